@@ -69,6 +69,21 @@ namespace CPUInfo
         cpuid(7, eax, ebx, ecx, edx);
         return (ebx >> 16) & 1;
     }
+
+    bool HasPCID() {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(1, eax, ebx, ecx, edx);
+        return (ecx >> 17) & 1;
+    }
+
+    bool HasINVPCID() {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0, eax, ebx, ecx, edx);
+        if (eax < 7) return false;
+
+        cpuid_count(7, 0, eax, ebx, ecx, edx);
+        return (ebx >> 10) & 1;
+    }
 }
 
 bool CPUInfo::IsAMD() {
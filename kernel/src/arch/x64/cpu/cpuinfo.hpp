@@ -49,6 +49,8 @@ namespace CPUInfo
     size_t GetCPUModel();
 
     // Memory info
+    bool HasPCID();
+    bool HasINVPCID();
     size_t GetVirtualBusWidth();
     size_t GetPhysicalBusWidth();
 };
@@ -0,0 +1,3 @@
+#include "percpu.hpp"
+
+cpu_local cpu_locals[CPU_MAX_COUNT] = {};
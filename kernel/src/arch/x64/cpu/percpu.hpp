@@ -0,0 +1,93 @@
+#ifndef KITTY_OS_CPP_PERCPU_HPP
+#define KITTY_OS_CPP_PERCPU_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define CPU_MAX_COUNT 64
+
+/*
+ * Structs
+ */
+struct cpu_local
+{
+    size_t cpu_id;
+    size_t interrupt_depth; // > 0 while running inside of interrupt_handler().
+    size_t irq_depth;       // > 0 while handling a hardware IRQ, not a syscall or an exception.
+    size_t numa_node;       // Node the CPU sits on, filled in by numa_init().
+};
+
+/*
+ * externs.
+ */
+extern cpu_local cpu_locals[CPU_MAX_COUNT];
+
+/*
+ * inline functions
+ */
+
+// APs aren't started yet, all kernel code runs on the BSP.
+inline size_t cpu_current_id()
+{
+    return 0;
+}
+
+inline cpu_local* cpu_this()
+{
+    return &cpu_locals[cpu_current_id()];
+}
+
+inline bool cpu_in_interrupt()
+{
+    return cpu_this()->interrupt_depth != 0;
+}
+
+inline void cpu_enter_interrupt()
+{
+    cpu_this()->interrupt_depth++;
+}
+
+inline void cpu_leave_interrupt()
+{
+    cpu_this()->interrupt_depth--;
+}
+
+inline bool cpu_in_irq()
+{
+    return cpu_this()->irq_depth != 0;
+}
+
+inline void cpu_enter_irq()
+{
+    cpu_this()->irq_depth++;
+}
+
+inline void cpu_leave_irq()
+{
+    cpu_this()->irq_depth--;
+}
+
+// Disables interrupts and returns the previous RFLAGS, pass it to cpu_restore_interrupts().
+inline uint64_t cpu_save_and_disable_interrupts()
+{
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+inline void cpu_restore_interrupts(uint64_t flags)
+{
+    if (flags & 0x200) asm volatile ("sti" ::: "memory");
+}
+
+inline bool cpu_interrupts_enabled()
+{
+    uint64_t flags;
+    asm volatile ("pushfq; pop %0" : "=r"(flags) :: "memory");
+    return flags & 0x200;
+}
+
+#endif //KITTY_OS_CPP_PERCPU_HPP
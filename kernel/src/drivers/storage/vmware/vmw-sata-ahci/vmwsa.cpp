@@ -4,10 +4,135 @@
 
 #include "vmwsa.hpp"
 
-static driver_handle_t vmwsa_entry([[maybe_unused]] pci_dev* dev)
+// Per-port command lists, received FIS areas and command tables come from these instead of whole pages.
+// Shared by every controller, set up by the first probe.
+static DMAPool vmwsa_cmd_list_pool;
+static DMAPool vmwsa_received_fis_pool;
+static DMAPool vmwsa_cmd_tbl_pool;
+static bool vmwsa_pools_ready = false;
+
+static bool vmwsa_init_pools()
+{
+    if (vmwsa_pools_ready) return true;
+
+    // The HBA might not support 64-bit addressing (CAP.S64A), keep everything below 4 GiB.
+    vmwsa_pools_ready = vmwsa_cmd_list_pool.init("ahci-cmd-list", AHCI_CMD_LIST_SIZE, AHCI_CMD_LIST_ALIGNMENT, DMA_NO_BOUNDARY, DMA_ADDRESS_LIMIT_32)
+            && vmwsa_received_fis_pool.init("ahci-fis", sizeof(HBA_FIS), AHCI_RECEIVED_FIS_ALIGNMENT, DMA_NO_BOUNDARY, DMA_ADDRESS_LIMIT_32)
+            && vmwsa_cmd_tbl_pool.init("ahci-cmd-tbl", AHCI_CMD_TBL_SIZE, AHCI_CMD_TBL_ALIGNMENT, DMA_NO_BOUNDARY, DMA_ADDRESS_LIMIT_32);
+
+    return vmwsa_pools_ready;
+}
+
+static void vmwsa_free_port(vmwsa_port* port)
+{
+    for (size_t i = 0; port->slot_count > i; i++) dma_free(port->cmd_tbls[i]);
+
+    dma_free(port->received_fis);
+    dma_free(port->cmd_list);
+
+    delete port;
+}
+
+// The command list and FIS base can only change while the port is idle (AHCI 1.3.1 section 10.1.2).
+static bool vmwsa_stop_port(HBA_PORT* regs)
+{
+    regs->cmd = regs->cmd & ~(AHCI_PxCMD_ST | AHCI_PxCMD_FRE);
+
+    for (size_t i = 0; AHCI_PORT_STOP_SPINS > i; i++)
+    {
+        if ((regs->cmd & (AHCI_PxCMD_CR | AHCI_PxCMD_FR)) == 0) return true;
+        asm volatile ("pause");
+    }
+
+    return false;
+}
+
+static vmwsa_port* vmwsa_setup_port(HBA_PORT* regs, size_t slot_count)
+{
+    if (!vmwsa_stop_port(regs)) return nullptr;
+
+    auto port = new vmwsa_port {};
+    port->regs = regs;
+
+    port->cmd_list = vmwsa_cmd_list_pool.alloc();
+    port->received_fis = vmwsa_received_fis_pool.alloc();
+    if (port->cmd_list.virt == nullptr || port->received_fis.virt == nullptr)
+    {
+        vmwsa_free_port(port);
+        return nullptr;
+    }
+
+    auto headers = static_cast<HBA_CMD_HEADER*>(port->cmd_list.virt);
+
+    for (; slot_count > port->slot_count; port->slot_count++)
+    {
+        dma_buffer& tbl = port->cmd_tbls[port->slot_count];
+
+        tbl = vmwsa_cmd_tbl_pool.alloc();
+        if (tbl.virt == nullptr)
+        {
+            vmwsa_free_port(port);
+            return nullptr;
+        }
+
+        headers[port->slot_count].ctba = static_cast<uint32_t>(tbl.phys);
+        headers[port->slot_count].ctbau = static_cast<uint32_t>(tbl.phys >> 32);
+    }
+
+    regs->clb = static_cast<uint32_t>(port->cmd_list.phys);
+    regs->clbu = static_cast<uint32_t>(port->cmd_list.phys >> 32);
+    regs->fb = static_cast<uint32_t>(port->received_fis.phys);
+    regs->fbu = static_cast<uint32_t>(port->received_fis.phys >> 32);
+
+    // Received FISes land in memory from now on, the command engine gets started once there's something to issue.
+    regs->cmd = regs->cmd | AHCI_PxCMD_FRE;
+
+    return port;
+}
+
+static driver_handle_t vmwsa_entry(pci_dev* dev)
 {
     kstd::printf("Initializing VMWSA device.\n");
-    return {};
+
+    if (dev == nullptr || !dev->is_pcie)
+    {
+        kstd::printf("[VMWSA] Only PCIe attached controllers are supported.\n");
+        return {};
+    }
+
+    // ABAR, the HBA registers. Uncached, it isn't prefetchable.
+    auto hba = static_cast<HBA_MEM*>(pcie_map_bar(dev, AHCI_ABAR_INDEX));
+    if (hba == nullptr)
+    {
+        kstd::printf("[VMWSA] Failed to map the ABAR.\n");
+        return {};
+    }
+
+    pcie_enable_mem_mastering(dev);
+    pcie_enable_bus_mastering(dev);
+
+    kstd::printf("[VMWSA] AHCI %x.%x, %u command slots, ports implemented: %x.\n", hba->vs >> 16, hba->vs & 0xFFFF, AHCI_CAP_SLOTS(hba->cap), hba->pi);
+
+    if (!vmwsa_init_pools()) return {};
+
+    // Port registers only work in AHCI mode.
+    hba->ghc = hba->ghc | AHCI_GHC_AE;
+
+    auto handle = new vmwsa_device_internal_handle {};
+    handle->ahci_bar = reinterpret_cast<uint64_t>(hba);
+    handle->device = dev;
+
+    size_t slot_count = AHCI_CAP_SLOTS(hba->cap);
+
+    for (size_t i = 0; AHCI_MAX_PORTS > i; i++)
+    {
+        if ((hba->pi & (1U << i)) == 0) continue;
+
+        handle->ports[i] = vmwsa_setup_port(&hba->ports[i], slot_count);
+        if (handle->ports[i] == nullptr) kstd::printf("[VMWSA] Port %zu couldn't be set up, skipping it.\n", i);
+    }
+
+    return { ._Handle = reinterpret_cast<uint64_t>(handle) };
 }
 
 static driver_status_t vmwsa_ioctl([[maybe_unused]] driver_handle_t* handle, [[maybe_unused]] uint64_t question, [[maybe_unused]] const char* buffer, [[maybe_unused]] char* answer)
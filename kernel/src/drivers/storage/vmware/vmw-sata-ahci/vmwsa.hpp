@@ -7,6 +7,8 @@
 
 #include <public/kdu/driver_entry.hpp>
 #include <mm/vmm.hpp>
+#include <mm/dma.hpp>
+#include <hal/bus/pci.hpp>
 #include <kstd/kstdio.hpp>
 
 typedef enum
@@ -172,12 +174,6 @@ typedef struct tagFIS_DMA_SETUP
 
 } FIS_DMA_SETUP;
 
-struct vmwsa_device_internal_handle
-{
-    uint64_t ahci_bar;
-    pci_dev* device;
-};
-
 typedef volatile struct tagHBA_PORT
 {
     uint32_t clb;		// 0x00, command list base address, 1K-byte aligned
@@ -305,4 +301,43 @@ typedef struct tagHBA_PRDT_ENTRY
     uint32_t i:1;		// Interrupt on completion
 } HBA_PRDT_ENTRY;
 
+// HBA registers, see AHCI 1.3.1 section 3.1.
+#define AHCI_ABAR_INDEX 5
+#define AHCI_CAP_SLOTS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_GHC_AE (1U << 31)
+
+// DMA layout of a port, see AHCI 1.3.1 section 4.2.
+#define AHCI_MAX_PORTS 32
+#define AHCI_CMD_SLOT_COUNT 32
+#define AHCI_CMD_LIST_SIZE (sizeof(HBA_CMD_HEADER) * AHCI_CMD_SLOT_COUNT)
+#define AHCI_CMD_LIST_ALIGNMENT 1024
+#define AHCI_RECEIVED_FIS_ALIGNMENT 256
+#define AHCI_PRDT_ENTRY_COUNT 8
+#define AHCI_CMD_TBL_SIZE (0x80 + sizeof(HBA_PRDT_ENTRY) * AHCI_PRDT_ENTRY_COUNT)
+#define AHCI_CMD_TBL_ALIGNMENT 128
+
+// Port command and status bits.
+#define AHCI_PxCMD_ST (1 << 0)
+#define AHCI_PxCMD_FRE (1 << 4)
+#define AHCI_PxCMD_FR (1 << 14)
+#define AHCI_PxCMD_CR (1 << 15)
+#define AHCI_PORT_STOP_SPINS 1000000 // The spec gives the engines 500 ms to stop.
+
+// DMA memory the HBA was pointed at for one port.
+struct vmwsa_port
+{
+    HBA_PORT* regs;
+    dma_buffer cmd_list;
+    dma_buffer received_fis;
+    dma_buffer cmd_tbls[AHCI_CMD_SLOT_COUNT];
+    size_t slot_count;
+};
+
+struct vmwsa_device_internal_handle
+{
+    uint64_t ahci_bar;
+    pci_dev* device;
+    vmwsa_port* ports[AHCI_MAX_PORTS];
+};
+
 #endif //KITTY_OS_CPP_VMWSA_HPP
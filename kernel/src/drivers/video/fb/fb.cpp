@@ -2,6 +2,7 @@
 // Created by Piotr on 02.05.2024.
 //
 
+#include <mm/pmm.hpp>
 #include "fb.hpp"
 
 namespace Framebuffer
@@ -28,6 +29,40 @@ namespace Framebuffer
 
         if (_Fbcount > 0)
         _MainFramebuffer = _Framebuffers[0];
+
+        // The framebuffer structures are in bootloader reclaimable memory, keep them.
+        pmm_keep_boot_memory(_Framebuffers, _Fbcount * sizeof(limine_framebuffer*));
+        for (size_t i = 0; _Fbcount > i; i++)
+        {
+            pmm_keep_boot_memory(_Framebuffers[i], sizeof(limine_framebuffer));
+            pmm_keep_boot_memory(_Framebuffers[i]->modes, _Framebuffers[i]->mode_count * sizeof(limine_video_mode*));
+
+            for (size_t j = 0; _Framebuffers[i]->mode_count > j; j++)
+            {
+                pmm_keep_boot_memory(_Framebuffers[i]->modes[j], sizeof(limine_video_mode));
+            }
+        }
+    }
+    void RemapHuge()
+    {
+        auto pml4e = vmm_make_virtual<struct pml4e*>(vmm_get_pml4());
+
+        for (size_t i = 0; _Fbcount > i; i++)
+        {
+            auto fb = _Framebuffers[i];
+
+            uint64_t start = reinterpret_cast<uint64_t>(fb->address) & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+            uint64_t end = reinterpret_cast<uint64_t>(fb->address) + fb->pitch * fb->height;
+
+            size_t pages = (end - start + PAGE_SIZE - 1) / PAGE_SIZE;
+
+            // Blits only ever write, write-combining turns them into full bursts instead of one bus cycle per pixel.
+            vmm_set_cache_range(pml4e, start, pages, MAP_CACHE_WC, MISC_NONE);
+
+            // Blits sweep the whole framebuffer, with 2 MiB pages that's a handful of TLB entries instead of thousands.
+            // The replaced tables are Limine's.
+            vmm_promote_range(pml4e, start, pages, MAP_GLOBAL, MISC_BOOT_TABLES | MISC_INVLPG);
+        }
     }
     void DrawPixel(size_t _FbIdx, size_t xpos, size_t ypos, uint8_t r, uint8_t g, uint8_t b)
     {
@@ -19,6 +19,7 @@ namespace Framebuffer
     extern size_t _Fbcount;
 
     void Initialize();
+    void RemapHuge(); // Remaps the framebuffers write-combining with global 2 MiB/1 GiB pages, needs the PMM.
     limine_framebuffer* GetFramebuffer(size_t _FbIdx);
     void DrawPixel(size_t _FbIdx, size_t xpos, size_t ypos, uint8_t r, uint8_t g, uint8_t b);
     uint32_t GetPixel(size_t _FbIdx, size_t xpos, size_t ypos);
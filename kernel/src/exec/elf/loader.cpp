@@ -11,137 +11,134 @@ elf_object_t* elf_create_object(void* elf_bin, size_t elf_bin_size)
     obj->elf_bin = elf_bin;
     obj->elf_bin_size = elf_bin_size;
 
-    // Allocate new PML4e.
-    uint64_t pml4e_pa = pmm_alloc_page();
-    if (!pml4e_pa) {
-        kstd::printf("Failed to allocate PML4e page.\n");
+    // Fresh PML4 with an empty lower half, the kernel half comes with it.
+    obj->space = address_space_create();
+    if (!obj->space) {
+        kstd::printf("Failed to create the address space.\n");
         delete obj;
         return nullptr;
     }
 
-    auto pml4e_va = vmm_make_virtual<uint8_t*>(pml4e_pa);
-    if (!pml4e_va) {
-        kstd::printf("Failed to map PML4e virtual address.\n");
-        pmm_free_page(pml4e_pa);
-        delete obj;
-        return nullptr;
-    }
-
-    obj->pml4e_dir_physical = pml4e_pa;
-
-    // Clear pml4e
-    for (size_t i = 0; i < 4096; i++)
-        pml4e_va[i] = 0x0;
-
-    // Copy last 256 entries of kernel pml4e to this pml4e.
-    pml4e* kernel_pml4e = vmm_make_virtual<pml4e*>(vmm_get_pml4());
-    if (!kernel_pml4e) {
-        kstd::printf("Failed to map kernel PML4e virtual address.\n");
-        pmm_free_page(pml4e_pa);
-        delete obj;
-        return nullptr;
-    }
-
-    pml4e* program_pml4e = reinterpret_cast<pml4e*>(pml4e_va);
-
-    for (size_t i = 0; i < 512; i++)
-    {
-        program_pml4e[i] = kernel_pml4e[i];
-    }
-
-    kstd::printf("Copied PML4e over to program's PML4e.\n");
-
-    obj->pml4e_dir = program_pml4e;
+    obj->pml4e_dir = obj->space->get_pml4();
+    obj->pml4e_dir_physical = obj->space->get_cr3() & ~PCID_CR3_MASK;
+    obj->pcid = obj->space->get_cr3() & PCID_CR3_MASK;
 
     return obj;
 }
 
-void elf_move_data(elf_object_t* obj, uint64_t virtual_address, void* data, size_t len)
+// Frames mapped per vmm_map_frames() call.
+constexpr size_t elf_map_batch = 64;
+
+// Copies a segment's file contents into the object's address space. False if there's no memory for it.
+static bool elf_move_data(elf_object_t* obj, uint64_t virtual_address, void* data, size_t len)
 {
-    size_t pages = (len + 4095) / PAGE_SIZE; // Calculate number of pages needed
+    // Segments don't have to start on a page boundary, map from the page they start in.
+    uint64_t offset = virtual_address % PAGE_SIZE;
+    uint64_t base_address = virtual_address - offset;
+
+    size_t pages = (offset + len + 4095) / PAGE_SIZE; // Calculate number of pages needed
     kstd::printf("required pages: %lx\n", pages);
     kstd::printf("%p -> %lx (%ld)\n", data, virtual_address, len);
 
-    if (pages == 0)
+    if (len == 0)
     {
         kstd::printf("ignoring this entry\n");
-        return;
+        return true;
     }
 
-    uint64_t original_virtual_address = virtual_address; // Save the starting virtual address
+    // Check bounds
+    if (reinterpret_cast<uint8_t*>(data) + len > reinterpret_cast<uint8_t*>(obj->elf_bin) + obj->elf_bin_size) {
+        kstd::printf("Data to move exceeds ELF binary bounds.\n");
+        return false;
+    }
 
-    vmm_address va = vmm_split_va(virtual_address);
-    size_t pml4e = va.pml4e;
-    size_t pdpe = va.pdpe;
-    size_t pde = va.pde;
-    size_t pte = va.pte;
-    size_t off = va.offset;
+    auto d = reinterpret_cast<uint8_t*>(data);
+    size_t copied = 0;
+    uint64_t frames[elf_map_batch];
+    bool fresh[elf_map_batch];
 
-    for (size_t i = 0; i < pages; i++)
+    for (size_t done = 0; pages > done;)
     {
-        uint64_t page = pmm_alloc_page();
-        if (!page) {
-            kstd::printf("Failed to allocate page.\n");
-            return;
-        }
+        size_t batch = pages - done < elf_map_batch ? pages - done : elf_map_batch;
+        uint64_t batch_address = base_address + done * PAGE_SIZE;
+        size_t allocated = 0;
 
-        if (!vmm_map(obj->pml4e_dir, virtual_address, page, PROT_RW | PROT_SUPERVISOR, MAP_PRESENT, MISC_INVLPG)) {
-            kstd::printf("Failed to map virtual address.\n");
-            return;
+        // The first and last page may be shared with the segment before or after, those are mapped already.
+        for (; batch > allocated; allocated++)
+        {
+            uint64_t mapped = vmm_virt_to_phys(obj->pml4e_dir, batch_address + allocated * PAGE_SIZE);
+
+            // Zeroed, so whatever the segment doesn't cover in its first and last page reads as 0.
+            fresh[allocated] = mapped == 0;
+            frames[allocated] = mapped != 0 ? mapped : pmm_alloc_zeroed_page();
+
+            if (frames[allocated] == 0) break;
         }
 
-        pte++;
-        if (pte >= 512)
+        // Runs of fresh frames, one mapping call each.
+        bool ok = allocated == batch;
+
+        for (size_t i = 0; ok && batch > i;)
         {
-            pte = 0;
-            pde++;
+            size_t run = 0;
+            while (batch > i + run && fresh[i + run]) run++;
+
+            if (run != 0) ok = vmm_map_frames(obj->pml4e_dir, batch_address + i * PAGE_SIZE, &frames[i], run, PROT_RW | PROT_SUPERVISOR, MAP_PRESENT, MISC_INVLPG);
+
+            i += run != 0 ? run : 1;
         }
-        if (pde >= 512)
-        {
-            pde = 0;
-            pdpe++;
+
+        if (!ok) {
+            // What did get mapped goes with the address space, the rest is freed here.
+            for (size_t i = 0; allocated > i; i++)
+            {
+                if (fresh[i] && vmm_virt_to_phys(obj->pml4e_dir, batch_address + i * PAGE_SIZE) == 0) pmm_free_page(frames[i]);
+            }
+
+            kstd::printf("Out of memory mapping the segment at %lx.\n", virtual_address);
+            return false;
         }
-        if (pdpe >= 512)
+
+        // Move the memory now. Through the HHDM, the object's address space isn't the one we're running on.
+        for (size_t i = 0; batch > i; i++)
         {
-            pdpe = 0;
-            pml4e++;
-        }
+            size_t page_offset = (done + i == 0) ? offset : 0;
+            size_t chunk = PAGE_SIZE - page_offset;
+            if (chunk > len - copied) chunk = len - copied;
 
-        va.pml4e = pml4e;
-        va.pdpe = pdpe;
-        va.pde = pde;
-        va.pte = pte;
-        va.offset = off;
+            kstd::memcpy(vmm_make_virtual<uint8_t*>(frames[i]) + page_offset, d + copied, chunk);
+            copied += chunk;
+        }
 
-        virtual_address = vmm_sva_to_va(va);
-        kstd::printf("new VA: %lx\n", virtual_address);
+        done += batch;
     }
 
-    // Move the memory now.
-    auto d = reinterpret_cast<uint8_t*>(data);
-    auto v = reinterpret_cast<uint8_t*>(original_virtual_address); // Use the original virtual address
+    kstd::printf("Moved %ld bytes to %lx from %p.\n", len, virtual_address, data);
 
-    // Check bounds
-    if (reinterpret_cast<uint8_t*>(data) + len > reinterpret_cast<uint8_t*>(obj->elf_bin) + obj->elf_bin_size) {
-        kstd::printf("Data to move exceeds ELF binary bounds.\n");
-        return;
-    }
+    return true;
+}
 
-    for (size_t i = 0; i < len; i++)
-    {
-        v[i] = d[i];
-    }
+// Adds the pages of a segment that aren't in an area yet. Segments may share their first or last page
+// with the one before or after, that page is already in its area.
+static bool elf_add_segment_area(elf_object_t* obj, uint64_t virtual_address, size_t len)
+{
+    uint64_t start = virtual_address & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+    uint64_t end = (virtual_address + len + PAGE_SIZE - 1) & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+    vm_area area {};
+
+    if (obj->space->find_area(start, &area)) start = area.end;
+    if (end > start && obj->space->find_area(end - 1, &area)) end = area.start;
 
-    kstd::printf("Moved %ld bytes to %lx from %p.\n", len, original_virtual_address, data);
+    return start >= end || obj->space->add_area(start, end - start, PROT_RW | PROT_SUPERVISOR, VM_AREA_ANONYMOUS);
 }
 
-void elf_load_object(elf_object_t* obj) {
+bool elf_load_object(elf_object_t* obj) {
     kstd::printf("ELF Header:\n");
     elf_header_64* hdr = reinterpret_cast<elf_header_64*>(obj->elf_bin);
 
     if (hdr->magic[0] != 0x7F || hdr->magic[1] != 'E' || hdr->magic[2] != 'L' || hdr->magic[3] != 'F') {
         kstd::printf("Invalid ELF magic.\n");
-        return;
+        return false;
     }
 
     kstd::printf("  Magic:   ");
@@ -178,23 +175,23 @@ void elf_load_object(elf_object_t* obj) {
 
     if (hdr->endianess != 1) {
         kstd::printf("Endianness is wrong.\n");
-        return;
+        return false;
     }
 
     if (hdr->os_abi != 0) {
         kstd::printf("OS abi isn't SYS-V.\n");
-        return;
+        return false;
     }
 
     if (hdr->type != 2) {
         kstd::printf("This is not an executable!.\n");
         kstd::printf("Type is: %hx\n", hdr->type);
-        return;
+        return false;
     }
 
     if (hdr->elf_version != 1) {
         kstd::printf("Elf version isn't equal to 1.\n");
-        return;
+        return false;
     }
 
     uint64_t program_entry_size = hdr->sizeof_entry_in_program_hdr_table;
@@ -206,6 +203,8 @@ void elf_load_object(elf_object_t* obj) {
 
     obj->start = hdr->program_entry_offset;
 
+    uint64_t brk_base = 0;
+
     // Iterate through each program header entry
     for (size_t i = 0; i < program_entry_count; i++) {
         // Calculate the offset of the current program header entry
@@ -214,29 +213,52 @@ void elf_load_object(elf_object_t* obj) {
         // Retrieve the program header entry
         auto program_entry = reinterpret_cast<elf_segment*>(reinterpret_cast<size_t>(obj->elf_bin) + entry_offset);
 
+        if (program_entry->type != 1) {
+            bochs_breakpoint();
+            continue;
+        }
+
+        // A segment that isn't loaded leaves the image broken, the whole object fails.
         if (program_entry->p_offset + program_entry->p_filesz > obj->elf_bin_size) {
             kstd::printf("Program segment exceeds ELF binary bounds.\n");
-            continue;
+            return false;
+        }
+
+        // Whatever is past p_filesz (.bss) gets zero filled on the first touch.
+        if (!elf_add_segment_area(obj, program_entry->p_vaddr, program_entry->p_memsz)) {
+            kstd::printf("Program segment at %lx overlaps another mapping or is out of range.\n", program_entry->p_vaddr);
+            return false;
         }
 
-        if (program_entry->type == 1) {
-            elf_move_data(obj, program_entry->p_vaddr, reinterpret_cast<void*>(reinterpret_cast<size_t>(obj->elf_bin) + program_entry->p_offset), program_entry->p_filesz);
+        if (program_entry->p_vaddr + program_entry->p_memsz > brk_base) brk_base = program_entry->p_vaddr + program_entry->p_memsz;
+
+        if (!elf_move_data(obj, program_entry->p_vaddr, reinterpret_cast<void*>(reinterpret_cast<size_t>(obj->elf_bin) + program_entry->p_offset), program_entry->p_filesz)) {
+            return false;
         }
+
         bochs_breakpoint();
     }
+
+    if (brk_base != 0) obj->space->set_brk_base(brk_base);
+
+    return true;
 }
 
 void elf_invoke_object(elf_object_t* obj)
 {
     kstd::printf("Invoking the object.\n");
 
-    elf_trampoline(obj->pml4e_dir_physical, obj->start);
+    uint64_t kernel_cr3 = vmm_read_cr3();
+
+    elf_trampoline(pcid_switch_cr3(obj->pml4e_dir_physical | obj->pcid), obj->start);
+
+    // Back to the kernel's tables, the object's PML4 goes away with elf_destroy_object().
+    vmm_write_cr3(pcid_switch_cr3(kernel_cr3));
 }
 
 void elf_destroy_object(elf_object_t* obj)
 {
-    // Don't forget to free everything in the way of first 256 entries of PML4e!
-
-    pmm_free_page(reinterpret_cast<uint64_t>(obj->pml4e_dir_physical));
+    // Unmapping the areas frees the frames and the lower half tables with them.
+    address_space_free(obj->space);
     delete obj;
 }
\ No newline at end of file
@@ -8,8 +8,10 @@
 
 #include <mm/vmm.hpp>
 #include <mm/pmm.hpp>
+#include <mm/pcid.hpp>
+#include <mm/address_space.hpp>
 
-extern "C" void elf_trampoline(uint64_t new_pml4e, uint64_t new_address);
+extern "C" void elf_trampoline(uint64_t new_cr3, uint64_t new_address);
 
 struct elf_object_t
 {
@@ -17,14 +19,16 @@ struct elf_object_t
     size_t elf_bin_size;
     pml4e* pml4e_dir;
     uint64_t pml4e_dir_physical;
+    uint16_t pcid;
+    AddressSpace* space;
     uint64_t start;
 };
 
 /// Create new ELF object.
 elf_object_t* elf_create_object(void* elf_bin, size_t elf_bin_size);
 
-/// Load the object to the memory.
-void elf_load_object(elf_object_t* obj);
+/// Load the object to the memory. False if a segment couldn't be loaded, destroy the object then.
+bool elf_load_object(elf_object_t* obj);
 
 /// Execute the object.
 void elf_invoke_object(elf_object_t* obj);
@@ -4,11 +4,9 @@ section .text
 
 global elf_trampoline
 
+; rdi = CR3 value (PML4 | PCID), rsi = entry point.
 elf_trampoline:
-    mov rax, cr3
-    and rax, 0xfff
-    or rax, rdi
-    mov cr3, rax
+    mov cr3, rdi
 
     xchg bx, bx
 
@@ -51,6 +51,9 @@ void acpi_parse_mcfg(acpi_mcfg* _mcfg_table)
 
     mcfg_table = _mcfg_table;
 
+    // Kept around after boot, don't let the PMM reclaim it.
+    pmm_keep_boot_memory(_mcfg_table, _mcfg_table->common.length);
+
     kstd::printf("[ACPI] [MCFG] Done!\n");
 }
 
@@ -62,6 +65,9 @@ void acpi_parse_madt(acpi_madt* _madt_table)
 
     madt_table = _madt_table;
 
+    // Kept around after boot, don't let the PMM reclaim it.
+    pmm_keep_boot_memory(_madt_table, _madt_table->common.length);
+
     kstd::printf("[ACPI] [MADT] Done!\n");
 }
 
@@ -71,6 +77,9 @@ void acpi_parse_fadt(acpi_fadt* _fadt_table)
 
     fadt_table = _fadt_table;
 
+    // Kept around after boot, don't let the PMM reclaim it.
+    pmm_keep_boot_memory(_fadt_table, _fadt_table->common.length);
+
     kstd::printf("[ACPI] [FADT] Done!\n");
 }
 
@@ -79,6 +88,31 @@ acpi_madt* acpi_get_madt()
     return madt_table;
 }
 
+acpi_sdt_common* acpi_find_table(const char* signature)
+{
+    if (acpi_rsdp_request.response == nullptr) return nullptr;
+
+    auto rsdp = reinterpret_cast<acpi_rsdp*>(acpi_rsdp_request.response->address);
+
+    // Prefer the XSDT, its entries are 64-bit.
+    bool extended = rsdp->revision >= 2 && rsdp->xsdt_address != 0;
+    auto root = vmm_make_virtual<acpi_sdt_common*>(extended ? rsdp->xsdt_address : rsdp->rsdt_address);
+    auto entries = reinterpret_cast<uint8_t*>(root) + sizeof(acpi_sdt_common);
+    size_t entry_size = extended ? 8 : 4;
+    size_t count = (root->length - sizeof(acpi_sdt_common)) / entry_size;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t address = 0;
+        kstd::memcpy(&address, entries + i * entry_size, entry_size);
+
+        auto sdt = vmm_make_virtual<acpi_sdt_common*>(address);
+        if (kstd::memcmp(&sdt->signature, signature, 4) == 0) return sdt;
+    }
+
+    return nullptr;
+}
+
 void acpi_init()
 {
     kstd::printf("[ACPI] Initializing...\n");
@@ -181,8 +181,74 @@ struct acpi_xsdt
     // At the end of this we have table pointers that are 64-bit
 };
 
+struct acpi_srat
+{
+    acpi_sdt_common common;
+    uint32_t reserved1;     // Must be 1.
+    uint64_t reserved2;
+    // After this we got static resource affinity structures
+} __attribute__((packed));
+
+struct acpi_srat_entry
+{
+    uint8_t entry_type;
+    uint8_t entry_length;
+} __attribute__((packed));
+
+#define ACPI_SRAT_LAPIC_AFFINITY 0
+#define ACPI_SRAT_MEMORY_AFFINITY 1
+#define ACPI_SRAT_X2APIC_AFFINITY 2
+
+#define ACPI_SRAT_ENABLED (1 << 0)
+#define ACPI_SRAT_MEMORY_HOT_PLUGGABLE (1 << 1)
+
+struct acpi_srat_lapic_affinity
+{
+    acpi_srat_entry header;
+    uint8_t proximity_domain_low;
+    uint8_t apic_id;
+    uint32_t flags;
+    uint8_t sapic_eid;
+    uint8_t proximity_domain_high[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct acpi_srat_memory_affinity
+{
+    acpi_srat_entry header;
+    uint32_t proximity_domain;
+    uint16_t reserved1;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed));
+
+struct acpi_srat_x2apic_affinity
+{
+    acpi_srat_entry header;
+    uint16_t reserved1;
+    uint32_t proximity_domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+} __attribute__((packed));
+
+struct acpi_slit
+{
+    acpi_sdt_common common;
+    uint64_t locality_count;
+    // After this we got locality_count * locality_count distance bytes
+} __attribute__((packed));
+
 void acpi_init();
 
+// Looks the table up straight from the RSDP, so it can be used before acpi_init() (only needs the HHDM).
+// Returns nullptr if the table isn't there.
+acpi_sdt_common* acpi_find_table(const char* signature);
+
 acpi_mcfg* acpi_get_mcfg();
 acpi_madt* acpi_get_madt();
 acpi_fadt* acpi_get_fadt();
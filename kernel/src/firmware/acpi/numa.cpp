@@ -0,0 +1,253 @@
+#include <kstd/kstdio.hpp>
+#include <hal/x64/cpuid.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include "acpi.hpp"
+#include "numa.hpp"
+
+struct numa_cpu_affinity
+{
+    uint32_t apic_id;
+    size_t node;
+};
+
+static size_t numa_node_count = 1;
+static uint32_t numa_node_domains[NUMA_MAX_NODES] = { 0 };  // Node -> proximity domain.
+
+static numa_memory_range numa_memory_ranges[NUMA_MAX_MEMORY_RANGES];
+static size_t numa_memory_range_count = 0;
+
+static numa_cpu_affinity numa_cpus[NUMA_MAX_CPUS];
+static size_t numa_cpu_count = 0;
+
+static uint8_t numa_distances[NUMA_MAX_NODES][NUMA_MAX_NODES];
+static size_t numa_fallback_orders[NUMA_MAX_NODES][NUMA_MAX_NODES];
+
+// Proximity domains can be any 32-bit value, nodes are numbered densely in order of appearance.
+// Returns NUMA_MAX_NODES if there's no room for another node.
+static size_t numa_node_for_domain(uint32_t domain)
+{
+    for (size_t i = 0; i < numa_node_count; i++)
+    {
+        if (numa_node_domains[i] == domain) return i;
+    }
+
+    if (numa_node_count >= NUMA_MAX_NODES)
+    {
+        kstd::printf("[NUMA] Too many proximity domains, domain %u is ignored.\n", domain);
+        return NUMA_MAX_NODES;
+    }
+
+    numa_node_domains[numa_node_count] = domain;
+    return numa_node_count++;
+}
+
+static void numa_add_cpu(uint32_t apic_id, uint32_t domain)
+{
+    size_t node = numa_node_for_domain(domain);
+    if (node == NUMA_MAX_NODES || numa_cpu_count >= NUMA_MAX_CPUS) return;
+
+    numa_cpus[numa_cpu_count++] = { .apic_id = apic_id, .node = node };
+}
+
+static void numa_add_memory(const acpi_srat_memory_affinity* entry)
+{
+    if (!(entry->flags & ACPI_SRAT_ENABLED) || entry->length == 0) return;
+
+    size_t node = numa_node_for_domain(entry->proximity_domain);
+    if (node == NUMA_MAX_NODES) return;
+
+    if (numa_memory_range_count >= NUMA_MAX_MEMORY_RANGES)
+    {
+        kstd::printf("[NUMA] Too many memory ranges, %lx - %lx is ignored.\n", entry->base_address, entry->base_address + entry->length);
+        return;
+    }
+
+    numa_memory_ranges[numa_memory_range_count++] = {
+            .base = entry->base_address,
+            .length = entry->length,
+            .node = node
+    };
+}
+
+static void numa_parse_srat(acpi_srat* srat)
+{
+    kstd::printf("[ACPI] [SRAT] Parsing SRAT table...\n");
+
+    // The first node is the one the first domain we see maps to, start from an empty list.
+    numa_node_count = 0;
+
+    auto entries = reinterpret_cast<uint8_t*>(srat);
+    size_t offset = sizeof(acpi_srat);
+
+    while (offset + sizeof(acpi_srat_entry) <= srat->common.length)
+    {
+        auto entry = reinterpret_cast<acpi_srat_entry*>(entries + offset);
+        if (entry->entry_length == 0) break;
+
+        switch (entry->entry_type)
+        {
+            case ACPI_SRAT_LAPIC_AFFINITY:
+            {
+                auto lapic = reinterpret_cast<acpi_srat_lapic_affinity*>(entry);
+                if (!(lapic->flags & ACPI_SRAT_ENABLED)) break;
+
+                uint32_t domain = lapic->proximity_domain_low | (lapic->proximity_domain_high[0] << 8) |
+                                  (lapic->proximity_domain_high[1] << 16) | (lapic->proximity_domain_high[2] << 24);
+                numa_add_cpu(lapic->apic_id, domain);
+                break;
+            }
+            case ACPI_SRAT_MEMORY_AFFINITY:
+                numa_add_memory(reinterpret_cast<acpi_srat_memory_affinity*>(entry));
+                break;
+            case ACPI_SRAT_X2APIC_AFFINITY:
+            {
+                auto x2apic = reinterpret_cast<acpi_srat_x2apic_affinity*>(entry);
+                if (!(x2apic->flags & ACPI_SRAT_ENABLED)) break;
+
+                numa_add_cpu(x2apic->x2apic_id, x2apic->proximity_domain);
+                break;
+            }
+            default:
+                break;
+        }
+
+        offset += entry->entry_length;
+    }
+
+    if (numa_node_count == 0) numa_node_count = 1;
+
+    kstd::printf("[ACPI] [SRAT] Nodes: %zu, memory ranges: %zu, CPUs: %zu.\n", numa_node_count, numa_memory_range_count, numa_cpu_count);
+    kstd::printf("[ACPI] [SRAT] Done!\n");
+}
+
+static void numa_parse_slit(acpi_slit* slit)
+{
+    kstd::printf("[ACPI] [SLIT] Parsing SLIT table...\n");
+
+    auto matrix = reinterpret_cast<uint8_t*>(slit) + sizeof(acpi_slit);
+
+    for (size_t from = 0; from < numa_node_count; from++)
+    {
+        for (size_t to = 0; to < numa_node_count; to++)
+        {
+            uint64_t from_domain = numa_node_domains[from];
+            uint64_t to_domain = numa_node_domains[to];
+
+            if (from_domain >= slit->locality_count || to_domain >= slit->locality_count) continue;
+
+            numa_distances[from][to] = matrix[from_domain * slit->locality_count + to_domain];
+        }
+    }
+
+    kstd::printf("[ACPI] [SLIT] Done!\n");
+}
+
+// Sort key of `other` in the fallback order of `node`, the node itself always goes first.
+static uint32_t numa_fallback_key(size_t node, size_t other)
+{
+    return other == node ? 0 : numa_distances[node][other] + 1;
+}
+
+// Simple insertion sort, there's at most NUMA_MAX_NODES nodes.
+static void numa_build_fallback_order(size_t node)
+{
+    size_t* order = numa_fallback_orders[node];
+
+    for (size_t i = 0; i < numa_node_count; i++)
+    {
+        size_t j = i;
+        while (j > 0 && numa_fallback_key(node, order[j - 1]) > numa_fallback_key(node, i))
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+}
+
+static uint32_t numa_get_bsp_apic_id()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, eax, ebx, ecx, edx);
+    return ebx >> 24;
+}
+
+void numa_init()
+{
+    // Defaults for a machine without SRAT/SLIT: one node holding everything.
+    for (size_t from = 0; from < NUMA_MAX_NODES; from++)
+    {
+        for (size_t to = 0; to < NUMA_MAX_NODES; to++)
+        {
+            numa_distances[from][to] = from == to ? NUMA_LOCAL_DISTANCE : NUMA_REMOTE_DISTANCE;
+        }
+    }
+
+    auto srat = reinterpret_cast<acpi_srat*>(acpi_find_table("SRAT"));
+    if (srat != nullptr)
+    {
+        numa_parse_srat(srat);
+
+        auto slit = reinterpret_cast<acpi_slit*>(acpi_find_table("SLIT"));
+        if (slit != nullptr) numa_parse_slit(slit);
+    }
+    else
+    {
+        kstd::printf("[NUMA] No SRAT, assuming a single node.\n");
+    }
+
+    for (size_t node = 0; node < numa_node_count; node++)
+    {
+        numa_build_fallback_order(node);
+
+        kstd::printf("[NUMA] Node %zu (domain %u) distances:", node, numa_node_domains[node]);
+        for (size_t to = 0; to < numa_node_count; to++)
+        {
+            kstd::printf(" %u", numa_distances[node][to]);
+        }
+        kstd::printf("\n");
+    }
+
+    cpu_this()->numa_node = numa_get_cpu_node(numa_get_bsp_apic_id());
+}
+
+size_t numa_get_node_count()
+{
+    return numa_node_count;
+}
+
+size_t numa_get_memory_range_count()
+{
+    return numa_memory_range_count;
+}
+
+const numa_memory_range* numa_get_memory_range(size_t idx)
+{
+    if (idx >= numa_memory_range_count) return nullptr;
+
+    return &numa_memory_ranges[idx];
+}
+
+uint8_t numa_get_distance(size_t from, size_t to)
+{
+    if (from >= numa_node_count || to >= numa_node_count) return NUMA_REMOTE_DISTANCE;
+
+    return numa_distances[from][to];
+}
+
+const size_t* numa_get_fallback_order(size_t node)
+{
+    if (node >= numa_node_count) node = 0;
+
+    return numa_fallback_orders[node];
+}
+
+size_t numa_get_cpu_node(uint32_t apic_id)
+{
+    for (size_t i = 0; i < numa_cpu_count; i++)
+    {
+        if (numa_cpus[i].apic_id == apic_id) return numa_cpus[i].node;
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef KITTY_OS_CPP_NUMA_HPP
+#define KITTY_OS_CPP_NUMA_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define NUMA_MAX_NODES 8
+#define NUMA_MAX_MEMORY_RANGES 32
+#define NUMA_MAX_CPUS 256
+#define NUMA_LOCAL_DISTANCE 10  // SLIT distance of a node to itself.
+#define NUMA_REMOTE_DISTANCE 20 // Assumed distance between nodes when there's no SLIT.
+
+/*
+ * Structs
+ */
+struct numa_memory_range
+{
+    uint64_t base;
+    uint64_t length;
+    size_t node;
+};
+
+/*
+ * Global function definitions
+ */
+
+// Parses SRAT and SLIT. Has to run before pmm_init(), needs only the HHDM.
+// Without SRAT the machine is treated as a single node.
+void numa_init();
+
+size_t numa_get_node_count();
+size_t numa_get_memory_range_count();
+const numa_memory_range* numa_get_memory_range(size_t idx);
+
+// Distance between two nodes, NUMA_LOCAL_DISTANCE for the node itself.
+uint8_t numa_get_distance(size_t from, size_t to);
+
+// Nodes ordered by their distance from `node`, starting with `node` itself.
+// Holds numa_get_node_count() entries.
+const size_t* numa_get_fallback_order(size_t node);
+
+// Node of the CPU with the given (x2)APIC ID, 0 if SRAT doesn't say.
+size_t numa_get_cpu_node(uint32_t apic_id);
+
+#endif //KITTY_OS_CPP_NUMA_HPP
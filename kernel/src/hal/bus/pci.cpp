@@ -4,6 +4,7 @@
 
 #include <public/kdu/driver_ctrl.hpp>
 #include <kstd/kstring.hpp>
+#include <mm/address_space.hpp>
 #include "pci.hpp"
 
 static bool is_pci_initialized = false;
@@ -180,6 +181,72 @@ void pcie_enable_mem_mastering(pci_dev* dev)
     *mmio |= (1 << 1);
 }
 
+void* pcie_map_bar(pci_dev* dev, size_t index, size_t* size)
+{
+    if (!dev->is_pcie || (dev->header_type & 0x7F) != PCI_HEADER_DEVICE || index >= PCI_BAR_COUNT) return nullptr;
+
+    auto config = reinterpret_cast<volatile uint32_t*>(pcie_create_mmio(dev->str, dev->bus, dev->slot, dev->function, 0) + vmm_hhdm->offset);
+    volatile uint32_t* bar = &config[offsetof(pci_dev_header, bars) / sizeof(uint32_t) + index];
+
+    uint32_t low = bar[0];
+    if (low & PCI_BAR_IO) return nullptr;
+
+    bool is_64 = (low & PCI_BAR_TYPE_MASK) == PCI_BAR_TYPE_64;
+    if (is_64 && index + 1 >= PCI_BAR_COUNT) return nullptr;
+
+    uint32_t high = is_64 ? bar[1] : 0;
+
+    // Writing all ones reads back the size as the bits that stay zero, decoding is off meanwhile
+    // so the device doesn't answer at the bogus address.
+    auto command = reinterpret_cast<volatile uint16_t*>(&config[1]);
+    uint16_t saved_command = *command;
+    *command = saved_command & ~(PCI_COMMAND_IO | PCI_COMMAND_MEMORY);
+
+    bar[0] = 0xFFFFFFFF;
+    uint64_t mask = bar[0] & PCI_BAR_MEMORY_MASK;
+    bar[0] = low;
+
+    if (is_64)
+    {
+        bar[1] = 0xFFFFFFFF;
+        mask |= static_cast<uint64_t>(bar[1]) << 32;
+        bar[1] = high;
+    }
+    else if (mask != 0)
+    {
+        mask |= 0xFFFFFFFF00000000ULL;
+    }
+
+    *command = saved_command;
+
+    uint64_t base = (low & PCI_BAR_MEMORY_MASK) | (static_cast<uint64_t>(high) << 32);
+    if (mask == 0 || base == 0) return nullptr;
+
+    uint64_t length = ~mask + 1;
+    uint64_t phys = base & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+    size_t pages = (base - phys + length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // Big BARs are aligned to their size, 2 MiB aligned addresses let them use 2 MiB pages.
+    uint64_t alignment = pages >= VMM_PAGES_PER_2M ? VMM_PAGES_PER_2M * PAGE_SIZE : PAGE_SIZE;
+    int prot_flags = PROT_RW | PROT_SUPERVISOR | PROT_NOEXEC;
+    int cache = low & PCI_BAR_PREFETCHABLE ? MAP_CACHE_WC : MAP_CACHE_UC;
+
+    // An area of its own (reserve() never merges), releasing it can't take a neighbouring BAR along.
+    AddressSpace* kernel = address_space_kernel();
+    uint64_t virt = kernel->reserve(pages * PAGE_SIZE, alignment, prot_flags, VM_AREA_IO);
+    if (virt == 0) return nullptr;
+
+    if (!vmm_map_range(kernel->get_pml4(), virt, phys, pages, prot_flags, MAP_PRESENT | MAP_GLOBAL | cache, MISC_INVLPG))
+    {
+        kernel->release(virt, pages * PAGE_SIZE);
+        return nullptr;
+    }
+
+    if (size != nullptr) *size = length;
+
+    return reinterpret_cast<void*>(virt + (base - phys));
+}
+
 void pci_dump_database()
 {
     for (size_t i = 0; pci_db_count > i; i++)
@@ -78,7 +78,7 @@ struct pci_dev_hdr_common
 struct pci_dev_header
 {
     struct pci_dev_hdr_common hdr;
-    uint32_t bars[5];
+    uint32_t bars[6];
     uint32_t cardbus_cis_pointer;
     uint16_t subsystem_vendor_id;
     uint16_t subsystem_id;
@@ -102,6 +102,18 @@ struct pci_db_entry
     const char* name;
 };
 
+// Command register bits.
+#define PCI_COMMAND_IO (1 << 0)
+#define PCI_COMMAND_MEMORY (1 << 1)
+
+// Low bits of a BAR.
+#define PCI_BAR_COUNT 6
+#define PCI_BAR_IO (1 << 0)
+#define PCI_BAR_TYPE_MASK (3 << 1)
+#define PCI_BAR_TYPE_64 (2 << 1)    // Takes the next BAR as its upper half.
+#define PCI_BAR_PREFETCHABLE (1 << 3)
+#define PCI_BAR_MEMORY_MASK 0xFFFFFFF0U
+
 constexpr uint32_t PCI_CFG_ADDR = 0xCF8;
 constexpr uint32_t PCI_CFG_DATA = 0xCFC;
 
@@ -119,6 +131,11 @@ void pcie_enable_bus_mastering(pci_dev* dev);
 void pcie_enable_io_mastering(pci_dev* dev);
 void pcie_enable_mem_mastering(pci_dev* dev);
 
+// Maps memory BAR `index` into the kernel half: write-combining if it's prefetchable, uncached otherwise.
+// nullptr for IO BARs, unimplemented ones or if there's no room. `size` gets the BAR's size if it isn't nullptr.
+// Every BAR is a VM_AREA_IO area of its own in the kernel's space.
+void* pcie_map_bar(pci_dev* dev, size_t index, size_t* size = nullptr);
+
 void pci_dump_database();
 void pci_enumerate_devices();
 
@@ -14,4 +14,12 @@ inline void cpuid(uint32_t function, uint32_t& eax, uint32_t& ebx, uint32_t& ecx
             : "a" (function));
 }
 
+// For leaves with subleaves (e.g. 7), `subleaf` goes in ecx.
+inline void cpuid_count(uint32_t function, uint32_t subleaf, uint32_t& eax, uint32_t& ebx, uint32_t& ecx, uint32_t& edx)
+{
+    asm volatile ("cpuid"
+            : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+            : "a" (function), "c" (subleaf));
+}
+
 #endif //KITTY_OS_CPP_CPUID_HPP
@@ -65,8 +65,15 @@ isr_common:
     lea rdi, [rsp]   ; Address of the saved registers
     call interrupt_handler
 
+    ; Only reload CR3 when the scheduler switched address spaces, a reload flushes the TLB.
+    ; Bit 63 (keep the PCID's TLB entries) isn't part of the comparison.
     pop rax
+    mov rbx, cr3
+    xor rbx, rax
+    shl rbx, 1
+    jz .same_cr3
     mov cr3, rax
+.same_cr3:
 
     xor rax, rax
     pop rax
@@ -8,6 +8,9 @@
 #include <hal/x64/irqs/pic/pic.hpp>
 #include <sched/processes.hpp>
 #include <kernel/syscalls/syscalls.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include <mm/address_space.hpp>
+#include <mm/uaccess.hpp>
 
 const char* exception_strings[32] = {
         "(#DE) Division Error",
@@ -143,8 +146,15 @@ bool enabled_sched = false;
 
 extern "C" void interrupt_handler(Registers_x86_64* regs)
 {
-    if (regs->interrupt_number >= 0x90 && regs->interrupt_number <= 0xa0)
+    cpu_enter_interrupt();
+
+    // Syscalls and faults come through here as well, only device interrupts count as IRQ context.
+    bool is_irq = regs->interrupt_number >= 0x90 && regs->interrupt_number <= 0xa0;
+
+    if (is_irq)
     {
+        cpu_enter_irq();
+
         uint64_t irq = regs->interrupt_number - 0x90;
 
         idt_internal_call(regs->interrupt_number, regs);
@@ -152,6 +162,14 @@ extern "C" void interrupt_handler(Registers_x86_64* regs)
         pic_send_eoi(irq);
     }
 
+    // Demand paging, only faults nobody can resolve are fatal. A bad user pointer in copy_from_user()
+    // and friends resumes at their fixup instead.
+    if (regs->interrupt_number == 14 && (address_space_handle_page_fault(read_cr2(), regs->error_code) || uaccess_fixup(regs)))
+    {
+        cpu_leave_interrupt();
+        return;
+    }
+
     if (regs->interrupt_number < 32)
     {
         kstd::enable_tailing_zeroes();
@@ -161,6 +179,7 @@ extern "C" void interrupt_handler(Registers_x86_64* regs)
         switch (regs->interrupt_number)
         {
             case 1:
+                cpu_leave_interrupt();
                 return;
             case 14:
                 print_page_fault_info(*regs);
@@ -171,7 +190,7 @@ extern "C" void interrupt_handler(Registers_x86_64* regs)
         unreachable();
     }
 
-    if (regs->rax == 0x80)
+    if (regs->interrupt_number == SYSCALL_VECTOR)
     {
         sctbl_call(regs);
     }
@@ -181,7 +200,8 @@ extern "C" void interrupt_handler(Registers_x86_64* regs)
         proc_scheduler(regs);
     }
 
-    return;
+    if (is_irq) cpu_leave_irq();
+    cpu_leave_interrupt();
 }
 
 void idt_enable_sched()
@@ -23,6 +23,16 @@ double clk_get_time()
     return _T;
 }
 
+uint64_t clk_get_ticks()
+{
+    return clk;
+}
+
+uint64_t clk_ticks_to_ms(uint64_t ticks)
+{
+    return ticks * 1000 / pit_frequency;
+}
+
 // t - seconds
 void clk_sleep(double t) {
     // Get the start time
@@ -16,6 +16,8 @@ typedef struct _ktime_t
 
 void clk_init();
 double clk_get_time();
+uint64_t clk_get_ticks();
+uint64_t clk_ticks_to_ms(uint64_t ticks);
 void clk_sleep(double t);
 
 #endif //KITTY_OS_CPP_CLOCK_HPP
@@ -3,5 +3,5 @@ section .text
 global fuckme
 fuckme:
     mov rax, 0x80000000
-    int 0x80
+    int 0x81
     ret
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include <limine.h>
 #include <firmware/acpi/acpi.hpp>
+#include <firmware/acpi/numa.hpp>
 #include <public/kdu/driver_ctrl.hpp>
 #include <exec/elf/loader.hpp>
 #include <kterm/kt.hpp>
@@ -13,6 +14,11 @@
 #include <hal/x64/tss/tss.hpp>
 #include <kernel/clock.hpp>
 #include <mm/heap.hpp>
+#include <mm/dma.hpp>
+#include <mm/address_space.hpp>
+#include <mm/slab.hpp>
+#include <mm/zram.hpp>
+#include <mm/uaccess.hpp>
 #include <drivers/video/fb/fb.hpp>
 #include <hal/x64/gdt/gdt.hpp>
 #include <hal/x64/idt/idt.hpp>
@@ -55,8 +61,16 @@ extern "C" void kernel_main()
     kstd::InitializeTerminal();
 
     vmm_init();
+    numa_init();
     pmm_init();
+    slab_init();
+    dma_init();
+    address_space_init();
+    uaccess_init();
     heap_init();
+    zram_init();
+    vmm_remap_kernel();
+    Framebuffer::RemapHuge();
 
     for (size_t i = 0; &__init_array[i] != __init_array_end; i++)
     {
@@ -76,9 +90,12 @@ extern "C" void kernel_main()
     driver_ctrl_call_ald();
     driver_ctrl_enumerate_drivers();
     smbios_dump_info();
+    pmm_reclaim_boot_memory();
     pmm_print_memory_information();
 
     sched_init();
+    proc_create_task(PROC_PRIORITY_IDLE, "pmm-zero", pmm_zero_task);
+    proc_create_task(PROC_PRIORITY_IDLE, "pmm-reclaim", pmm_reclaim_task);
     idt_enable_sched();
     tss_flush();
 
@@ -1,8 +1,9 @@
 #include <kstd/kstdio.hpp>
+#include <mm/uaccess.hpp>
 #include "syscalls.hpp"
 
-extern char *_syscall_tbl_start;
-extern char *_syscall_tbl_end;
+extern char _syscall_tbl_start[];
+extern char _syscall_tbl_end[];
 
 void sctbl_print_entries()
 {
@@ -22,6 +23,38 @@ void sctbl_call(Registers_x86_64* regs)
         if (ent.syscall_id == regs->rax)
         {
             ent.syscall_function(&scent[i], regs);
+            return;
         }
     }
-}
\ No newline at end of file
+}
+// write(string) -> its length, or -EFAULT. What KernWrite() in libs/Kitty calls, the string is read a chunk at a time.
+static void sctbl_sc_write([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    char chunk[256];
+    auto string = reinterpret_cast<const char*>(registers->rbx);
+    long written = 0;
+
+    while (true)
+    {
+        long length = strncpy_from_user(chunk, string + written, sizeof(chunk) - 1);
+
+        if (length < 0)
+        {
+            registers->rax = static_cast<uint64_t>(length);
+            return;
+        }
+
+        chunk[length] = 0;
+        kstd::printf("%s", chunk);
+
+        written += length;
+        if (static_cast<size_t>(length) != sizeof(chunk) - 1) break;
+    }
+
+    registers->rax = static_cast<uint64_t>(written);
+}
+
+syscall_type syscall_entry sctbl_write_sce = {
+        .syscall_id = SYSCALL_WRITE,
+        .syscall_function = &sctbl_sc_write
+};
@@ -7,6 +7,16 @@
 
 #define syscall_type __attribute__((section(".syscalls"), used))
 
+// int 0x81, the syscall number goes in rax.
+#define SYSCALL_VECTOR 0x81
+
+#define SYSCALL_WRITE 0x01
+#define SYSCALL_MMAP 0x10
+#define SYSCALL_MUNMAP 0x11
+#define SYSCALL_BRK 0x12
+#define SYSCALL_SPAWN 0x13
+#define SYSCALL_EXIT 0x14
+
 struct syscall_entry;
 
 // syscall_entry* self, Registers* registers
@@ -8,174 +8,343 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <kstd/kstdio.hpp>
+#include <kstd/kstring.hpp>
+#include <arch/x64/control/control.hpp>
 
-template <typename T>
+// Dense bitmap, one bit per index, stored in 64-bit words.
+// Optionally keeps a summary level with one bit per fully set word, so searches for
+// cleared bits skip full regions 64 words (4096 bits) at a time.
 class Bitmap
 {
 protected:
-    T* gBitmap;
-    size_t gSize;
+    uint64_t* gBitmap = nullptr;
+    uint64_t* gSummary = nullptr;
+    size_t gSize = 0;       // In bits.
+    size_t gWords = 0;
     size_t last_free_block = 0;
+
+    static constexpr uint64_t full_word = ~0ULL;
+
+    void UpdateSummary(size_t word)
+    {
+        if (this->gSummary == nullptr) return;
+
+        if (this->gBitmap[word] == full_word)
+            this->gSummary[word / 64] |= (1ULL << (word % 64));
+        else
+            this->gSummary[word / 64] &= ~(1ULL << (word % 64));
+    }
+
+    // Applies `mask` to the word with either OR (set) or AND NOT (clear).
+    void ApplyMask(size_t word, uint64_t mask, bool set)
+    {
+        if (set)
+            this->gBitmap[word] |= mask;
+        else
+            this->gBitmap[word] &= ~mask;
+
+        this->UpdateSummary(word);
+    }
+
+    // Sets or clears `len` bits of `words` starting at `idx`. Head and tail words get masked,
+    // the aligned middle is filled with memset.
+    static void FillBits(uint64_t* words, size_t idx, size_t len, bool set)
+    {
+        if (len == 0) return;
+
+        size_t end = idx + len;
+        size_t first_word = idx / 64;
+        size_t last_word = (end - 1) / 64;
+
+        uint64_t head_mask = full_word << (idx % 64);
+        uint64_t tail_mask = full_word >> (63 - ((end - 1) % 64));
+
+        if (first_word == last_word)
+        {
+            head_mask &= tail_mask;
+        }
+
+        if (set) words[first_word] |= head_mask;
+        else words[first_word] &= ~head_mask;
+
+        if (first_word == last_word) return;
+
+        if (last_word - first_word > 1)
+        {
+            kstd::memset(&words[first_word + 1], set ? 0xff : 0, (last_word - first_word - 1) * sizeof(uint64_t));
+        }
+
+        if (set) words[last_word] |= tail_mask;
+        else words[last_word] &= ~tail_mask;
+    }
+
+    void ApplyRange(size_t idx, size_t len, bool set)
+    {
+        if (idx >= this->gSize || len == 0) return;
+        if (len > this->gSize - idx) len = this->gSize - idx;
+
+        FillBits(this->gBitmap, idx, len, set);
+
+        if (this->gSummary == nullptr) return;
+
+        // Words in the middle are now all full or all empty, their summary bits follow suit.
+        size_t first_word = idx / 64;
+        size_t last_word = (idx + len - 1) / 64;
+
+        this->UpdateSummary(first_word);
+        this->UpdateSummary(last_word);
+
+        if (last_word - first_word > 1)
+        {
+            FillBits(this->gSummary, first_word + 1, last_word - first_word - 1, set);
+        }
+    }
+
+    // Finds `length` consecutive bits equal to `set`, returns SIZE_MAX if there's no such run.
+    size_t FindRun(size_t length, bool set)
+    {
+        if (length == 0 || length > this->gSize) return SIZE_MAX;
+
+        size_t run = 0;
+        size_t run_start = 0;
+
+        for (size_t word = 0; this->gWords > word; word++)
+        {
+            // Whole group of full words, nothing cleared in there.
+            if (!set && this->gSummary != nullptr && word % 64 == 0 && this->gSummary[word / 64] == full_word)
+            {
+                run = 0;
+                word += 63;
+                continue;
+            }
+
+            // Looking for runs of zeroes in `value`.
+            uint64_t value = set ? ~this->gBitmap[word] : this->gBitmap[word];
+
+            if (value == full_word)
+            {
+                run = 0;
+                continue;
+            }
+
+            size_t bit = 0;
+            while (64 > bit)
+            {
+                uint64_t rest = value >> bit;
+
+                size_t zeroes = rest == 0 ? 64 - bit : __builtin_ctzll(rest);
+                if (zeroes != 0)
+                {
+                    if (run == 0) run_start = word * 64 + bit;
+                    run += zeroes;
+                    bit += zeroes;
+
+                    if (run >= length)
+                    {
+                        return run_start + length <= this->gSize ? run_start : SIZE_MAX;
+                    }
+                }
+
+                if (bit >= 64) break;
+
+                uint64_t ones = ~(value >> bit);
+                bit += ones == 0 ? 64 - bit : __builtin_ctzll(ones);
+                run = 0;
+            }
+        }
+
+        return SIZE_MAX;
+    }
+
+    // Index of the first cleared bit at or after `start_word`, SIZE_MAX if there's none.
+    size_t FindClearedFrom(size_t start_word)
+    {
+        size_t word = start_word;
+
+        while (this->gWords > word)
+        {
+            if (this->gSummary != nullptr)
+            {
+                // Skip full words using the summary level.
+                uint64_t summary = ~this->gSummary[word / 64] & (full_word << (word % 64));
+                if (summary == 0)
+                {
+                    word = (word / 64 + 1) * 64;
+                    continue;
+                }
+
+                word = (word / 64) * 64 + __builtin_ctzll(summary);
+                if (word >= this->gWords) break;
+            }
+
+            if (this->gBitmap[word] != full_word)
+            {
+                size_t idx = word * 64 + __builtin_ctzll(~this->gBitmap[word]);
+                return idx < this->gSize ? idx : SIZE_MAX;
+            }
+
+            word++;
+        }
+
+        return SIZE_MAX;
+    }
 public:
+    // Number of words the summary level requires for a bitmap of `bit_count` bits.
+    static constexpr size_t SummaryWords(size_t bit_count)
+    {
+        return ((bit_count + 63) / 64 + 63) / 64;
+    }
+
     // Set the bit in the bitmap
     void Set(size_t idx)
     {
-        if ((idx / sizeof(T)) > this->gSize) return;
+        if (idx >= this->gSize) return;
 
-        this->gBitmap[idx / sizeof(T)] |= (1 << (idx % sizeof(T)));
+        this->ApplyMask(idx / 64, 1ULL << (idx % 64), true);
     }
 
     // Toggle the bit in the bitmap (If bit == 0, then bit = 1 and vice versa)
     void Toggle(size_t idx)
     {
-        if ((idx / sizeof(T)) > this->gSize) return;
+        if (idx >= this->gSize) return;
 
-        this->gBitmap[idx / sizeof(T)] ^= (1 << (idx % sizeof(T)));
+        this->gBitmap[idx / 64] ^= (1ULL << (idx % 64));
+        this->UpdateSummary(idx / 64);
+
+        if (idx < this->last_free_block) this->last_free_block = idx;
     }
 
     // Clears the bit
     void Clear(size_t idx)
     {
-        if ((idx / sizeof(T)) > this->gSize) return;
+        if (idx >= this->gSize) return;
+
+        this->ApplyMask(idx / 64, 1ULL << (idx % 64), false);
 
-        this->gBitmap[idx / sizeof(T)] &= ~(1 << (idx % sizeof(T)));
+        if (idx < this->last_free_block) this->last_free_block = idx;
     }
 
     // Checks the bit (returns true if set, false if not set).
     bool Check(size_t idx)
     {
-        if ((idx / sizeof(T)) > this->gSize) return false;
+        if (idx >= this->gSize) return false;
 
-        return (this->gBitmap[idx / sizeof(T)] & (1 << (idx % sizeof(T)))) != 0;
+        return (this->gBitmap[idx / 64] & (1ULL << (idx % 64))) != 0;
+    }
+
+    // Sets `len` bits starting at `idx`, word at a time.
+    void SetRange(size_t idx, size_t len)
+    {
+        this->ApplyRange(idx, len, true);
+    }
+
+    // Clears `len` bits starting at `idx`, word at a time.
+    void ClearRange(size_t idx, size_t len)
+    {
+        this->ApplyRange(idx, len, false);
+
+        if (len != 0 && idx < this->last_free_block) this->last_free_block = idx;
     }
 
     // Returns number of set bits.
     size_t CountSet()
     {
         size_t count = 0;
-        for (size_t i = 0; i < this->gSize * sizeof(T); ++i)
+        for (size_t i = 0; i < this->gWords; ++i)
         {
-            if (this->Check(i))
-            {
-                ++count;
-            }
+            uint64_t word = this->gBitmap[i];
+
+            // Don't count the bits past the end of the bitmap.
+            if (i == this->gWords - 1 && this->gSize % 64 != 0)
+                word &= full_word >> (64 - this->gSize % 64);
+
+            count += __builtin_popcountll(word);
         }
         return count;
     }
     // Returns number of cleared bits.
     size_t CountUnset()
     {
-        return (this->gSize * sizeof(T)) - this->CountSet();
+        return this->gSize - this->CountSet();
     }
 
     // Returns index of first set bit.
     size_t FindFirstSet()
     {
-        for (size_t i = 0; i < this->gSize * sizeof(T); ++i)
+        for (size_t i = 0; i < this->gWords; ++i)
         {
-            if (this->Check(i))
+            if (this->gBitmap[i] != 0)
             {
-                return i;
+                size_t idx = i * 64 + __builtin_ctzll(this->gBitmap[i]);
+                return idx < this->gSize ? idx : SIZE_MAX;
             }
         }
         return SIZE_MAX; // Indicate no set bit found
     }
 
-    // Returns index of first unset bit.
+    // Returns index of first unset bit, SIZE_MAX if every bit is set.
     size_t FindFirstCleared()
     {
-        if (last_free_block != 0)
+        // last_free_block only moves back when something gets cleared, so nothing before it is free.
+        size_t idx = this->FindClearedFrom(this->last_free_block / 64);
+
+        if (idx != SIZE_MAX)
         {
-            for (size_t i = last_free_block; i < this->gSize * sizeof(T); ++i)
-            {
-                if (!this->Check(i))
-                {
-                    last_free_block = i;
-                    return i;
-                }
-            }
-        }
-        else
-        {
-            for (size_t i = 0; i < this->gSize * sizeof(T); ++i)
-            {
-                if (!this->Check(i))
-                {
-                    last_free_block = i;
-                    return i;
-                }
-            }
+            this->last_free_block = idx;
+            return idx;
         }
 
-        kstd::printf("NO BLOCK FOUND!!");
-        unreachable();
-        return 0; // Indicate no unset bit found
+        return SIZE_MAX;
     }
 
     // Returns the index of the continuous block of set bits.
     size_t FindContinuousBlockOfSet(size_t length)
     {
-        size_t consecutive = 0;
-        for (size_t i = 0; i < this->gSize * sizeof(T); ++i)
-        {
-            if (this->Check(i))
-            {
-                ++consecutive;
-                if (consecutive >= length)
-                {
-                    return i - consecutive + 1;
-                }
-            }
-            else
-            {
-                consecutive = 0;
-            }
-        }
-        return SIZE_MAX; // Indicate no continuous block of set bits found
+        return this->FindRun(length, true);
     }
 
     // Returns the index of continuous block unset bits.
     size_t FindContinuousBlockOfUnset(size_t length)
     {
-        size_t consecutive = 0;
-        for (size_t i = 0; i < this->gSize * sizeof(T); ++i)
-        {
-            if (!this->Check(i))
-            {
-                ++consecutive;
-                if (consecutive >= length)
-                {
-                    return i - consecutive + 1;
-                }
-            }
-            else
-            {
-                consecutive = 0;
-            }
-        }
-        return SIZE_MAX; // Indicate no continuous block of unset bits found
+        return this->FindRun(length, false);
     }
 
     void ClearToOnes()
     {
-        for (size_t i = 0; (this->gSize * sizeof(T)) > i; i++)
-        {
-            this->Set(i);
-        }
+        this->ApplyRange(0, this->gSize, true);
     }
 
     void ClearToZeroes()
     {
-        for (size_t i = 0; (this->gSize * sizeof(T)) > i; i++)
-        {
-            this->Clear(i);
-        }
+        this->ApplyRange(0, this->gSize, false);
+        this->last_free_block = 0;
     }
 
-    void Initialize(T* bitmap_pointer = nullptr, size_t bitmap_size = 0)
+    // `bitmap_pointer` has to hold at least (bit_count + 63) / 64 words.
+    void Initialize(uint64_t* bitmap_pointer = nullptr, size_t bit_count = 0)
     {
         this->gBitmap = bitmap_pointer;
-        this->gSize = bitmap_size;
+        this->gSize = bit_count;
+        this->gWords = (bit_count + 63) / 64;
+        this->gSummary = nullptr;
+        this->last_free_block = 0;
+    }
+
+    // Enables the summary level. `summary_pointer` has to hold SummaryWords(bit_count) words.
+    // The summary is rebuilt from the current contents of the bitmap.
+    void InitializeSummary(uint64_t* summary_pointer)
+    {
+        this->gSummary = summary_pointer;
+
+        for (size_t i = 0; SummaryWords(this->gSize) > i; i++)
+        {
+            this->gSummary[i] = 0;
+        }
+
+        for (size_t word = 0; this->gWords > word; word++)
+        {
+            this->UpdateSummary(word);
+        }
     }
 };
 
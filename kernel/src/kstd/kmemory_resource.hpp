@@ -0,0 +1,53 @@
+#ifndef KITTY_OS_CPP_KMEMORY_RESOURCE_HPP
+#define KITTY_OS_CPP_KMEMORY_RESOURCE_HPP
+
+#include <stddef.h>
+#include <mm/kmalloc.hpp>
+
+namespace kstd
+{
+    // Where a container gets its memory from. The base class is kmalloc(), containers holding nullptr
+    // call kmalloc() directly and skip the virtual call.
+    class memory_resource
+    {
+    public:
+        virtual void* allocate(size_t bytes, size_t alignment)
+        {
+            return alignment > 16 ? kmalloc_aligned(bytes, alignment) : kmalloc(bytes);
+        }
+
+        // Contents up to the smaller of both sizes are kept, `ptr` may be nullptr.
+        virtual void* reallocate(void* ptr, [[maybe_unused]] size_t old_bytes, size_t new_bytes, [[maybe_unused]] size_t alignment)
+        {
+            return krealloc(ptr, new_bytes);
+        }
+
+        virtual void deallocate(void* ptr, [[maybe_unused]] size_t bytes)
+        {
+            kfree(ptr);
+        }
+
+    protected:
+        ~memory_resource() = default;
+    };
+
+    inline void* resource_allocate(memory_resource* resource, size_t bytes, size_t alignment)
+    {
+        if (resource != nullptr) return resource->allocate(bytes, alignment);
+        return alignment > 16 ? kmalloc_aligned(bytes, alignment) : kmalloc(bytes);
+    }
+
+    inline void* resource_reallocate(memory_resource* resource, void* ptr, size_t old_bytes, size_t new_bytes, size_t alignment)
+    {
+        if (resource != nullptr) return resource->reallocate(ptr, old_bytes, new_bytes, alignment);
+        return krealloc(ptr, new_bytes);
+    }
+
+    inline void resource_deallocate(memory_resource* resource, void* ptr, size_t bytes)
+    {
+        if (resource != nullptr) resource->deallocate(ptr, bytes);
+        else kfree(ptr);
+    }
+}
+
+#endif //KITTY_OS_CPP_KMEMORY_RESOURCE_HPP
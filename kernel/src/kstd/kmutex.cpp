@@ -8,6 +8,10 @@ namespace kstd
         }
     }
 
+    bool mutex::try_lock() {
+        return !flag.test_and_set(std::memory_order_acquire);
+    }
+
     void mutex::unlock() {
         flag.clear(std::memory_order_release);
     }
@@ -8,11 +8,15 @@ namespace kstd
 {
     class mutex {
     public:
-        mutex() : flag(ATOMIC_FLAG_INIT) {}
+        // constexpr so global mutexes are ready before the init_array runs (the PMM and VMM lock them earlier).
+        constexpr mutex() : flag(ATOMIC_FLAG_INIT) {}
 
         // Lock the mutex (blocking)
         void lock();
 
+        // Try to lock the mutex, returns false if it's already locked.
+        bool try_lock();
+
         // Unlock the mutex
         void unlock();
 
@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <kstd/kmemory_resource.hpp>
 
 namespace kstd
 {
@@ -35,6 +36,14 @@ namespace kstd
         char* data;
         size_t length;
         size_t capacity; // Add capacity to manage memory
+        memory_resource* resource; // nullptr = kmalloc()
+
+        // Appending grows the capacity geometrically, one reallocation per character adds up.
+        void grow(size_t needed) {
+            if (needed > capacity) {
+                reserve(needed > capacity * 2 ? needed : capacity * 2);
+            }
+        }
 
     public:
         // Iterator class definition
@@ -70,9 +79,11 @@ namespace kstd
         };
 
         // Constructors and destructor
-        string() : data(nullptr), length(0), capacity(0) {}
+        string() : data(nullptr), length(0), capacity(0), resource(nullptr) {}
+
+        explicit string(memory_resource* resource) : data(nullptr), length(0), capacity(0), resource(resource) {}
 
-        string(const char* str) : data(nullptr), length(0), capacity(0) {
+        string(const char* str, memory_resource* resource = nullptr) : data(nullptr), length(0), capacity(0), resource(resource) {
             size_t len = strlen(str);
             reserve(len + 1); // +1 for null terminator
             strcpy(data, str);
@@ -81,17 +92,18 @@ namespace kstd
 
         ~string() {
             if (data) {
-                delete[] data;
+                resource_deallocate(resource, data, capacity);
             }
         }
 
-        string(const string& other) : data(nullptr), length(0), capacity(0) {
+        // Copies use kmalloc(), whatever the resource of `other` is.
+        string(const string& other) : data(nullptr), length(0), capacity(0), resource(nullptr) {
             reserve(other.length + 1); // +1 for null terminator
             strcpy(data, other.data);
             length = other.length;
         }
 
-        // Assignment operator
+        // Assignment operator, the string keeps its resource.
         string& operator=(const string& other) {
             if (this != &other) {
                 reserve(other.length + 1); // +1 for null terminator
@@ -101,15 +113,21 @@ namespace kstd
             return *this;
         }
 
+        string& operator=(const char* str) {
+            size_t len = strlen(str);
+            reserve(len + 1); // +1 for null terminator
+            strcpy(data, str);
+            length = len;
+            return *this;
+        }
+
         // Capacity management
+        // Grows in place when the block after the data is free.
         void reserve(size_t newCapacity) {
             if (newCapacity > capacity) {
-                char* newData = new char[newCapacity];
-                if (data) {
-                    strcpy(newData, data);
-                    delete[] data;
-                }
-                data = newData;
+                bool was_empty = data == nullptr;
+                data = static_cast<char*>(resource_reallocate(resource, data, capacity, newCapacity, 1));
+                if (was_empty) data[0] = '\0';
                 capacity = newCapacity;
             }
         }
@@ -128,10 +146,14 @@ namespace kstd
             return data;
         }
 
+        memory_resource* get_resource() const {
+            return resource;
+        }
+
         // Concatenation operators
         string& operator+=(const string& other) {
             size_t newLength = length + other.length;
-            reserve(newLength + 1); // +1 for null terminator
+            grow(newLength + 1); // +1 for null terminator
             strcat(data, other.data);
             length = newLength;
             return *this;
@@ -139,7 +161,7 @@ namespace kstd
 
         string& operator+=(const char other) {
             size_t newLength = length + 1;
-            reserve(newLength + 1); // +1 for null terminator
+            grow(newLength + 1); // +1 for null terminator
             data[length] = other;
             data[length + 1] = '\0'; // Null-terminate the string
             length = newLength;
@@ -149,7 +171,7 @@ namespace kstd
         // Clear the string
         void clear() {
             if (data) {
-                delete[] data;
+                resource_deallocate(resource, data, capacity);
                 data = nullptr;
             }
             length = 0;
@@ -1,6 +1,8 @@
 #include <initializer_list>
-
+#include <type_traits>
 #include <cstddef>
+#include <new>
+#include <kstd/kmemory_resource.hpp>
 
 namespace kstd
 {
@@ -11,31 +13,87 @@ namespace kstd
         T* array;         // Pointer to the array
         size_t size;      // Current number of elements
         size_t capacity;  // Current capacity of the array
+        memory_resource* resource;  // nullptr = kmalloc()
 
-        // Function to resize the array when it runs out of space
-        void resize()
+        // Plain data is left unconstructed, so growing it is a reallocation that can stay in place.
+        static constexpr bool is_raw = std::is_trivially_copyable_v<T> && alignof(T) <= 16;
+
+        // Elements that take a memory resource get the vector's, a vector of strings in an arena keeps
+        // the strings there too.
+        static constexpr bool takes_resource = !std::is_pointer_v<T> && std::is_constructible_v<T, memory_resource*>;
+
+        T* allocate(size_t count)
+        {
+            T* data = static_cast<T*>(resource_allocate(resource, count * sizeof(T), alignof(T)));
+
+            if constexpr (!is_raw)
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    if constexpr (takes_resource) new (&data[i]) T(resource);
+                    else new (&data[i]) T();
+                }
+            }
+
+            return data;
+        }
+
+        void release(T* data, size_t count)
         {
-            capacity *= 2;
-            T* newArray = new T[capacity];
-            for (size_t i = 0; i < size; ++i)
+            if constexpr (!is_raw)
             {
-                newArray[i] = array[i];
+                for (size_t i = 0; i < count; ++i)
+                {
+                    data[i].~T();
+                }
             }
-            delete[] array;
-            array = newArray;
+
+            resource_deallocate(resource, data, count * sizeof(T));
+        }
+
+        void grow(size_t newCapacity)
+        {
+            if constexpr (is_raw)
+            {
+                array = static_cast<T*>(resource_reallocate(resource, array, capacity * sizeof(T), newCapacity * sizeof(T), alignof(T)));
+            }
+            else
+            {
+                T* newArray = allocate(newCapacity);
+                for (size_t i = 0; i < size; ++i)
+                {
+                    newArray[i] = array[i];
+                }
+                release(array, capacity);
+                array = newArray;
+            }
+
+            capacity = newCapacity;
+        }
+
+        // Function to resize the array when it runs out of space
+        void resize()
+        {
+            grow(capacity * 2);
         }
 
     public:
         // Constructor
-        vector() : size(0), capacity(1)
+        vector() : size(0), capacity(1), resource(nullptr)
         {
-            array = new T[capacity];
+            array = allocate(capacity);
+        }
+
+        // Everything, elements that take a resource included, comes from `resource`.
+        explicit vector(memory_resource* resource) : size(0), capacity(1), resource(resource)
+        {
+            array = allocate(capacity);
         }
 
         // Initializer list constructor
-        vector(std::initializer_list<T> initList) : size(initList.size()), capacity(initList.size())
+        vector(std::initializer_list<T> initList) : size(initList.size()), capacity(initList.size()), resource(nullptr)
         {
-            array = new T[capacity];
+            array = allocate(capacity);
             size_t index = 0;
             for (const T& value : initList)
             {
@@ -46,19 +104,13 @@ namespace kstd
         // Destructor
         ~vector()
         {
-            delete[] array;
+            release(array, capacity);
         }
 
         void reserve(size_t newCapacity) {
             if (newCapacity <= capacity) return; // No need to reallocate
 
-            T* newData = new T[newCapacity];
-            for (size_t i = 0; i < size; ++i) {
-                newData[i] = array[i]; // Move existing elements
-            }
-            delete[] array; // Delete old data
-            array = newData;
-            capacity = newCapacity;
+            grow(newCapacity);
         }
 
         // Get the current size of the vector
@@ -73,6 +125,11 @@ namespace kstd
             return capacity;
         }
 
+        memory_resource* get_resource() const
+        {
+            return resource;
+        }
+
         // Add an element to the end of the vector
         void push_back(const T& value)
         {
@@ -0,0 +1,35 @@
+#include <kstd/kstdio.hpp>
+#include <mm/heap_profile.hpp>
+#include "../kt_command.hpp"
+
+void start_heap_profile_cmd([[maybe_unused]] kstd::string& command_name, [[maybe_unused]] kstd::vector<kstd::string>& params)
+{
+    heap_profile_start();
+    kstd::printf("Heap profiling started.\n");
+}
+
+void stop_heap_profile_cmd([[maybe_unused]] kstd::string& command_name, [[maybe_unused]] kstd::vector<kstd::string>& params)
+{
+    heap_profile_stop();
+    kstd::printf("Heap profiling stopped.\n");
+}
+
+void get_heap_profile_cmd([[maybe_unused]] kstd::string& command_name, [[maybe_unused]] kstd::vector<kstd::string>& params)
+{
+    heap_profile_print();
+}
+
+kt_command_spec start_heap_profile_cmd_desc = {
+        .command_name = "Start-HeapProfile",
+        .command_function = &start_heap_profile_cmd
+};
+
+kt_command_spec stop_heap_profile_cmd_desc = {
+        .command_name = "Stop-HeapProfile",
+        .command_function = &stop_heap_profile_cmd
+};
+
+kt_command_spec get_heap_profile_cmd_desc = {
+        .command_name = "Get-HeapProfile",
+        .command_function = &get_heap_profile_cmd
+};
@@ -0,0 +1,21 @@
+#include <kstd/kstdio.hpp>
+#include <mm/pmm.hpp>
+#include <mm/shrinker.hpp>
+#include "../kt_command.hpp"
+
+void get_memory_pressure_cmd([[maybe_unused]] kstd::string& command_name, [[maybe_unused]] kstd::vector<kstd::string>& params)
+{
+    static const char* pressure_names[] = { "none", "low", "min" };
+
+    size_t min, low, high;
+    pmm_get_watermarks(&min, &low, &high);
+
+    kstd::printf("Free pages: %zu (pressure: %s)\n", pmm_get_free_pages(), pressure_names[pmm_get_pressure()]);
+    kstd::printf("Watermarks: min %zu, low %zu, high %zu pages\n", min, low, high);
+    shrinker_print();
+}
+
+kt_command_spec get_memory_pressure_cmd_desc = {
+        .command_name = "Get-MemoryPressure",
+        .command_function = &get_memory_pressure_cmd
+};
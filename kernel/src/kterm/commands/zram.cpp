@@ -0,0 +1,12 @@
+#include <mm/zram.hpp>
+#include "../kt_command.hpp"
+
+void get_zram_stats_cmd([[maybe_unused]] kstd::string& command_name, [[maybe_unused]] kstd::vector<kstd::string>& params)
+{
+    zram_print_stats();
+}
+
+kt_command_spec get_zram_stats_cmd_desc = {
+        .command_name = "Get-ZramStats",
+        .command_function = &get_zram_stats_cmd
+};
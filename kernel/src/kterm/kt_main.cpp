@@ -5,6 +5,7 @@
 #include <kstd/kstring.hpp>
 #include <kernel/kbd.hpp>
 #include <kernel/clock.hpp>
+#include <mm/arena.hpp>
 #include <functional>
 #include "kt_command.hpp"
 
@@ -12,11 +13,12 @@ extern kt_command __kt_commands_array[];
 extern kt_command __kt_commands_array_end[];
 
 constexpr size_t cmdbuf_size = 8192;
+constexpr size_t kt_arena_size = 2048;   // Enough for the usual command line, longer ones spill into the heap.
 
 void kt_parse_command_line(char* cmdbuf, kstd::vector<kstd::string>& output) {
     bool in_quotes = false;
     bool escaped = false;
-    kstd::string tok;
+    kstd::string tok(output.get_resource());
 
     while (*cmdbuf != 0)
     {
@@ -80,7 +82,11 @@ void kt_do_comamnd()
     kbd_read(cmdbuf, true);
     kstd::putc('\n');
 
-    kstd::vector<kstd::string> parsed_cmdline;
+    // The tokens die with the command, they're parsed into an arena instead of the heap.
+    alignas(16) uint8_t arena_buffer[kt_arena_size];
+    Arena arena(arena_buffer, sizeof(arena_buffer));
+
+    kstd::vector<kstd::string> parsed_cmdline(&arena);
     kt_parse_command_line(cmdbuf, parsed_cmdline);
 
     if (parsed_cmdline.getSize() == 0)
@@ -88,8 +94,8 @@ void kt_do_comamnd()
         return;
     }
 
-    auto str = kstd::strdup(parsed_cmdline[0].c_str());
-    auto command_name = kstd::string(str);
+    auto command_name = kstd::string(parsed_cmdline[0].c_str(), &arena);
+    auto str = command_name.c_str();
 
     if (!parsed_cmdline.empty()) {
         parsed_cmdline.erase(0);
@@ -110,7 +116,6 @@ void kt_do_comamnd()
     }
 
     kstd::printf("Command \"%s\" not found.\n", str);
-    delete str;
 }
 
 void kt_main()
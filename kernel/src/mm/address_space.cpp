@@ -0,0 +1,757 @@
+#include <kstd/kstdio.hpp>
+#include <mm/pcid.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include <kernel/syscalls/syscalls.hpp>
+#include <mm/slab.hpp>
+#include <mm/zram.hpp>
+#include "address_space.hpp"
+
+static AddressSpace address_space_kernel_space;
+static AddressSpace* address_space_list = nullptr;
+static kstd::mutex address_space_list_lock;
+
+// Area nodes come from a slab cache instead of the heap, the heap reserves its own range through the
+// kernel's space.
+static SlabCache address_space_node_cache;
+
+// Clock hand of address_space_reclaim(): the space it's in, by CR3 since the space may be gone, and where in it.
+static uint64_t address_space_reclaim_cr3 = 0;
+static uint64_t address_space_reclaim_cursor = 0;
+
+static inline uint64_t address_space_page_down(uint64_t v)
+{
+    return v & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+}
+
+static inline uint64_t address_space_page_up(uint64_t v)
+{
+    return (v + PAGE_SIZE - 1) & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+}
+
+static vm_area* address_space_alloc_node()
+{
+    auto node = static_cast<vm_area*>(address_space_node_cache.alloc());
+    if (node != nullptr) kstd::memset(node, 0, sizeof(vm_area));
+
+    return node;
+}
+
+static void address_space_free_node(vm_area* node)
+{
+    address_space_node_cache.free(node);
+}
+
+void AddressSpace::init(uint64_t pml4_physical, uint16_t pcid)
+{
+    this->pml4_physical = pml4_physical;
+    this->pml4 = vmm_make_virtual<pml4e*>(pml4_physical);
+    this->pcid = pcid;
+    this->brk_start = ADDRESS_SPACE_BRK_BASE;
+    this->brk_end = ADDRESS_SPACE_BRK_BASE;
+}
+
+void AddressSpace::destroy()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    while (vm_area* area = this->areas.first())
+    {
+        this->areas.erase(area);
+        this->unmap_pages(area->start, area->end, area->area_flags);
+        address_space_free_node(area);
+    }
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+pml4e* AddressSpace::get_pml4() const
+{
+    return this->pml4;
+}
+
+uint64_t AddressSpace::get_cr3() const
+{
+    return this->pml4_physical | this->pcid;
+}
+
+size_t AddressSpace::get_area_count() const
+{
+    return this->areas.size();
+}
+
+// Unmaps [start, end) and frees whatever was faulted in there, lock has to be held.
+void AddressSpace::unmap_pages(uint64_t start, uint64_t end, int area_flags)
+{
+    // The kernel half is loaded everywhere, vmm_unmap_range() takes care of the other PCIDs.
+    bool current = start >= ADDRESS_SPACE_USER_END || vmm_get_pml4() == this->pml4_physical;
+
+    // Device memory isn't the PMM's.
+    int misc_flags = area_flags & VM_AREA_IO ? MISC_NONE : MISC_FREE_FRAMES;
+
+    vmm_unmap_range(this->pml4, start, (end - start) / PAGE_SIZE, misc_flags | (current ? MISC_INVLPG : MISC_NONE));
+
+    // The TLB may still hold the space under its PCID.
+    if (!current) pcid_flush(this->pcid);
+}
+
+bool AddressSpace::range_is_free(uint64_t start, uint64_t end)
+{
+    vm_area* area = this->areas.first_ending_after(start);
+
+    return area == nullptr || area->start >= end;
+}
+
+// Links a new area in, merging it with its neighbours if they're the same kind and `merge` is set.
+// Lock has to be held and the range has to be free.
+vm_area* AddressSpace::insert_area(uint64_t start, uint64_t end, int prot_flags, int area_flags, bool merge)
+{
+    vm_area* next = this->areas.first_ending_after(start);
+    vm_area* prev = next != nullptr ? VMATree::prev(next) : this->areas.last();
+
+    bool merge_prev = merge && prev != nullptr && prev->end == start && prev->prot_flags == prot_flags && prev->area_flags == area_flags;
+    bool merge_next = merge && next != nullptr && next->start == end && next->prot_flags == prot_flags && next->area_flags == area_flags;
+
+    if (merge_prev && merge_next)
+    {
+        this->areas.erase(next);
+        prev->end = next->end;
+        this->areas.update(prev);
+
+        address_space_free_node(next);
+        return prev;
+    }
+
+    if (merge_prev)
+    {
+        prev->end = end;
+        this->areas.update(prev);
+        return prev;
+    }
+
+    if (merge_next)
+    {
+        next->start = start;
+        this->areas.update(next);
+        return next;
+    }
+
+    vm_area* area = address_space_alloc_node();
+    if (area == nullptr) return nullptr;
+
+    area->start = start;
+    area->end = end;
+    area->prot_flags = prot_flags;
+    area->area_flags = area_flags;
+
+    this->areas.insert(area);
+
+    return area;
+}
+
+// Cuts [start, end) out of the areas (splitting the ones it starts or ends in) and unmaps it. Lock has to be held.
+void AddressSpace::remove_areas(uint64_t start, uint64_t end)
+{
+    vm_area* area = this->areas.first_ending_after(start);
+
+    while (area != nullptr && end > area->start)
+    {
+        vm_area* next = VMATree::next(area);
+
+        uint64_t cut_start = start > area->start ? start : area->start;
+        uint64_t cut_end = end < area->end ? end : area->end;
+
+        this->unmap_pages(cut_start, cut_end, area->area_flags);
+
+        if (cut_start > area->start && area->end > cut_end)
+        {
+            // Hole in the middle, the tail becomes an area of its own.
+            vm_area* tail = address_space_alloc_node();
+            uint64_t area_end = area->end;
+
+            area->end = cut_start;
+            this->areas.update(area);
+
+            if (tail == nullptr)
+            {
+                kstd::printf("[AS] Out of memory splitting an area, %lx - %lx is gone.\n", cut_end, area_end);
+                this->unmap_pages(cut_end, area_end, area->area_flags);
+                return;
+            }
+
+            tail->start = cut_end;
+            tail->end = area_end;
+            tail->prot_flags = area->prot_flags;
+            tail->area_flags = area->area_flags;
+            this->areas.insert(tail);
+            return;
+        }
+
+        if (cut_start > area->start)
+        {
+            area->end = cut_start;
+            this->areas.update(area);
+        }
+        else if (area->end > cut_end)
+        {
+            area->start = cut_end;
+            this->areas.update(area);
+        }
+        else
+        {
+            this->areas.erase(area);
+            address_space_free_node(area);
+        }
+
+        area = next;
+    }
+}
+
+bool AddressSpace::add_area(uint64_t start, uint64_t length, int prot_flags, int area_flags)
+{
+    uint64_t end = address_space_page_up(start + length);
+    start = address_space_page_down(start);
+
+    if (length == 0 || end > ADDRESS_SPACE_USER_END || start >= end) return false;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    bool ok = this->range_is_free(start, end) && this->insert_area(start, end, prot_flags, area_flags, true) != nullptr;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return ok;
+}
+
+uint64_t AddressSpace::reserve(uint64_t length, uint64_t alignment, int prot_flags, int area_flags)
+{
+    length = address_space_page_up(length);
+    if (alignment < PAGE_SIZE) alignment = PAGE_SIZE;
+
+    if (length == 0 || (alignment & (alignment - 1)) != 0) return 0;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    uint64_t start = this->areas.find_gap(length, alignment, ADDRESS_SPACE_KERNEL_START, ADDRESS_SPACE_KERNEL_END);
+    // Never merged: vmalloc_size() finds an allocation by its area, and releasing one BAR mustn't take its neighbour along.
+    if (start != 0 && this->insert_area(start, start + length, prot_flags, area_flags | VM_AREA_KERNEL, false) == nullptr) start = 0;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    if (start == 0) kstd::printf("[AS] Out of kernel virtual memory reserving %lx bytes.\n", length);
+
+    return start;
+}
+
+void AddressSpace::release(uint64_t start, uint64_t length)
+{
+    uint64_t end = address_space_page_up(start + length);
+    start = address_space_page_down(start);
+
+    if (ADDRESS_SPACE_KERNEL_START > start || end > ADDRESS_SPACE_KERNEL_END || start >= end) return;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    this->remove_areas(start, end);
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+bool AddressSpace::find_area(uint64_t address, vm_area* area)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    vm_area* found = this->areas.find(address);
+    if (found != nullptr) *area = *found;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return found != nullptr;
+}
+
+uint64_t AddressSpace::map_anonymous(uint64_t hint, uint64_t length, int prot_flags)
+{
+    length = address_space_page_up(length);
+    hint = address_space_page_down(hint);
+
+    if (length == 0 || length > ADDRESS_SPACE_USER_END) return 0;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    uint64_t start = 0;
+    if (hint != 0 && ADDRESS_SPACE_USER_END >= hint + length && hint + length > hint && this->range_is_free(hint, hint + length))
+        start = hint;
+    else
+        start = this->areas.find_gap(length, PAGE_SIZE, ADDRESS_SPACE_MMAP_BASE, ADDRESS_SPACE_USER_END);
+
+    // Nothing gets mapped here, pages show up as they're touched.
+    if (start != 0 && this->insert_area(start, start + length, prot_flags, VM_AREA_ANONYMOUS, true) == nullptr) start = 0;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return start;
+}
+
+bool AddressSpace::unmap(uint64_t start, uint64_t length)
+{
+    if (start % PAGE_SIZE != 0 || length == 0) return false;
+
+    uint64_t end = address_space_page_up(start + length);
+    if (end > ADDRESS_SPACE_USER_END || start >= end) return false;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    this->remove_areas(start, end);
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return true;
+}
+
+void AddressSpace::set_brk_base(uint64_t base)
+{
+    this->brk_start = address_space_page_up(base);
+    this->brk_end = this->brk_start;
+}
+
+uint64_t AddressSpace::set_brk(uint64_t new_end)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    if (new_end >= this->brk_start && ADDRESS_SPACE_USER_END >= new_end)
+    {
+        uint64_t old_top = address_space_page_up(this->brk_end);
+        uint64_t new_top = address_space_page_up(new_end);
+
+        if (new_top > old_top)
+        {
+            // Grows into the area below it, as long as nothing else is in the way.
+            if (this->range_is_free(old_top, new_top) &&
+                this->insert_area(old_top, new_top, PROT_RW | PROT_NOEXEC, VM_AREA_ANONYMOUS | VM_AREA_BRK, true) != nullptr)
+                this->brk_end = new_end;
+        }
+        else
+        {
+            if (old_top > new_top) this->remove_areas(new_top, old_top);
+            this->brk_end = new_end;
+        }
+    }
+
+    uint64_t result = this->brk_end;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return result;
+}
+
+
+AddressSpace* AddressSpace::clone()
+{
+    AddressSpace* child = address_space_create();
+    if (child == nullptr) return nullptr;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    bool current = vmm_get_pml4() == this->pml4_physical;
+    bool ok = true;
+
+    for (vm_area* area = this->areas.first(); area != nullptr && ok; area = VMATree::next(area))
+    {
+        // The kernel's own reservations are in every space already.
+        if (area->area_flags & (VM_AREA_KERNEL | VM_AREA_BOOT)) continue;
+
+        vm_area* copy = address_space_alloc_node();
+        if (copy == nullptr)
+        {
+            ok = false;
+            break;
+        }
+
+        copy->start = area->start;
+        copy->end = area->end;
+        copy->prot_flags = area->prot_flags;
+        copy->area_flags = area->area_flags;
+        child->areas.insert(copy);
+
+        ok = vmm_share_range(this->pml4, child->pml4, area->start, (area->end - area->start) / PAGE_SIZE, current ? MISC_INVLPG : MISC_NONE);
+    }
+
+    child->brk_start = this->brk_start;
+    child->brk_end = this->brk_end;
+
+    if (!current) pcid_flush(this->pcid);
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    if (!ok)
+    {
+        kstd::printf("[AS] Out of memory cloning an address space.\n");
+
+        // Whatever got shared already is just another mapping to drop.
+        address_space_free(child);
+        return nullptr;
+    }
+
+    return child;
+}
+
+bool AddressSpace::handle_fault(uint64_t address, uint64_t error_code)
+{
+    if (error_code & PF_ERROR_RESERVED) return false;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    bool handled = false;
+    vm_area* area = this->areas.find(address);
+
+    bool write = (error_code & PF_ERROR_WRITE) != 0;
+
+    if (area != nullptr && (area->area_flags & VM_AREA_ANONYMOUS) &&
+        !(write && !(area->prot_flags & PROT_RW)) &&
+        !((error_code & PF_ERROR_FETCH) && (area->prot_flags & PROT_NOEXEC)) &&
+        !((error_code & PF_ERROR_USER) && (area->prot_flags & PROT_SUPERVISOR)))
+    {
+        uint64_t page = address_space_page_down(address);
+        uint64_t mapped = vmm_virt_to_phys(this->pml4, page);
+        uint64_t zero_page = vmm_get_zero_page();
+
+        if (!(error_code & PF_ERROR_PRESENT) && zram_is_swap_entry(vmm_get_pte(this->pml4, page)))
+        {
+            // Compressed by the clock scan, comes back in a frame of its own.
+            handled = zram_swap_in(this->pml4, page, area->prot_flags, MISC_INVLPG);
+        }
+        else if (!(error_code & PF_ERROR_PRESENT) && !write)
+        {
+            // Reads share the zero page until the first write.
+            handled = vmm_map_range(this->pml4, page, zero_page, 1, area->prot_flags & ~PROT_RW, MAP_PRESENT, MISC_INVLPG);
+        }
+        else if ((error_code & PF_ERROR_PRESENT) && mapped != zero_page && !pmm_page_is_shared(mapped))
+        {
+            // Copy-on-write frame whose other owners are gone, or another path mapped the page already.
+            vmm_protect_range(this->pml4, page, 1, area->prot_flags, MISC_INVLPG);
+            handled = true;
+        }
+        else
+        {
+            // First write to a page: a fresh frame, a copy of the shared one if there's one.
+            uint64_t frame = pmm_alloc_zeroed_page();
+
+            if (frame == 0)
+            {
+                kstd::printf("[AS] Out of memory on a fault at %lx.\n", address);
+            }
+            else
+            {
+                bool copy = (error_code & PF_ERROR_PRESENT) && mapped != zero_page;
+                if (copy) kstd::memcpy(vmm_make_virtual<void*>(frame), vmm_make_virtual<void*>(mapped), PAGE_SIZE);
+
+                handled = vmm_map_range(this->pml4, page, frame, 1, area->prot_flags, MAP_PRESENT, MISC_INVLPG);
+
+                if (!handled) pmm_free_page(frame);
+                else if (copy) pmm_put_page(mapped);
+            }
+        }
+    }
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return handled;
+}
+
+size_t AddressSpace::swap_out(uint64_t& cursor, size_t pages)
+{
+    uint64_t cold[ZRAM_SCAN_BATCH];
+    size_t swapped = 0;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    bool current = vmm_get_pml4() == this->pml4_physical;
+    int misc_flags = current ? MISC_INVLPG : MISC_NONE;
+
+    vm_area* area = this->areas.first_ending_after(cursor);
+
+    while (area != nullptr && pages > swapped)
+    {
+        if (!(area->area_flags & VM_AREA_ANONYMOUS) || area->start >= ADDRESS_SPACE_USER_END)
+        {
+            area = VMATree::next(area);
+            continue;
+        }
+
+        uint64_t start = cursor > area->start ? cursor : area->start;
+        size_t batch = pages - swapped < ZRAM_SCAN_BATCH ? pages - swapped : ZRAM_SCAN_BATCH;
+
+        size_t count = vmm_collect_cold_pages(this->pml4, start, (area->end - start) / PAGE_SIZE, cold, batch, &cursor, misc_flags);
+
+        for (size_t i = 0; count > i; i++)
+        {
+            if (zram_swap_out(this->pml4, cold[i], misc_flags)) swapped++;
+        }
+
+        if (cursor >= area->end) area = VMATree::next(area);
+    }
+
+    if (area == nullptr) cursor = 0;
+
+    // The TLB may still hold the space under its PCID.
+    if (!current) pcid_flush(this->pcid);
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return swapped;
+}
+
+void address_space_init()
+{
+    pml4e* kernel_pml4 = vmm_make_virtual<pml4e*>(vmm_get_pml4());
+    auto entries = __builtin_bit_cast(uint64_t*, kernel_pml4);
+    size_t allocated = 0;
+
+    address_space_node_cache.init("vm_area", sizeof(vm_area), alignof(vm_area), nullptr);
+    address_space_kernel_space.init(vmm_get_pml4(), PCID_KERNEL);
+
+    // Every PML4 copies these entries, so kernel mappings show up everywhere without syncing.
+    for (size_t i = 256; 512 > i; i++)
+    {
+        uint64_t slot_start = vmm_create_virtual_address(false, i, 0, 0, 0, 0);
+
+        if (entries[i] & VMM_ENTRY_PRESENT)
+        {
+            // Whatever Limine mapped in the reservable range stays out of the way.
+            if (slot_start >= ADDRESS_SPACE_KERNEL_START && ADDRESS_SPACE_KERNEL_END > slot_start)
+                address_space_kernel_space.insert_area(slot_start, slot_start + VMM_PAGES_PER_1G * 512 * PAGE_SIZE, PROT_RW | PROT_SUPERVISOR, VM_AREA_KERNEL | VM_AREA_BOOT, true);
+
+            continue;
+        }
+
+        uint64_t pdpt = pmm_alloc_zeroed_page();
+        if (pdpt == 0)
+        {
+            kstd::printf("[AS] Out of memory preallocating the kernel PDPTs.\n");
+            unreachable();
+        }
+
+        entries[i] = pdpt | VMM_ENTRY_PRESENT | VMM_ENTRY_RW;
+        allocated++;
+    }
+
+    address_space_register(&address_space_kernel_space);
+
+    kstd::printf("[AS] Kernel address space at %lx, %zu kernel PDPTs preallocated, zero page at %lx.\n", vmm_get_pml4(), allocated, vmm_get_zero_page());
+}
+
+AddressSpace* address_space_create()
+{
+    uint64_t pml4 = pmm_alloc_zeroed_page();
+    if (pml4 == 0) return nullptr;
+
+    auto space = new AddressSpace;
+    if (space == nullptr)
+    {
+        pmm_free_page(pml4);
+        return nullptr;
+    }
+
+    space->init(pml4, pcid_alloc());
+
+    // The lower half stays empty, the kernel half references the shared PDPTs.
+    pml4e* kernel_pml4 = address_space_kernel_space.get_pml4();
+    pml4e* entries = space->get_pml4();
+
+    for (size_t i = 256; 512 > i; i++)
+    {
+        entries[i] = kernel_pml4[i];
+    }
+
+    address_space_register(space);
+    return space;
+}
+
+void address_space_free(AddressSpace* space)
+{
+    address_space_unregister(space);
+    space->destroy();
+
+    pmm_free_page(space->get_cr3() & ~PCID_CR3_MASK);
+    pcid_free(space->get_cr3() & PCID_CR3_MASK);
+    delete space;
+}
+
+void address_space_register(AddressSpace* space)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    address_space_list_lock.lock();
+
+    space->next = address_space_list;
+    address_space_list = space;
+
+    address_space_list_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+void address_space_unregister(AddressSpace* space)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    address_space_list_lock.lock();
+
+    AddressSpace** link = &address_space_list;
+    while (*link != nullptr && *link != space) link = &(*link)->next;
+    if (*link != nullptr) *link = space->next;
+
+    address_space_list_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+AddressSpace* address_space_current()
+{
+    uint64_t pml4 = vmm_get_pml4();
+    AddressSpace* found = nullptr;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    address_space_list_lock.lock();
+
+    for (AddressSpace* space = address_space_list; space != nullptr; space = space->next)
+    {
+        if ((space->get_cr3() & ~PCID_CR3_MASK) == pml4)
+        {
+            found = space;
+            break;
+        }
+    }
+
+    address_space_list_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return found;
+}
+
+AddressSpace* address_space_kernel()
+{
+    return &address_space_kernel_space;
+}
+
+bool address_space_handle_page_fault(uint64_t address, uint64_t error_code)
+{
+    // The kernel half is always mapped up front.
+    if (address >= ADDRESS_SPACE_USER_END) return false;
+
+    AddressSpace* space = address_space_current();
+    if (space == nullptr) return false;
+
+    return space->handle_fault(address, error_code);
+}
+
+size_t address_space_reclaim(size_t pages)
+{
+    size_t swapped = 0;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    address_space_list_lock.lock();
+
+    size_t count = 0;
+    AddressSpace* space = nullptr;
+
+    for (AddressSpace* s = address_space_list; s != nullptr; s = s->next)
+    {
+        if (s->get_cr3() == address_space_reclaim_cr3) space = s;
+        count++;
+    }
+
+    // The space the hand was in is gone, start over.
+    if (space == nullptr)
+    {
+        space = address_space_list;
+        address_space_reclaim_cursor = 0;
+    }
+
+    // A space the hand stopped in halfway comes around again at the end, for the part that was skipped.
+    size_t visits = count + (address_space_reclaim_cursor != 0 ? 1 : 0);
+
+    for (size_t visited = 0; space != nullptr && visits > visited && pages > swapped;)
+    {
+        swapped += space->swap_out(address_space_reclaim_cursor, pages - swapped);
+        if (address_space_reclaim_cursor != 0) break;
+
+        space = space->next != nullptr ? space->next : address_space_list;
+        visited++;
+    }
+
+    address_space_reclaim_cr3 = space != nullptr ? space->get_cr3() : 0;
+
+    address_space_list_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return swapped;
+}
+
+/*
+ * Syscalls: the arguments are in rbx, rcx and rdx, the result goes to rax.
+ */
+
+// Ring 0 programs (everything the ELF loader starts for now) get supervisor pages, like their segments.
+static int address_space_syscall_prot(Registers_x86_64* registers, uint64_t prot_flags)
+{
+    int prot = static_cast<int>(prot_flags) & (PROT_RW | PROT_NOEXEC | PROT_SUPERVISOR);
+    if ((registers->cs & 3) == 0) prot |= PROT_SUPERVISOR;
+    return prot;
+}
+
+// mmap(hint, length, prot) -> address, 0 on failure.
+static void address_space_sc_mmap([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    AddressSpace* space = address_space_current();
+
+    registers->rax = space == nullptr ? 0 : space->map_anonymous(registers->rbx, registers->rcx, address_space_syscall_prot(registers, registers->rdx));
+}
+
+// munmap(address, length) -> 0, or -1 on failure.
+static void address_space_sc_munmap([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    AddressSpace* space = address_space_current();
+
+    registers->rax = space != nullptr && space->unmap(registers->rbx, registers->rcx) ? 0 : static_cast<uint64_t>(-1);
+}
+
+// brk(end) -> the new end, the current one if it couldn't be moved (brk(0) only asks).
+static void address_space_sc_brk([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    AddressSpace* space = address_space_current();
+
+    registers->rax = space == nullptr ? 0 : space->set_brk(registers->rbx);
+}
+
+syscall_type syscall_entry address_space_mmap_sce = {
+        .syscall_id = SYSCALL_MMAP,
+        .syscall_function = &address_space_sc_mmap
+};
+
+syscall_type syscall_entry address_space_munmap_sce = {
+        .syscall_id = SYSCALL_MUNMAP,
+        .syscall_function = &address_space_sc_munmap
+};
+
+syscall_type syscall_entry address_space_brk_sce = {
+        .syscall_id = SYSCALL_BRK,
+        .syscall_function = &address_space_sc_brk
+};
@@ -0,0 +1,138 @@
+#ifndef KITTY_OS_CPP_ADDRESS_SPACE_HPP
+#define KITTY_OS_CPP_ADDRESS_SPACE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/vmm.hpp>
+#include <mm/vma_tree.hpp>
+#include <kstd/kmutex.hpp>
+
+/*
+ * Raw defines
+ */
+#define VM_AREA_ANONYMOUS (1 << 0)  // Pages are zero filled on first touch.
+#define VM_AREA_BRK (1 << 1)        // The area brk() moves.
+#define VM_AREA_KERNEL (1 << 2)     // Kernel half range, mapped by whoever reserved it (heap, vmalloc).
+#define VM_AREA_BOOT (1 << 3)       // Kernel half range that was mapped before the address spaces were set up.
+#define VM_AREA_IO (1 << 4)         // Kernel half range mapping device memory, release() leaves the frames alone.
+#define VM_AREA_VMALLOC (1 << 5)    // Kernel half range made by vmalloc().
+
+// Lower half range handed out to mmap() and brk().
+#define ADDRESS_SPACE_USER_END 0x0000800000000000ULL
+#define ADDRESS_SPACE_MMAP_BASE 0x0000700000000000ULL
+#define ADDRESS_SPACE_BRK_BASE 0x0000100000000000ULL   // brk() start when no program set one.
+
+// Kernel half range handed out by AddressSpace::reserve(), PML4 slots 384 - 510. The HHDM sits below it,
+// the kernel image in the last slot.
+#define ADDRESS_SPACE_KERNEL_START 0xFFFFC00000000000ULL
+#define ADDRESS_SPACE_KERNEL_END 0xFFFFFF8000000000ULL
+
+// #PF error code bits.
+#define PF_ERROR_PRESENT (1 << 0)
+#define PF_ERROR_WRITE (1 << 1)
+#define PF_ERROR_USER (1 << 2)
+#define PF_ERROR_RESERVED (1 << 3)
+#define PF_ERROR_FETCH (1 << 4)
+
+/*
+ * Classes
+ */
+
+// Page tables plus the areas that are allowed to be mapped in them. Faults in anonymous areas are resolved
+// on demand: reads map the shared zero page, the first write gets a zeroed frame of its own. Writes to
+// frames shared with a clone copy them first.
+// Every space shares the kernel half: its PDPTs are allocated up front and only ever referenced, so
+// kernel mappings never have to be synced. Kernel half areas are only tracked by the kernel's space.
+class AddressSpace
+{
+private:
+    pml4e* pml4 = nullptr;
+    uint64_t pml4_physical = 0;
+    uint16_t pcid = 0;
+
+    VMATree areas;
+    uint64_t brk_start = 0;
+    uint64_t brk_end = 0;
+
+    kstd::mutex lock;
+
+    bool range_is_free(uint64_t start, uint64_t end);
+    vm_area* insert_area(uint64_t start, uint64_t end, int prot_flags, int area_flags, bool merge);
+    void remove_areas(uint64_t start, uint64_t end);
+    void unmap_pages(uint64_t start, uint64_t end, int area_flags);
+
+    friend void address_space_init();
+public:
+    AddressSpace* next = nullptr;   // Registry of live address spaces.
+
+    // Takes over the page tables at `pml4_physical`, tagged with `pcid`.
+    void init(uint64_t pml4_physical, uint16_t pcid);
+
+    // Unmaps every area and frees the frames behind them, the PML4 itself stays with the caller.
+    void destroy();
+
+    pml4e* get_pml4() const;
+    uint64_t get_cr3() const;
+
+    // Copy-on-write copy of the lower half: same areas, same frames, both sides read-only until written.
+    // Costs the page tables, not the memory behind them. nullptr if there's no memory for it.
+    AddressSpace* clone();
+
+    // Registers [start, start + length) in the lower half without mapping anything, fails if it overlaps another area.
+    bool add_area(uint64_t start, uint64_t length, int prot_flags, int area_flags);
+
+    // Kernel half counterparts, only for the kernel's space. reserve() returns 0 if there's no room,
+    // release() unmaps the range and frees the frames that were mapped there (unless it's VM_AREA_IO).
+    // Every reservation stays an area of its own, so its owner can look it up and release it as a whole.
+    uint64_t reserve(uint64_t length, uint64_t alignment, int prot_flags, int area_flags);
+    void release(uint64_t start, uint64_t length);
+
+    // Copy of the area containing `address`, false if it's in a gap.
+    bool find_area(uint64_t address, vm_area* area);
+
+    // mmap/munmap/brk. map_anonymous() returns 0 on failure, `hint` is only taken if it's free.
+    uint64_t map_anonymous(uint64_t hint, uint64_t length, int prot_flags);
+    bool unmap(uint64_t start, uint64_t length);
+    uint64_t set_brk(uint64_t new_end);
+    void set_brk_base(uint64_t base);
+
+    // Returns false if the fault isn't a legal access to an area.
+    bool handle_fault(uint64_t address, uint64_t error_code);
+
+    // One step of the zram clock: moves `cursor` through the anonymous areas, clearing accessed bits and
+    // compressing the pages that had theirs clear already, until `pages` were swapped out. `cursor` is
+    // 0 again once the whole space was scanned. Returns the pages swapped out.
+    size_t swap_out(uint64_t& cursor, size_t pages);
+
+    size_t get_area_count() const;
+};
+
+/*
+ * Global function definitions
+ */
+
+// Preallocates the kernel half PDPTs and sets up the kernel's space, needs the PMM.
+void address_space_init();
+
+// New space with an empty lower half, the kernel half and a PCID of its own. Registered already,
+// nullptr if there's no memory for it.
+AddressSpace* address_space_create();
+
+// Unregisters and destroys a space made by address_space_create(), its PML4 and PCID included.
+void address_space_free(AddressSpace* space);
+
+void address_space_register(AddressSpace* space);
+void address_space_unregister(AddressSpace* space);
+
+// Address space whose PML4 is loaded, nullptr if it isn't a registered one.
+AddressSpace* address_space_current();
+AddressSpace* address_space_kernel();
+
+// Called from the #PF handler, true if the fault was resolved and the access can be retried.
+bool address_space_handle_page_fault(uint64_t address, uint64_t error_code);
+
+// Runs the zram clock over the registered spaces, picking up where the last call stopped, until `pages`
+// were swapped out or every space was visited once. Returns the pages swapped out.
+size_t address_space_reclaim(size_t pages);
+
+#endif //KITTY_OS_CPP_ADDRESS_SPACE_HPP
@@ -0,0 +1,140 @@
+#include <kstd/kstring.hpp>
+#include <kstd/kstdio.hpp>
+#include "arena.hpp"
+
+static inline uint64_t arena_align_up(uint64_t v, uint64_t alignment)
+{
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+Arena::Arena(void* buffer, size_t size)
+{
+    if (sizeof(arena_chunk) >= size) return;
+
+    auto first = static_cast<arena_chunk*>(buffer);
+    first->prev = nullptr;
+    first->size = size;
+    first->owned = false;
+
+    this->chunk = first;
+    this->top = reinterpret_cast<uint64_t>(first + 1);
+    this->end = reinterpret_cast<uint64_t>(first) + size;
+}
+
+Arena::~Arena()
+{
+    this->reset({ nullptr, 0 });
+}
+
+// New chunk with room for `bytes` at `alignment`. What's left of the current one is given up.
+bool Arena::add_chunk(size_t bytes, size_t alignment)
+{
+    size_t size = sizeof(arena_chunk) + alignment + bytes;
+    if (this->chunk_size > size) size = this->chunk_size;
+
+    auto added = static_cast<arena_chunk*>(kmalloc(size));
+    if (added == nullptr) return false;
+
+    added->prev = this->chunk;
+    added->size = size;
+    added->owned = true;
+
+    this->chunk = added;
+    this->top = reinterpret_cast<uint64_t>(added + 1);
+    this->end = reinterpret_cast<uint64_t>(added) + size;
+
+    return true;
+}
+
+void* Arena::allocate(size_t bytes, size_t alignment)
+{
+    if (alignment == 0) alignment = 1;
+
+    uint64_t start = arena_align_up(this->top, alignment);
+
+    if (this->chunk == nullptr || start + bytes > this->end)
+    {
+        if (!this->add_chunk(bytes, alignment))
+        {
+            kstd::printf("[ARENA] No memory for a new chunk of %zu bytes.\n", bytes);
+            return nullptr;
+        }
+
+        start = arena_align_up(this->top, alignment);
+    }
+
+    this->top = start + bytes;
+    this->last = start;
+
+    return reinterpret_cast<void*>(start);
+}
+
+void* Arena::reallocate(void* ptr, size_t old_bytes, size_t new_bytes, size_t alignment)
+{
+    if (ptr == nullptr) return this->allocate(new_bytes, alignment);
+
+    auto start = reinterpret_cast<uint64_t>(ptr);
+
+    // The latest allocation can move the top, anything else only shrinks in place.
+    if (start == this->last && this->end >= start + new_bytes)
+    {
+        this->top = start + new_bytes;
+        return ptr;
+    }
+
+    if (old_bytes >= new_bytes) return ptr;
+
+    void* moved = this->allocate(new_bytes, alignment);
+    if (moved != nullptr) kstd::memcpy(moved, ptr, old_bytes);
+
+    return moved;
+}
+
+void Arena::deallocate(void* ptr, [[maybe_unused]] size_t bytes)
+{
+    if (ptr == nullptr || reinterpret_cast<uint64_t>(ptr) != this->last) return;
+
+    this->top = this->last;
+    this->last = 0;
+}
+
+arena_mark Arena::mark() const
+{
+    return { this->chunk, this->top };
+}
+
+void Arena::reset(arena_mark mark)
+{
+    while (this->chunk != mark.chunk)
+    {
+        arena_chunk* prev = this->chunk->prev;
+        if (this->chunk->owned) kfree(this->chunk);
+
+        this->chunk = prev;
+    }
+
+    this->top = this->chunk != nullptr ? mark.top : 0;
+    this->end = this->chunk != nullptr ? reinterpret_cast<uint64_t>(this->chunk) + this->chunk->size : 0;
+    this->last = 0;
+}
+
+// Back to empty. The first chunk is kept, so an arena that's reset over and over doesn't go to the heap each time.
+void Arena::reset()
+{
+    arena_chunk* first = this->chunk;
+    if (first == nullptr) return;
+
+    while (first->prev != nullptr) first = first->prev;
+
+    this->reset({ first, reinterpret_cast<uint64_t>(first + 1) });
+}
+
+size_t Arena::get_used() const
+{
+    if (this->chunk == nullptr) return 0;
+
+    size_t used = this->top - reinterpret_cast<uint64_t>(this->chunk);
+    for (arena_chunk* c = this->chunk->prev; c != nullptr; c = c->prev) used += c->size;
+
+    return used;
+}
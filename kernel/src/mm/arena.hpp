@@ -0,0 +1,89 @@
+#ifndef KITTY_OS_CPP_ARENA_HPP
+#define KITTY_OS_CPP_ARENA_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kstd/kmemory_resource.hpp>
+
+/*
+ * Raw defines
+ */
+#define ARENA_CHUNK_SIZE (16 * 1024)    // Chunks taken from the heap, larger allocations get a chunk of their own.
+
+/*
+ * Structs
+ */
+
+// Header at the start of every chunk, the memory handed out follows it.
+struct arena_chunk
+{
+    arena_chunk* prev;
+    size_t size;        // Header included.
+    bool owned;         // Allocated by the arena, false for the buffer it was made with.
+};
+
+// Position in an arena, see Arena::mark().
+struct arena_mark
+{
+    arena_chunk* chunk;
+    uint64_t top;
+};
+
+/*
+ * Classes
+ */
+
+// Bump allocator for objects that die together, e.g. everything a boot phase or a kterm command
+// parses. Allocating moves a pointer, freeing does nothing unless it's the latest allocation (a
+// growing string stays in place that way) and reset() gives back everything at once.
+// Destructors aren't run, containers using the arena have to be gone before it's reset.
+// Not locked, an arena belongs to whoever made it.
+class Arena : public kstd::memory_resource
+{
+private:
+    arena_chunk* chunk = nullptr;
+    uint64_t top = 0;
+    uint64_t end = 0;
+    uint64_t last = 0;          // Start of the latest allocation, 0 if it can't be undone.
+    size_t chunk_size = ARENA_CHUNK_SIZE;
+
+    bool add_chunk(size_t bytes, size_t alignment);
+public:
+    constexpr Arena() = default;
+
+    // The first `size` bytes come from `buffer` (e.g. a stack array), the heap is only used past that.
+    Arena(void* buffer, size_t size);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    // nullptr if the heap can't give a new chunk.
+    void* allocate(size_t bytes, size_t alignment) override;
+    void* reallocate(void* ptr, size_t old_bytes, size_t new_bytes, size_t alignment) override;
+    void deallocate(void* ptr, size_t bytes) override;
+
+    arena_mark mark() const;
+
+    // Drops everything allocated after `mark`, chunks added since go back to the heap.
+    void reset(arena_mark mark);
+    void reset();
+
+    size_t get_used() const;    // Bytes between the chunk starts and the current position, chunk headers and padding included.
+};
+
+// Resets the arena to where it was when the scope was entered.
+class ArenaScope
+{
+private:
+    Arena& arena;
+    arena_mark saved;
+public:
+    explicit ArenaScope(Arena& arena) : arena(arena), saved(arena.mark()) {}
+    ~ArenaScope() { this->arena.reset(this->saved); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+#endif //KITTY_OS_CPP_ARENA_HPP
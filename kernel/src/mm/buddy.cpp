@@ -0,0 +1,188 @@
+#include <mm/vmm.hpp>
+#include <kstd/kstring.hpp>
+#include "buddy.hpp"
+
+static inline size_t buddy_map_words(size_t pages, size_t order)
+{
+    return ((pages >> order) / 64) + 1;
+}
+
+static inline size_t buddy_floor_log2(uint64_t v)
+{
+    return 63 - __builtin_clzll(v);
+}
+
+static inline uint64_t buddy_align_base(uint64_t first_page)
+{
+    return first_page & ~((1ULL << BUDDY_MAX_ORDER) - 1);
+}
+
+size_t BuddyAllocator::metadata_size(uint64_t first_page, size_t pages)
+{
+    pages += first_page - buddy_align_base(first_page);
+
+    size_t size = 0;
+    for (size_t order = 0; BUDDY_ORDER_COUNT > order; order++)
+    {
+        size += buddy_map_words(pages, order) * sizeof(uint64_t);
+    }
+    return size;
+}
+
+void BuddyAllocator::init(void* metadata, uint64_t first_page, size_t pages)
+{
+    this->base_page = buddy_align_base(first_page);
+    pages += first_page - this->base_page;
+
+    this->page_count = pages;
+    this->free_pages = 0;
+    this->nonempty_orders = 0;
+
+    auto map = static_cast<uint64_t*>(metadata);
+    for (size_t order = 0; BUDDY_ORDER_COUNT > order; order++)
+    {
+        this->free_lists[order] = nullptr;
+        this->free_counts[order] = 0;
+        this->free_maps[order] = map;
+        map += buddy_map_words(pages, order);
+    }
+
+    kstd::memset(metadata, 0, metadata_size(this->base_page, pages));
+}
+
+bool BuddyAllocator::is_free(size_t block, size_t order)
+{
+    return (this->free_maps[order][block / 64] & (1ULL << (block % 64))) != 0;
+}
+
+void BuddyAllocator::set_free(size_t block, size_t order, bool state)
+{
+    if (state)
+        this->free_maps[order][block / 64] |= (1ULL << (block % 64));
+    else
+        this->free_maps[order][block / 64] &= ~(1ULL << (block % 64));
+}
+
+void BuddyAllocator::push(uint64_t page, size_t order)
+{
+    auto block = vmm_make_virtual<buddy_free_block*>(page * PAGE_SIZE);
+
+    block->prev = nullptr;
+    block->next = this->free_lists[order];
+    if (block->next != nullptr) block->next->prev = block;
+    this->free_lists[order] = block;
+
+    this->set_free((page - this->base_page) >> order, order, true);
+    this->free_counts[order]++;
+    this->nonempty_orders |= (1U << order);
+}
+
+void BuddyAllocator::remove(uint64_t page, size_t order)
+{
+    auto block = vmm_make_virtual<buddy_free_block*>(page * PAGE_SIZE);
+
+    if (block->prev != nullptr) block->prev->next = block->next;
+    else this->free_lists[order] = block->next;
+    if (block->next != nullptr) block->next->prev = block->prev;
+
+    this->set_free((page - this->base_page) >> order, order, false);
+    if (--this->free_counts[order] == 0) this->nonempty_orders &= ~(1U << order);
+}
+
+uint64_t BuddyAllocator::pop(size_t order)
+{
+    buddy_free_block* block = this->free_lists[order];
+    uint64_t page = (reinterpret_cast<uint64_t>(block) - vmm_hhdm->offset) / PAGE_SIZE;
+
+    this->remove(page, order);
+
+    return page;
+}
+
+void BuddyAllocator::add_range(uint64_t base, uint64_t length)
+{
+    uint64_t page = (base + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end = (base + length) / PAGE_SIZE;
+
+    if (page < this->base_page) page = this->base_page;
+    if (end > this->base_page + this->page_count) end = this->base_page + this->page_count;
+
+    // Page 0 doubles as the failure value of alloc(), never hand it out.
+    if (page == 0) page = 1;
+
+    while (end > page)
+    {
+        size_t order = buddy_floor_log2(end - page);
+        size_t alignment = page == this->base_page ? BUDDY_MAX_ORDER : __builtin_ctzll(page - this->base_page);
+
+        if (order > alignment) order = alignment;
+        if (order > BUDDY_MAX_ORDER) order = BUDDY_MAX_ORDER;
+
+        this->free(page * PAGE_SIZE, order);
+        page += (1ULL << order);
+    }
+}
+
+uint64_t BuddyAllocator::alloc(size_t order)
+{
+    if (order > BUDDY_MAX_ORDER) return 0;
+
+    uint32_t candidates = this->nonempty_orders & ~((1U << order) - 1);
+    if (candidates == 0) return 0;
+
+    size_t current_order = __builtin_ctz(candidates);
+    uint64_t page = this->pop(current_order);
+
+    // Split down, handing the upper halves back to the lower orders.
+    while (current_order > order)
+    {
+        current_order--;
+        this->push(page + (1ULL << current_order), current_order);
+    }
+
+    this->free_pages -= (1ULL << order);
+
+    return page * PAGE_SIZE;
+}
+
+void BuddyAllocator::free(uint64_t addr, size_t order)
+{
+    uint64_t page = addr / PAGE_SIZE - this->base_page;
+
+    this->free_pages += (1ULL << order);
+
+    // Coalesce with the buddy for as long as it's free as a whole.
+    while (BUDDY_MAX_ORDER > order)
+    {
+        uint64_t buddy = page ^ (1ULL << order);
+
+        if (buddy + (1ULL << order) > this->page_count || !this->is_free(buddy >> order, order))
+            break;
+
+        this->remove(this->base_page + buddy, order);
+
+        page &= ~(1ULL << order);
+        order++;
+    }
+
+    this->push(this->base_page + page, order);
+}
+
+size_t BuddyAllocator::get_free_pages() const
+{
+    return this->free_pages;
+}
+
+size_t BuddyAllocator::get_free_blocks(size_t order) const
+{
+    if (order > BUDDY_MAX_ORDER) return 0;
+
+    return this->free_counts[order];
+}
+
+size_t BuddyAllocator::get_largest_free_order() const
+{
+    if (this->nonempty_orders == 0) return 0;
+
+    return 31 - __builtin_clz(this->nonempty_orders);
+}
@@ -0,0 +1,77 @@
+#ifndef KITTY_OS_CPP_BUDDY_HPP
+#define KITTY_OS_CPP_BUDDY_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define BUDDY_MAX_ORDER 18 // 4 KiB << 18 = 1 GiB
+#define BUDDY_ORDER_COUNT (BUDDY_MAX_ORDER + 1)
+
+/*
+ * Structs
+ */
+
+// Lives inside of every free block (accessed through the HHDM).
+struct buddy_free_block
+{
+    buddy_free_block* next;
+    buddy_free_block* prev;
+};
+
+/*
+ * constexpr functions
+ */
+
+// Smallest order that can hold `pages` pages.
+constexpr size_t buddy_order_for_pages(size_t pages)
+{
+    size_t order = 0;
+    while ((static_cast<size_t>(1) << order) < pages) order++;
+    return order;
+}
+
+/*
+ * Classes
+ */
+class BuddyAllocator
+{
+private:
+    buddy_free_block* free_lists[BUDDY_ORDER_COUNT] = {};
+    size_t free_counts[BUDDY_ORDER_COUNT] = {};
+
+    // One bit per block of given order, set when the block sits on the free list.
+    uint64_t* free_maps[BUDDY_ORDER_COUNT] = {};
+
+    // Bit N set = free_lists[N] isn't empty. Lets alloc find the order with one ctz.
+    uint32_t nonempty_orders = 0;
+
+    // Blocks are indexed relative to base_page, which is aligned to the largest block so
+    // that every block stays naturally aligned in physical memory.
+    uint64_t base_page = 0;
+    size_t page_count = 0;
+    size_t free_pages = 0;
+
+    bool is_free(size_t block, size_t order);
+    void set_free(size_t block, size_t order, bool state);
+    void push(uint64_t page, size_t order);
+    void remove(uint64_t page, size_t order);
+    uint64_t pop(size_t order);
+public:
+    // Metadata required to manage pages [first_page, first_page + pages).
+    static size_t metadata_size(uint64_t first_page, size_t pages);
+
+    void init(void* metadata, uint64_t first_page, size_t pages);
+    void add_range(uint64_t base, uint64_t length);
+
+    uint64_t alloc(size_t order); // Returns physical address, 0 on failure.
+    void free(uint64_t addr, size_t order);
+
+    size_t get_free_pages() const;
+    size_t get_free_blocks(size_t order) const;
+    size_t get_largest_free_order() const;
+};
+
+#endif //KITTY_OS_CPP_BUDDY_HPP
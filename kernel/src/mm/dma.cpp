@@ -0,0 +1,237 @@
+#include <kstd/kstdio.hpp>
+#include <kstd/kstring.hpp>
+#include <mm/pmm.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include "dma.hpp"
+
+static DMAPool dma_small_pools[DMA_SMALL_POOL_COUNT];
+static const char* dma_small_pool_names[DMA_SMALL_POOL_COUNT] = {
+        "dma-32", "dma-64", "dma-128", "dma-256", "dma-512", "dma-1k", "dma-2k"
+};
+
+static inline bool dma_is_power_of_two(uint64_t v)
+{
+    return v != 0 && (v & (v - 1)) == 0;
+}
+
+static inline uint64_t dma_align_up(uint64_t v, uint64_t alignment)
+{
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+// Block of 2^order pages that ends at or below `address_limit`, 0 if there's none.
+static uint64_t dma_alloc_block(size_t order, uint64_t address_limit)
+{
+    size_t block_size = PAGE_SIZE << order;
+    pmm_zone_type highest_zone = address_limit > DMA_ADDRESS_LIMIT_32 ? PMM_ZONE_NORMAL : PMM_ZONE_DMA32;
+
+    // Only the zones' upper ends are known, limits between them (ISA's 16 MiB, a 36-bit engine) aren't a zone
+    // of their own. Hold on to blocks that are too high so the next attempt gets a different one.
+    uint64_t rejected[DMA_MAX_ALLOC_ATTEMPTS];
+    size_t rejected_count = 0;
+    uint64_t block = 0;
+
+    while (DMA_MAX_ALLOC_ATTEMPTS > rejected_count)
+    {
+        uint64_t candidate = pmm_alloc_pages_node(order, PMM_NODE_LOCAL, highest_zone);
+        if (candidate == 0) break;
+
+        if (candidate + block_size - 1 <= address_limit)
+        {
+            block = candidate;
+            break;
+        }
+
+        rejected[rejected_count++] = candidate;
+    }
+
+    for (size_t i = 0; i < rejected_count; i++)
+    {
+        pmm_free_pages(rejected[i], order);
+    }
+
+    // Anything below 4 GiB is below a limit above it.
+    if (block == 0 && highest_zone == PMM_ZONE_NORMAL) block = pmm_alloc_pages_node(order, PMM_NODE_LOCAL, PMM_ZONE_DMA32);
+
+    return block;
+}
+
+void dma_init()
+{
+    for (size_t i = 0; DMA_SMALL_POOL_COUNT > i; i++)
+    {
+        size_t size = DMA_SMALL_POOL_MIN_SIZE << i;
+
+        // Naturally aligned, so they can't cross any boundary that's at least their size.
+        dma_small_pools[i].init(dma_small_pool_names[i], size, size, DMA_NO_BOUNDARY, DMA_ADDRESS_LIMIT_32);
+    }
+}
+
+dma_buffer dma_alloc(size_t size, size_t alignment, uint64_t boundary, uint64_t address_limit)
+{
+    if (size == 0) return {};
+
+    if (alignment == 0) alignment = 1;
+
+    if (!dma_is_power_of_two(alignment) || (boundary != DMA_NO_BOUNDARY && !dma_is_power_of_two(boundary)))
+    {
+        kstd::printf("[DMA] Alignment %zu and boundary %lx have to be powers of two.\n", alignment, boundary);
+        return {};
+    }
+
+    // Small buffers: the first size class that covers both the size and the alignment.
+    for (size_t i = 0; DMA_SMALL_POOL_COUNT > i; i++)
+    {
+        size_t class_size = DMA_SMALL_POOL_MIN_SIZE << i;
+
+        if (size > class_size || alignment > class_size) continue;
+        if (boundary != DMA_NO_BOUNDARY && class_size > boundary) break;
+        if (DMA_ADDRESS_LIMIT_32 > address_limit) break;
+
+        return dma_small_pools[i].alloc();
+    }
+
+    // Whole blocks. Buddy blocks are aligned to their size, so one that's not larger than the
+    // boundary can't cross it.
+    size_t block_size = size > alignment ? size : alignment;
+    size_t order = buddy_order_for_pages((block_size + PAGE_SIZE - 1) / PAGE_SIZE);
+
+    if (order > BUDDY_MAX_ORDER || (boundary != DMA_NO_BOUNDARY && (static_cast<uint64_t>(PAGE_SIZE) << order) > boundary))
+    {
+        kstd::printf("[DMA] Can't allocate %zu bytes aligned to %zu within a %lx boundary.\n", size, alignment, boundary);
+        return {};
+    }
+
+    uint64_t phys = dma_alloc_block(order, address_limit);
+    if (phys == 0) return {};
+
+    auto virt = vmm_make_virtual<void*>(phys);
+    kstd::memset(virt, 0, PAGE_SIZE << order);
+
+    return {
+            .virt = virt,
+            .phys = phys,
+            .size = size,
+            .pool = nullptr,
+            .order = order
+    };
+}
+
+void dma_free(const dma_buffer& buffer)
+{
+    if (buffer.virt == nullptr) return;
+
+    if (buffer.pool != nullptr)
+    {
+        buffer.pool->free(buffer);
+        return;
+    }
+
+    pmm_free_pages(buffer.phys, buffer.order);
+}
+
+bool DMAPool::init(const char* name, size_t object_size, size_t alignment, uint64_t boundary, uint64_t address_limit)
+{
+    if (alignment < alignof(dma_pool_free_object)) alignment = alignof(dma_pool_free_object);
+
+    this->name = name;
+    this->object_size = object_size < sizeof(dma_pool_free_object) ? sizeof(dma_pool_free_object) : object_size;
+    this->stride = dma_align_up(this->object_size, alignment);
+    this->boundary = boundary;
+    this->address_limit = address_limit;
+    this->block_order = buddy_order_for_pages((this->stride + PAGE_SIZE - 1) / PAGE_SIZE);
+    this->free_list = nullptr;
+
+    if (!dma_is_power_of_two(alignment) || (boundary != DMA_NO_BOUNDARY && (!dma_is_power_of_two(boundary) || this->object_size > boundary)))
+    {
+        kstd::printf("[DMA] Pool \"%s\": objects of %zu bytes can't meet alignment %zu and boundary %lx.\n", name, object_size, alignment, boundary);
+        this->object_size = 0;
+        return false;
+    }
+
+    return true;
+}
+
+// Carves a new block into objects, pool lock has to be held.
+bool DMAPool::grow()
+{
+    uint64_t phys = dma_alloc_block(this->block_order, this->address_limit);
+    if (phys == 0) return false;
+
+    auto virt = vmm_make_virtual<uint8_t*>(phys);
+    size_t block_size = PAGE_SIZE << this->block_order;
+    size_t offset = 0;
+
+    while (block_size >= offset + this->object_size)
+    {
+        // Blocks are aligned to their size, so offsets tell where the boundaries are.
+        if (this->boundary != DMA_NO_BOUNDARY && offset / this->boundary != (offset + this->object_size - 1) / this->boundary)
+        {
+            offset = dma_align_up(offset, this->boundary);
+            continue;
+        }
+
+        auto object = reinterpret_cast<dma_pool_free_object*>(virt + offset);
+        object->next = this->free_list;
+        object->phys = phys + offset;
+        this->free_list = object;
+
+        offset += this->stride;
+    }
+
+    return true;
+}
+
+dma_buffer DMAPool::alloc()
+{
+    if (this->object_size == 0) return {};
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    if (this->free_list == nullptr && !this->grow())
+    {
+        this->lock.unlock();
+        cpu_restore_interrupts(flags);
+
+        kstd::printf("[DMA] Pool \"%s\" is out of memory.\n", this->name);
+        return {};
+    }
+
+    dma_pool_free_object* object = this->free_list;
+    this->free_list = object->next;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    uint64_t phys = object->phys;
+    kstd::memset(object, 0, this->object_size);
+
+    return {
+            .virt = object,
+            .phys = phys,
+            .size = this->object_size,
+            .pool = this,
+            .order = 0
+    };
+}
+
+void DMAPool::free(const dma_buffer& buffer)
+{
+    auto object = static_cast<dma_pool_free_object*>(buffer.virt);
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    this->lock.lock();
+
+    object->phys = buffer.phys;
+    object->next = this->free_list;
+    this->free_list = object;
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+size_t DMAPool::get_object_size() const
+{
+    return this->object_size;
+}
@@ -0,0 +1,81 @@
+#ifndef KITTY_OS_CPP_DMA_HPP
+#define KITTY_OS_CPP_DMA_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <kstd/kmutex.hpp>
+
+/*
+ * Raw defines
+ */
+#define DMA_NO_BOUNDARY 0
+#define DMA_ADDRESS_LIMIT_32 0xFFFFFFFFULL  // Highest address a 32-bit DMA engine can reach.
+#define DMA_ADDRESS_LIMIT_64 UINT64_MAX
+#define DMA_SMALL_POOL_MIN_SIZE 32
+#define DMA_SMALL_POOL_COUNT 7              // Power of two size classes, 32 B - 2 KiB.
+#define DMA_MAX_ALLOC_ATTEMPTS 16           // Blocks tried before giving up on an address limit below 4 GiB.
+
+/*
+ * Structs
+ */
+class DMAPool;
+
+// Memory a device can access. `virt` is an HHDM pointer, `phys` is what gets programmed into the device.
+struct dma_buffer
+{
+    void* virt;
+    uint64_t phys;
+    size_t size;
+    DMAPool* pool;  // Pool the buffer came from, nullptr for whole blocks.
+    size_t order;   // Buddy order of whole blocks.
+};
+
+// Free pool objects keep the link and their own physical address.
+struct dma_pool_free_object
+{
+    dma_pool_free_object* next;
+    uint64_t phys;
+};
+
+/*
+ * Global function definitions
+ */
+void dma_init();
+
+// Physically contiguous, zeroed buffer of `size` bytes. `alignment` and `boundary` have to be powers of two
+// (or DMA_NO_BOUNDARY), the buffer never crosses a multiple of `boundary` and ends at or below `address_limit`.
+// Small buffers come from the per-size pools. Returns a buffer with virt == nullptr on failure.
+dma_buffer dma_alloc(size_t size, size_t alignment, uint64_t boundary, uint64_t address_limit);
+void dma_free(const dma_buffer& buffer);
+
+/*
+ * Classes
+ */
+
+// Fixed size objects (e.g. AHCI command tables) carved out of DMA blocks, so descriptors don't take a page each.
+// Pools only grow, their blocks are never given back.
+class DMAPool
+{
+private:
+    const char* name = nullptr;
+    size_t object_size = 0;
+    size_t stride = 0;
+    uint64_t boundary = DMA_NO_BOUNDARY;
+    uint64_t address_limit = DMA_ADDRESS_LIMIT_64;
+    size_t block_order = 0;
+
+    dma_pool_free_object* free_list = nullptr;
+    kstd::mutex lock;
+
+    bool grow();
+public:
+    // Returns false if the constraints can't be met (e.g. an object larger than `boundary`).
+    bool init(const char* name, size_t object_size, size_t alignment, uint64_t boundary, uint64_t address_limit);
+
+    dma_buffer alloc();
+    void free(const dma_buffer& buffer);
+
+    size_t get_object_size() const;
+};
+
+#endif //KITTY_OS_CPP_DMA_HPP
@@ -2,12 +2,26 @@
 // Created by Piotr on 30.05.2024.
 //
 
+#include <mm/slab.hpp>
+#include <mm/heap_profile.hpp>
 #include "heap.hpp"
 
+// Small objects come from the slab caches, the rest from the heap. kfree() takes both.
+// `caller` is whoever used new, for the heap profiler.
+static inline void* new_alloc(size_t size, void* caller)
+{
+    void* ptr = slab_kmalloc(size);
+    if (ptr == nullptr) ptr = heap_alloc(size);
+
+    heap_profile_alloc(ptr, size, caller);
+
+    return ptr;
+}
+
 // Overload new operator
 void* operator new(size_t size) {
     // kstd::printf("[ALLOC] Size: %llx\n", size);
-    return kmalloc(size);
+    return new_alloc(size, __builtin_return_address(0));
 }
 
 // Overload delete operator
@@ -17,7 +31,7 @@ void operator delete(void* ptr) noexcept {
 
 // Overload new[] operator
 void* operator new[](size_t size) {
-    return kmalloc(size);
+    return new_alloc(size, __builtin_return_address(0));
 }
 
 // Overload delete[] operator
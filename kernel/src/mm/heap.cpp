@@ -2,272 +2,902 @@
 // Created by Piotr on 13.05.2024.
 //
 
+#include <mm/address_space.hpp>
+#include <mm/slab.hpp>
+#include <mm/heap_profile.hpp>
+#include <mm/vmalloc.hpp>
+#include <mm/shrinker.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include <kstd/kstring.hpp>
 #include "heap.hpp"
 
-void Heap::init()
+// Frames mapped per vmm_map_frames() call when committing.
+constexpr size_t heap_commit_batch = 64;
+
+// Every arena gets 64 GiB of kernel virtual memory, all of them are reserved in one go so the arena
+// a pointer belongs to follows from its address.
+constexpr size_t heap_arena_pages = 64ULL * 512ULL * 512ULL;
+
+static inline size_t heap_block_size(size_t length)
+{
+    return length + 2 * sizeof(malloc_tag);
+}
+
+static inline malloc_tag* heap_footer(malloc_tag* block)
+{
+    return reinterpret_cast<malloc_tag*>(reinterpret_cast<uint8_t*>(block) + sizeof(malloc_tag) + block->length);
+}
+
+static inline malloc_tag* heap_next_block(malloc_tag* block)
+{
+    return heap_footer(block) + 1;
+}
+
+static inline void heap_set_block(malloc_tag* block, size_t length, malloc_state state, uint32_t flags)
+{
+    block->length = length;
+    block->state = state;
+    block->flags = flags;
+
+    malloc_tag* footer = heap_footer(block);
+    footer->length = length;
+    footer->state = state;
+    footer->flags = flags;
+}
+
+static inline uint64_t heap_page_down(uint64_t v)
+{
+    return v & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+}
+
+static inline uint64_t heap_page_up(uint64_t v)
+{
+    return (v + PAGE_SIZE - 1) & ~(static_cast<uint64_t>(PAGE_SIZE) - 1);
+}
+
+static inline size_t heap_round_length(size_t len)
 {
-    this->pml4_entry = 0;
-    this->last_pte_entry = 0;
-    this->last_pde_entry = 0;
-    this->last_pdpe_entry = 0;
+    size_t length = len > HEAP_MIN_PAYLOAD ? len : HEAP_MIN_PAYLOAD;
+    return (length + HEAP_ALIGNMENT - 1) & ~static_cast<size_t>(HEAP_ALIGNMENT - 1);
+}
 
-    // Find free pml4e entry.
+static inline size_t heap_bin_index(size_t length)
+{
+    if (HEAP_SMALL_BIN_COUNT * HEAP_ALIGNMENT >= length) return length / HEAP_ALIGNMENT - 1;
+
+    // 1 KiB < length, so the log is at least 10.
+    size_t index = HEAP_SMALL_BIN_COUNT + (63 - __builtin_clzll(length)) - 10;
+    return index < HEAP_BIN_COUNT ? index : HEAP_BIN_COUNT - 1;
+}
 
-    // Get pml4e
+void Heap::init(uint64_t base)
+{
     this->pml4e_pointer = vmm_make_virtual<struct pml4e*>(vmm_get_pml4());
+    this->base_address = base;
+
+    this->commit_page();
+}
+
+
+bool Heap::commit_page()
+{
+    return this->commit_pages(1);
+}
+
+bool Heap::commit_pages(size_t count)
+{
+    if (count == 0) return true;
+
+    // Large commits end on a 2 MiB boundary, so the next large one can use 2 MiB pages as well.
+    if (count >= VMM_PAGES_PER_2M)
+    {
+        size_t end = this->committed_memory_pages + count;
+        end = (end + VMM_PAGES_PER_2M - 1) / VMM_PAGES_PER_2M * VMM_PAGES_PER_2M;
+        count = end - this->committed_memory_pages;
+    }
+
+    if (this->committed_memory_pages + count > heap_arena_pages)
+    {
+        kstd::printf("[HEAP] Out of virtual memory.\n");
+        return false;
+    }
+
+    // The heap grows linearly, new pages go right after the committed ones.
+    uint64_t va = this->base_address + this->committed_memory_pages * PAGE_SIZE;
+    uint64_t frames[heap_commit_batch];
+    size_t done = 0;
+    bool ok = true;
 
-    for (size_t i = 500; 512 > i; i++)
+    while (count > done)
     {
-        if (this->pml4e_pointer[i].pdpe_ptr == 0)
+        uint64_t batch_va = va + done * PAGE_SIZE;
+        size_t to_boundary = VMM_PAGES_PER_2M - (batch_va / PAGE_SIZE) % VMM_PAGES_PER_2M;
+
+        // Whole 2 MiB blocks get a single 2 MiB page, the heap is scanned linearly and that's a lot fewer TLB misses.
+        if (to_boundary == VMM_PAGES_PER_2M && count - done >= VMM_PAGES_PER_2M)
         {
-            this->pml4_entry = i;
+            uint64_t block = pmm_alloc_pages(buddy_order_for_pages(VMM_PAGES_PER_2M));
+
+            if (block != 0)
+            {
+                if (!vmm_map_range(this->pml4e_pointer, batch_va, block, VMM_PAGES_PER_2M, PROT_SUPERVISOR | PROT_RW, MAP_PRESENT | MAP_GLOBAL, MISC_INVLPG))
+                {
+                    // Whatever got mapped is unmapped again, the block goes back whole.
+                    vmm_unmap_range(this->pml4e_pointer, batch_va, VMM_PAGES_PER_2M, MISC_INVLPG);
+                    pmm_free_pages(block, buddy_order_for_pages(VMM_PAGES_PER_2M));
+
+                    ok = false;
+                    break;
+                }
+
+                done += VMM_PAGES_PER_2M;
+                continue;
+            }
+
+            // Too fragmented for a 2 MiB block, fall back to single frames.
+        }
+
+        size_t batch = count - done < heap_commit_batch ? count - done : heap_commit_batch;
+        if (batch > to_boundary) batch = to_boundary;
 
+        size_t allocated = 0;
+
+        while (batch > allocated)
+        {
+            frames[allocated] = pmm_alloc_page();
+            if (frames[allocated] == 0) break;
+
+            allocated++;
+        }
+
+        if (allocated != batch || !vmm_map_frames(this->pml4e_pointer, batch_va, frames, batch, PROT_SUPERVISOR | PROT_RW, MAP_PRESENT | MAP_GLOBAL, MISC_INVLPG))
+        {
+            // A failed map may have mapped part of the batch, those frames go back with the unmap.
+            for (size_t i = 0; allocated > i; i++)
+            {
+                if (vmm_virt_to_phys(this->pml4e_pointer, batch_va + i * PAGE_SIZE) == 0) pmm_free_page(frames[i]);
+            }
+
+            vmm_unmap_range(this->pml4e_pointer, batch_va, allocated, MISC_FREE_FRAMES | MISC_INVLPG);
+
+            ok = false;
             break;
         }
+
+        done += batch;
     }
 
-    this->base_address = vmm_create_virtual_address(false, this->pml4_entry, 0, 0, 0, 0);
+    if (done == 0) return false;
 
-    this->commit_page();
-}
+    // The new pages are one free block, merged with the last block if that's free.
+    auto block = reinterpret_cast<malloc_tag*>(va);
+    heap_set_block(block, done * PAGE_SIZE - 2 * sizeof(malloc_tag), MALLOC_STATE_FREE, 0);
+
+    this->committed_memory_pages += done;
+    this->entry_count++;
 
+    this->release_block(block);
+
+    return ok;
+}
 
-void Heap::commit_page()
+uint64_t Heap::top() const
 {
-    void* page = reinterpret_cast<void*>(pmm_alloc_page());
+    return this->base_address + this->committed_memory_pages * PAGE_SIZE;
+}
 
-    if (page == nullptr)
+// First non-empty bin at or after `index`, HEAP_BIN_COUNT if there's none.
+size_t Heap::next_bin(size_t index) const
+{
+    while (HEAP_BIN_COUNT > index)
     {
-        kstd::printf("Failure commiting a page!\n");
-        unreachable();
+        uint64_t word = this->bin_map[index / 64] >> (index % 64);
+        if (word != 0) return index + __builtin_ctzll(word);
+
+        index = (index / 64 + 1) * 64;
     }
 
-    // map the memory
-    if (this->last_pte_entry >= 512)
+    return HEAP_BIN_COUNT;
+}
+
+void Heap::bin_insert(malloc_tag* block)
+{
+    size_t index = heap_bin_index(block->length);
+    auto free_block = reinterpret_cast<malloc_free_block*>(block);
+
+    free_block->prev = nullptr;
+    free_block->next = this->bins[index];
+    if (free_block->next != nullptr) free_block->next->prev = free_block;
+
+    this->bins[index] = free_block;
+    this->bin_map[index / 64] |= 1ULL << (index % 64);
+}
+
+void Heap::bin_remove(malloc_tag* block)
+{
+    size_t index = heap_bin_index(block->length);
+    auto free_block = reinterpret_cast<malloc_free_block*>(block);
+
+    if (free_block->prev != nullptr) free_block->prev->next = free_block->next;
+    else this->bins[index] = free_block->next;
+
+    if (free_block->next != nullptr) free_block->next->prev = free_block->prev;
+
+    if (this->bins[index] == nullptr) this->bin_map[index / 64] &= ~(1ULL << (index % 64));
+}
+
+// Free block with at least `length` bytes of payload, still in its bin. nullptr if there's none.
+malloc_tag* Heap::find_block(size_t length)
+{
+    size_t index = this->next_bin(heap_bin_index(length));
+
+    // Small bins hold a single length, large ones a range of them: best fit in the first one.
+    if (HEAP_BIN_COUNT > index && heap_bin_index(length) == index)
     {
-        this->last_pte_entry = 0;
-        this->last_pde_entry ++;
+        malloc_free_block* best = nullptr;
+
+        for (malloc_free_block* block = this->bins[index]; block != nullptr; block = block->next)
+        {
+            if (length > block->tag.length) continue;
+            if (best == nullptr || best->tag.length > block->tag.length) best = block;
+            if (block->tag.length == length) break;
+        }
+
+        if (best != nullptr) return &best->tag;
+
+        index = this->next_bin(index + 1);
     }
 
-    if (this->last_pde_entry >= 512)
+    // Everything in a larger bin fits.
+    if (index == HEAP_BIN_COUNT) return nullptr;
+
+    return &this->bins[index]->tag;
+}
+
+// Marks `block` free, merges it with free neighbours and puts the result in its bin.
+malloc_tag* Heap::release_block(malloc_tag* block)
+{
+    size_t length = block->length;
+    uint32_t flags = block->flags;
+    this->available_memory += heap_block_size(length);
+
+    if (reinterpret_cast<uint64_t>(block) != this->base_address)
     {
-        this->last_pde_entry = 0;
-        this->last_pdpe_entry ++;
+        malloc_tag* previous_footer = block - 1;
+
+        if (previous_footer->state == MALLOC_STATE_FREE)
+        {
+            auto previous = reinterpret_cast<malloc_tag*>(reinterpret_cast<uint8_t*>(block) - heap_block_size(previous_footer->length));
+
+            this->bin_remove(previous);
+            length += heap_block_size(previous->length);
+            flags |= previous->flags;
+            block = previous;
+            this->entry_count--;
+        }
     }
 
-    if (this->last_pdpe_entry >= 512)
+    malloc_tag* next = reinterpret_cast<malloc_tag*>(reinterpret_cast<uint8_t*>(block) + heap_block_size(length));
+
+    if (this->top() > reinterpret_cast<uint64_t>(next) && next->state == MALLOC_STATE_FREE)
     {
-        kstd::printf("Out of virtual memory!\n");
-        unreachable();
+        this->bin_remove(next);
+        length += heap_block_size(next->length);
+        flags |= next->flags;
+        this->entry_count--;
     }
 
-    // page it in
-    uint64_t va = vmm_create_virtual_address(false, this->pml4_entry, this->last_pdpe_entry, this->last_pde_entry, this->last_pte_entry, 0);
-    // kstd::printf("[HEAP] Entry: %llx %llx %llx %llx\n",this->pml4_entry, this->last_pdpe_entry, this->last_pde_entry, this->last_pte_entry );
-    bool ok = vmm_map(
-            this->pml4e_pointer,
-            va,
-            reinterpret_cast<uint64_t>(page),
-            PROT_SUPERVISOR | PROT_RW,
-            MAP_PRESENT,
-            MISC_INVLPG
-    );
+    heap_set_block(block, length, MALLOC_STATE_FREE, flags);
+    this->bin_insert(block);
 
-    if (!ok)
-    {
-        kstd::printf("Failed to map memory to heap.\n");
-        bochs_breakpoint();
+    return block;
+}
 
-        unreachable();
-    }
+// Unmaps the whole pages inside a free block if `policy` allows it. Its tags and links stay mapped.
+// Returns the frames that went back to the PMM.
+size_t Heap::decommit(malloc_tag* block, const heap_decommit_policy& policy)
+{
+    uint64_t start = heap_page_up(reinterpret_cast<uint64_t>(block) + sizeof(malloc_free_block));
+    uint64_t end = heap_page_down(reinterpret_cast<uint64_t>(heap_footer(block)));
 
-    this->last_pte_entry ++;
+    if (start >= end || policy.min_bytes > end - start) return 0;
 
-    // tag the memory
-    struct malloc_tag* tag = reinterpret_cast<struct malloc_tag*>(va);
+    size_t resident_free = this->available_memory - this->decommitted_pages * PAGE_SIZE;
+    if (policy.retain_bytes >= resident_free) return 0;
 
-    tag->state = MALLOC_STATE_FREE;
-    tag->length = 4096 - sizeof (struct malloc_tag);
+    size_t unmapped = vmm_unmap_range(this->pml4e_pointer, start, (end - start) / PAGE_SIZE, MISC_FREE_FRAMES | MISC_INVLPG);
+    this->decommitted_pages += unmapped;
 
-    // update the commitment memory.
-    this->available_memory += (4096 - sizeof(struct malloc_tag));
-    this->committed_memory_pages ++;
-    this->entry_count ++;
+    block->flags |= HEAP_BLOCK_DECOMMITTED;
+    heap_footer(block)->flags |= HEAP_BLOCK_DECOMMITTED;
 
-    merge_blocks();
+    return unmapped;
+}
+
+// Maps fresh frames wherever [start, end) was decommitted. False if memory ran out, the pages mapped
+// until then stay mapped.
+bool Heap::recommit(uint64_t start, uint64_t end)
+{
+    for (uint64_t va = start; end > va; va += PAGE_SIZE)
+    {
+        if (vmm_virt_to_phys(this->pml4e_pointer, va) != 0) continue;
+
+        uint64_t frame = pmm_alloc_page();
+        if (frame == 0) return false;
+
+        if (!vmm_map_range(this->pml4e_pointer, va, frame, 1, PROT_SUPERVISOR | PROT_RW, MAP_PRESENT | MAP_GLOBAL, MISC_NONE))
+        {
+            pmm_free_page(frame);
+            return false;
+        }
+
+        this->decommitted_pages--;
+    }
+
+    return true;
 }
 
 void Heap::print_memory_entries()
 {
-    uintptr_t current_address = this->base_address;
+    auto block = reinterpret_cast<malloc_tag*>(this->base_address);
 
-    // Iterate through memory for each entry
+    // Blocks tile the heap, each one starts where the previous one ends.
     for (size_t i = 0; i < this->entry_count; i++)
     {
-        // Cast the current address to a malloc_tag pointer
-        struct malloc_tag* tag = reinterpret_cast<struct malloc_tag*>(current_address);
-
-        // Print details of the current entry
-        kstd::printf("Memory Entry at Address: %p\n", reinterpret_cast<void*>(current_address));
-        kstd::printf("    State: %d\n", tag->state);
-        kstd::printf("    Length: %ld bytes\n", tag->length);
+        kstd::printf("Memory Entry at Address: %p\n", static_cast<void*>(block));
+        kstd::printf("    State: %d\n", block->state);
+        kstd::printf("    Length: %ld bytes\n", block->length);
 
-        // Move to the next memory entry
-        current_address += tag->length + sizeof(struct malloc_tag);
+        block = heap_next_block(block);
     }
 }
 
-void Heap::merge_block() {
-    uintptr_t current_address = this->base_address;
+void* Heap::alloc_normal(size_t len)
+{
+    size_t length = heap_round_length(len);
 
-    // Iterate through memory for each entry
-    for (size_t i = 0; i < this->entry_count - 1; i++) {
-        struct malloc_tag *tag = reinterpret_cast<struct malloc_tag *>(current_address);
-        struct malloc_tag *next_tag = reinterpret_cast<struct malloc_tag *>(reinterpret_cast<uintptr_t>(tag) + sizeof(struct malloc_tag) + tag->length); // Corrected next_tag calculation
+    malloc_tag* block = this->find_block(length);
 
-        if (current_address >= committed_memory_pages * 4096 + base_address) return;
-        if (reinterpret_cast<uint64_t>(tag) + tag->length + sizeof(struct malloc_tag) >= committed_memory_pages * 4096 + base_address) return;
+    if (block == nullptr)
+    {
+        // The new pages merge with a free block at the end, only the rest has to be committed.
+        size_t needed = heap_block_size(length);
 
-        if (tag->state == MALLOC_STATE_FREE && next_tag->state == MALLOC_STATE_FREE)
+        if (this->committed_memory_pages != 0)
         {
-            tag->length += sizeof(struct malloc_tag) + next_tag->length;
-            tag->state = MALLOC_STATE_FREE; // Set current tag state to free
-            this->entry_count --;
-
-            return;
+            auto last_footer = reinterpret_cast<malloc_tag*>(this->top()) - 1;
+            if (last_footer->state == MALLOC_STATE_FREE) needed -= heap_block_size(last_footer->length);
         }
 
-        current_address += sizeof(struct malloc_tag) + tag->length; // Adjusting the address correctly
+        // A commit that ran out halfway still leaves its pages behind, they may be enough.
+        this->commit_pages((needed + PAGE_SIZE - 1) / PAGE_SIZE);
+
+        block = this->find_block(length);
+        if (block == nullptr) return nullptr;
+    }
+
+    // Split off the rest if it can be a block of its own.
+    size_t remainder = block->length - length;
+    bool split = remainder >= heap_block_size(HEAP_MIN_PAYLOAD);
+    uint32_t flags = block->flags;
+
+    // Whatever the new block and the rest's tag and links land on has to be mapped again, the rest
+    // stays decommitted beyond that. Done first, the block stays free if there's no memory for it.
+    if (flags & HEAP_BLOCK_DECOMMITTED)
+    {
+        uint64_t start = reinterpret_cast<uint64_t>(block);
+        uint64_t end = start + (split ? heap_block_size(length) + sizeof(malloc_free_block) : heap_block_size(block->length));
+
+        if (!this->recommit(heap_page_down(start), heap_page_up(end))) return nullptr;
     }
+
+    this->bin_remove(block);
+    this->available_memory -= heap_block_size(block->length);
+
+    if (split)
+    {
+        heap_set_block(block, length, MALLOC_STATE_USED, 0);
+
+        malloc_tag* rest = heap_next_block(block);
+        heap_set_block(rest, remainder - 2 * sizeof(malloc_tag), MALLOC_STATE_FREE, flags);
+
+        this->available_memory += remainder;
+        this->bin_insert(rest);
+        this->entry_count++;
+    }
+    else
+    {
+        heap_set_block(block, block->length, MALLOC_STATE_USED, 0);
+    }
+
+    this->used_memory += heap_block_size(block->length);
+
+    return block + 1;
 }
 
-void* Heap::alloc_normal(size_t len)
+// Gives the end of a used block past `length` back as a free block, if it's big enough to be one.
+// `flags` are the rest's, HEAP_BLOCK_DECOMMITTED if part of it may still be unmapped.
+void Heap::shrink_block(malloc_tag* block, size_t length, uint32_t flags)
 {
-    // Calculate size of tag structure once
-    size_t tag_size = sizeof(struct malloc_tag);
+    size_t remainder = block->length - length;
+    if (heap_block_size(HEAP_MIN_PAYLOAD) > remainder) return;
 
-    if (len > heap_get_available_memory()) {
-        for (size_t i = 0; (len + 4095) / 4096 > i; i++) {
-            commit_page();
-        }
-    }
+    heap_set_block(block, length, MALLOC_STATE_USED, 0);
 
-    try_again:
-    // Get the first entry.
-    struct malloc_tag* this_tag = reinterpret_cast<struct malloc_tag*>(this->base_address);
+    malloc_tag* rest = heap_next_block(block);
+    heap_set_block(rest, remainder - 2 * sizeof(malloc_tag), MALLOC_STATE_USED, flags);
 
-    // Align length to a multiple of 32
-    len += (32 - (len % 32)) % 32;
+    this->used_memory -= remainder;
+    this->entry_count++;
+    this->release_block(rest);
+}
 
-    // Iterate through the tags to find a suitable free block.
-    for (size_t i = 0; i < this->entry_count; i++)
+void* Heap::alloc_aligned(size_t len, size_t alignment)
+{
+    if (HEAP_ALIGNMENT >= alignment) return this->alloc_normal(len);
+
+    size_t length = heap_round_length(len);
+
+    // Enough to move the payload up to an aligned address and leave a free block in front of it.
+    void* allocated = this->alloc_normal(length + alignment + heap_block_size(HEAP_MIN_PAYLOAD));
+    if (allocated == nullptr) return nullptr;
+
+    malloc_tag* block = static_cast<malloc_tag*>(allocated) - 1;
+
+    auto payload = reinterpret_cast<uint64_t>(block + 1);
+    uint64_t aligned = (payload + alignment - 1) & ~static_cast<uint64_t>(alignment - 1);
+
+    if (aligned != payload)
     {
-        if (this_tag->state == MALLOC_STATE_FREE && this_tag->length >= (len + tag_size))
-        {
-            // Found a suitable free block.
-            // Record the original length.
-            uint64_t original_length = this_tag->length;
+        while (heap_block_size(HEAP_MIN_PAYLOAD) > aligned - payload) aligned += alignment;
+
+        size_t front = aligned - payload;
+        size_t total = block->length;
+
+        malloc_tag* moved = reinterpret_cast<malloc_tag*>(aligned) - 1;
+        heap_set_block(block, front - 2 * sizeof(malloc_tag), MALLOC_STATE_USED, 0);
+        heap_set_block(moved, total - front, MALLOC_STATE_USED, 0);
+
+        this->used_memory -= front;
+        this->entry_count++;
+        this->release_block(block);
+
+        block = moved;
+    }
 
-            // Adjust the length of the current tag to reflect the allocated block.
-            this_tag->length = len;
-            this_tag->state = MALLOC_STATE_USED;
+    this->shrink_block(block, length, 0);
 
-            // Calculate the address for the new tag.
-            struct malloc_tag* new_tag = reinterpret_cast<struct malloc_tag*>(reinterpret_cast<uintptr_t>(this_tag) + len + tag_size);
+    return block + 1;
+}
 
-            // Set up the new tag with the remaining length.
-            new_tag->length = original_length - len - tag_size;
-            new_tag->state = MALLOC_STATE_FREE;
+bool Heap::resize(void* ptr, size_t len)
+{
+    malloc_tag* block = static_cast<malloc_tag*>(ptr) - 1;
+    size_t length = heap_round_length(len);
 
-            // Update entry count to reflect the new free block.
-            this->entry_count++;
+    if (block->length >= length)
+    {
+        this->shrink_block(block, length, 0);
+        return true;
+    }
 
-            // Update available and used memory.
-            this->available_memory -= (len + tag_size);
-            this->used_memory += (len + tag_size);
+    // Grow into the next block if it's free and large enough.
+    malloc_tag* next = heap_next_block(block);
 
+    if (this->top() > reinterpret_cast<uint64_t>(next) && next->state == MALLOC_STATE_FREE &&
+        block->length + heap_block_size(next->length) >= length)
+    {
+        // No memory to map what the block grows into, it moves instead (and probably fails there too).
+        uint32_t flags = next->flags;
+        if (flags & HEAP_BLOCK_DECOMMITTED)
+        {
+            uint64_t end = reinterpret_cast<uint64_t>(block) + heap_block_size(length) + sizeof(malloc_free_block);
+            uint64_t next_end = reinterpret_cast<uint64_t>(heap_next_block(next));
 
-            // Return the address after the current tag's metadata.
-            return reinterpret_cast<void*>(reinterpret_cast<uintptr_t>(this_tag) + tag_size);
+            if (!this->recommit(heap_page_down(reinterpret_cast<uint64_t>(next)), heap_page_up(end < next_end ? end : next_end))) return false;
         }
 
-        // Move to the next tag.
-        this_tag = reinterpret_cast<struct malloc_tag*>(reinterpret_cast<uintptr_t>(this_tag) + this_tag->length + tag_size);
+        this->bin_remove(next);
+        this->available_memory -= heap_block_size(next->length);
+        this->used_memory += heap_block_size(next->length);
+
+        heap_set_block(block, block->length + heap_block_size(next->length), MALLOC_STATE_USED, 0);
+        this->entry_count--;
+
+        this->shrink_block(block, length, flags);
+        return true;
     }
 
-    commit_page();
-    goto try_again;
+    return false;
+}
+
+size_t Heap::usable_size(const void* ptr) const
+{
+    const malloc_tag* block = static_cast<const malloc_tag*>(ptr) - 1;
+
+    return block->state == MALLOC_STATE_USED ? block->length : 0;
 }
 
 void Heap::free(void* ptr)
 {
-    // Check if ptr is nullptr
-    if (ptr == nullptr) {
-        return; // Nothing to free
+    if (ptr == nullptr) return;
+
+    malloc_tag* block = static_cast<malloc_tag*>(ptr) - 1;
+
+    if (block->state != MALLOC_STATE_USED)
+    {
+        kstd::printf("[HEAP] Freeing %p, which isn't allocated.\n", ptr);
+        return;
+    }
+
+    this->used_memory -= heap_block_size(block->length);
+    this->decommit(this->release_block(block), this->decommit_policy);
+}
+
+// Can be called from any CPU. The block stays allocated until the owner drains its list, the
+// HEAP_BLOCK_REMOTE_FREE bit catches a second free in the meantime.
+void Heap::free_remote(void* ptr)
+{
+    malloc_tag* block = static_cast<malloc_tag*>(ptr) - 1;
+
+    if (block->state != MALLOC_STATE_USED ||
+        (__atomic_fetch_or(&block->flags, HEAP_BLOCK_REMOTE_FREE, __ATOMIC_ACQ_REL) & HEAP_BLOCK_REMOTE_FREE))
+    {
+        kstd::printf("[HEAP] Freeing %p, which isn't allocated.\n", ptr);
+        return;
     }
 
-    // Calculate the address of the corresponding malloc_tag
-    struct malloc_tag* tag_to_free = reinterpret_cast<struct malloc_tag*>(reinterpret_cast<uint64_t>(ptr) - sizeof(struct malloc_tag));
+    auto link = reinterpret_cast<malloc_free_block*>(block);
+    malloc_free_block* head = this->remote_frees.load(std::memory_order_relaxed);
+
+    do
+    {
+        link->next = head;
+    } while (!this->remote_frees.compare_exchange_weak(head, link, std::memory_order_release, std::memory_order_relaxed));
+}
+
+// Owner only. Takes the whole list at once, so there's no ABA to worry about.
+void Heap::drain_remote_frees()
+{
+    if (this->remote_frees.load(std::memory_order_relaxed) == nullptr) return;
 
-    // Mark the tag as free
-    tag_to_free->state = MALLOC_STATE_FREE;
+    malloc_free_block* link = this->remote_frees.exchange(nullptr, std::memory_order_acquire);
+
+    while (link != nullptr)
+    {
+        malloc_free_block* next = link->next;
 
-    // Update used_memory and available_memory
-    this->used_memory -= (tag_to_free->length + sizeof(struct malloc_tag));
-    this->available_memory += (tag_to_free->length + sizeof(struct malloc_tag));
+        link->tag.flags &= ~HEAP_BLOCK_REMOTE_FREE;
+        this->free(&link->tag + 1);
 
-    // kstd::printf("Freed memory: %llx.\n", ptr);
+        link = next;
+    }
 }
 
-static Heap heap;
+size_t Heap::trim(size_t pages)
+{
+    constexpr heap_decommit_policy everything = { 0, PAGE_SIZE };
+    size_t freed = 0;
 
-void merge_blocks() {
-    size_t current_blk_count = heap.entry_count;
-    size_t this_blk_count = 0;
-    while (current_blk_count != this_blk_count) {
-        heap.merge_block();
-        this_blk_count = current_blk_count;
-        current_blk_count = heap.entry_count;
+    // Large bins first, their blocks give the most pages per unmap.
+    for (size_t index = HEAP_BIN_COUNT; index > 0 && pages > freed; index--)
+    {
+        for (malloc_free_block* block = this->bins[index - 1]; block != nullptr && pages > freed; block = block->next)
+        {
+            freed += this->decommit(&block->tag, everything);
+        }
     }
+
+    return freed;
+}
+
+static Heap heap_arenas[CPU_MAX_COUNT];
+static uint64_t heap_arenas_base = 0;
+
+// Arena of the calling CPU, set up on its first allocation. Interrupts have to be disabled.
+static Heap* heap_local_arena()
+{
+    Heap* arena = &heap_arenas[cpu_current_id()];
+
+    if (arena->base_address == 0) arena->init(heap_arenas_base + cpu_current_id() * heap_arena_pages * PAGE_SIZE);
+    arena->drain_remote_frees();
+
+    return arena;
+}
+
+// nullptr if `ptr` isn't in any arena.
+static Heap* heap_arena_of(const void* ptr)
+{
+    auto address = reinterpret_cast<uint64_t>(ptr);
+
+    if (heap_arenas_base == 0 || heap_arenas_base > address) return nullptr;
+
+    size_t index = (address - heap_arenas_base) / (heap_arena_pages * PAGE_SIZE);
+    return CPU_MAX_COUNT > index && heap_arenas[index].base_address != 0 ? &heap_arenas[index] : nullptr;
 }
 
 void heap_print_entries()
 {
-    heap.print_memory_entries();
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_local_arena()->print_memory_entries();
+    cpu_restore_interrupts(flags);
+}
+
+// Runs `alloc` on the local arena with interrupts disabled. If that comes back empty, the shrinkers run
+// once the arena is left alone again and `alloc` gets another go.
+template <typename Alloc>
+static void* heap_alloc_retry(size_t len, Alloc alloc)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    void* ptr = alloc(heap_local_arena());
+    cpu_restore_interrupts(flags);
+
+    if (ptr != nullptr || !pmm_direct_reclaim(len / PAGE_SIZE + 1)) return ptr;
+
+    flags = cpu_save_and_disable_interrupts();
+    ptr = alloc(heap_local_arena());
+    cpu_restore_interrupts(flags);
+
+    return ptr;
+}
+
+void* heap_alloc(size_t len)
+{
+    // Large allocations get pages of their own, the heap stays made of small blocks.
+    if (len >= VMALLOC_THRESHOLD) return vmalloc(len);
+
+    void* ptr = heap_alloc_retry(len, [len](Heap* arena) { return arena->alloc_normal(len); });
+    if (ptr == nullptr) kstd::printf("[HEAP] Out of memory allocating %zu bytes.\n", len);
+
+    return ptr;
+}
+
+void heap_free(void* ptr)
+{
+    if (ptr == nullptr) return;
+
+    if (slab_owns(ptr))
+    {
+        slab_free(ptr);
+        return;
+    }
+
+    Heap* arena = heap_arena_of(ptr);
+    if (arena == nullptr)
+    {
+        if (vmalloc_size(ptr) != 0) vfree(ptr);
+        else kstd::printf("[HEAP] Freeing %p, which isn't heap memory.\n", ptr);
+
+        return;
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    if (arena == &heap_arenas[cpu_current_id()]) arena->free(ptr);
+    else arena->free_remote(ptr);
+
+    cpu_restore_interrupts(flags);
 }
 
 void* kmalloc(size_t len)
 {
-    return heap.alloc_normal(len);
+    void* ptr = heap_alloc(len);
+    heap_profile_alloc(ptr, len, __builtin_return_address(0));
+
+    return ptr;
+}
+
+void* kmalloc_aligned(size_t len, size_t alignment)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        kstd::printf("[HEAP] Alignment %zu isn't a power of two.\n", alignment);
+        return nullptr;
+    }
+
+    void* ptr;
+
+    if (len >= VMALLOC_THRESHOLD && PAGE_SIZE >= alignment)
+    {
+        ptr = vmalloc(len);
+    }
+    else
+    {
+        ptr = heap_alloc_retry(len + alignment, [len, alignment](Heap* arena) { return arena->alloc_aligned(len, alignment); });
+        if (ptr == nullptr) kstd::printf("[HEAP] Out of memory allocating %zu bytes.\n", len);
+    }
+
+    heap_profile_alloc(ptr, len, __builtin_return_address(0));
+
+    return ptr;
+}
+
+void* krealloc(void* ptr, size_t len)
+{
+    void* caller = __builtin_return_address(0);
+
+    if (ptr == nullptr)
+    {
+        void* allocated = heap_alloc(len);
+        heap_profile_alloc(allocated, len, caller);
+
+        return allocated;
+    }
+
+    // The profiler sees a resize as a free and a new allocation.
+    heap_profile_free(ptr);
+
+    if (len == 0)
+    {
+        heap_free(ptr);
+        return nullptr;
+    }
+
+    size_t size;
+    void* moved = nullptr;
+
+    // Slab objects can't grow, anything larger than their class moves.
+    if (slab_owns(ptr))
+    {
+        size = slab_object_size(ptr);
+        if (size >= len)
+        {
+            heap_profile_alloc(ptr, len, caller);
+            return ptr;
+        }
+
+        moved = slab_kmalloc(len);
+    }
+    else if (heap_arena_of(ptr) == nullptr)
+    {
+        // vmalloc() mappings stay put while the pages they have are enough and the size still calls for one.
+        size = vmalloc_size(ptr);
+
+        if (size == 0)
+        {
+            kstd::printf("[HEAP] Reallocating %p, which isn't allocated.\n", ptr);
+            return nullptr;
+        }
+
+        if (size >= len && len >= VMALLOC_THRESHOLD)
+        {
+            heap_profile_alloc(ptr, len, caller);
+            return ptr;
+        }
+    }
+    else
+    {
+        Heap* arena = heap_arena_of(ptr);
+        size = arena->usable_size(ptr);
+
+        if (size == 0)
+        {
+            kstd::printf("[HEAP] Reallocating %p, which isn't allocated.\n", ptr);
+            return nullptr;
+        }
+
+        // Only the owner resizes in place, blocks of other arenas always move.
+        uint64_t flags = cpu_save_and_disable_interrupts();
+        bool resized = arena == &heap_arenas[cpu_current_id()] && arena->resize(ptr, len);
+        cpu_restore_interrupts(flags);
+
+        if (resized)
+        {
+            heap_profile_alloc(ptr, len, caller);
+            return ptr;
+        }
+    }
+
+    // The copy runs with interrupts enabled.
+    if (moved == nullptr) moved = heap_alloc(len);
+
+    // Out of memory, the block stays where it was and what it was.
+    if (moved == nullptr)
+    {
+        heap_profile_alloc(ptr, size, caller);
+        return nullptr;
+    }
+
+    kstd::memcpy(moved, ptr, size < len ? size : len);
+    heap_free(ptr);
+
+    heap_profile_alloc(moved, len, caller);
+
+    return moved;
 }
 
 void kfree(void* ptr)
 {
-    heap.free(ptr);
+    heap_profile_free(ptr);
+    heap_free(ptr);
 }
 
 void commit_page()
 {
-    heap.commit_page();
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    if (!heap_local_arena()->commit_page()) kstd::printf("[HEAP] Out of memory committing a page.\n");
+    cpu_restore_interrupts(flags);
 }
 
+// Free heap pages that are still mapped. Only the local arena is trimmed, the others belong to their CPUs.
+static size_t heap_shrinker_count()
+{
+    const Heap& arena = heap_arenas[cpu_current_id()];
+    size_t free_pages = arena.available_memory / PAGE_SIZE;
+
+    return free_pages > arena.decommitted_pages ? free_pages - arena.decommitted_pages : 0;
+}
+
+static size_t heap_shrinker_scan(size_t pages)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    size_t freed = heap_local_arena()->trim(pages);
+    cpu_restore_interrupts(flags);
+
+    return freed;
+}
+
+static shrinker heap_shrinker = {
+        .name = "heap",
+        .count = heap_shrinker_count,
+        .scan = heap_shrinker_scan,
+        .next = nullptr,
+        .exhausted = false
+};
+
 void heap_init()
 {
-    heap.init();
+    // 1 GiB aligned, so large commits can use huge pages.
+    heap_arenas_base = address_space_kernel()->reserve(CPU_MAX_COUNT * heap_arena_pages * PAGE_SIZE, VMM_PAGES_PER_1G * PAGE_SIZE, PROT_SUPERVISOR | PROT_RW, 0);
+    if (heap_arenas_base == 0)
+    {
+        kstd::printf("[HEAP] No kernel virtual memory left for the heap.\n");
+        unreachable();
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_local_arena();
+    cpu_restore_interrupts(flags);
+
+    shrinker_register(&heap_shrinker);
 }
 
+// The counters below add up every arena. Other CPUs' arenas may change while they're read, the
+// result is a snapshot and not exact.
 
 uint64_t heap_get_available_memory()
 {
-    return heap.available_memory;
+    uint64_t total = 0;
+    for (const Heap& arena : heap_arenas) total += arena.available_memory;
+
+    return total;
 }
 
 uint64_t heap_get_used_memory()
 {
-    return heap.used_memory;
+    uint64_t total = 0;
+    for (const Heap& arena : heap_arenas) total += arena.used_memory;
+
+    return total;
 }
 
 uint64_t heap_get_used_virtual_memory()
 {
-    return heap.committed_memory_pages * 4096;
-}
\ No newline at end of file
+    uint64_t total = 0;
+    for (const Heap& arena : heap_arenas) total += arena.committed_memory_pages * PAGE_SIZE;
+
+    return total;
+}
+
+uint64_t heap_get_resident_memory()
+{
+    uint64_t total = 0;
+    for (const Heap& arena : heap_arenas) total += (arena.committed_memory_pages - arena.decommitted_pages) * PAGE_SIZE;
+
+    return total;
+}
+
+void heap_set_decommit_policy(const heap_decommit_policy& policy)
+{
+    for (Heap& arena : heap_arenas) arena.decommit_policy = policy;
+}
@@ -7,11 +7,29 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <atomic>
 #include <sys/types.h>
 #include <kstd/kstdio.hpp>
 #include <mm/pmm.hpp>
 #include <mm/vmm.hpp>
 #include <arch/x64/control/control.hpp>
+#include <mm/kmalloc.hpp>
+
+/*
+ * Raw defines
+ */
+#define HEAP_ALIGNMENT 16
+#define HEAP_MIN_PAYLOAD 16         // Room for the free list links.
+#define HEAP_SMALL_BIN_COUNT 64     // One bin per size up to 1 KiB, HEAP_ALIGNMENT apart.
+#define HEAP_BIN_COUNT 96           // Past that one bin per power of two, the last one takes everything bigger.
+
+// malloc_tag flags.
+#define HEAP_BLOCK_DECOMMITTED (1 << 0) // Free block whose inner pages may be unmapped, see Heap::decommit().
+#define HEAP_BLOCK_REMOTE_FREE (1 << 1) // Used block waiting on its arena's remote free list.
+
+// Default decommit policy.
+#define HEAP_DECOMMIT_RETAIN (1024 * 1024)
+#define HEAP_DECOMMIT_MIN (64 * 1024)
 
 enum malloc_state
 {
@@ -19,48 +37,108 @@ enum malloc_state
     MALLOC_STATE_USED
 };
 
+// Boundary tag, there's one at each end of a block. `length` is the payload between them, so a block
+// takes length + 2 * sizeof(malloc_tag) bytes. The trailing one lets free() find the block in front.
 struct malloc_tag
 {
     size_t length;
     malloc_state state;
+    uint32_t flags;
+};
+
+// Free blocks keep their bin links at the start of the payload.
+struct malloc_free_block
+{
+    malloc_tag tag;
+    malloc_free_block* prev;
+    malloc_free_block* next;
 };
 
+// Whole pages inside free blocks are handed back to the PMM, but only once more than `retain_bytes` of free
+// heap memory is mapped and only for spans of at least `min_bytes`. Sizes that are freed and allocated
+// again right away stay mapped that way, instead of being unmapped and mapped over and over.
+struct heap_decommit_policy
+{
+    size_t retain_bytes;
+    size_t min_bytes;
+};
+
+// Blocks tile [base_address, base_address + committed pages) with no gaps. Free blocks are coalesced with
+// their neighbours as soon as they're freed and sit in a bin by size, allocation takes the best fit of
+// the first bin that could hold the length and the first block of any larger one.
+// Every CPU has a Heap of its own (an arena) and is the only one touching it, with interrupts disabled,
+// so there's no lock. Other CPUs hand blocks back through free_remote(), a lock-free list the owner
+// drains before it allocates.
 class Heap
 {
 private:
     pml4e* pml4e_pointer = nullptr;
-    size_t pml4_entry = 0;
 
-    // Last entries where we mapped data.
-    size_t last_pdpe_entry = 0;
-    size_t last_pde_entry = 0;
-    size_t last_pte_entry = 0;
+    malloc_free_block* bins[HEAP_BIN_COUNT] = {};
+    uint64_t bin_map[(HEAP_BIN_COUNT + 63) / 64] = {};  // Bit per non-empty bin.
+
+    std::atomic<malloc_free_block*> remote_frees = nullptr; // Linked through `next`, blocks are still used.
+
+    uint64_t top() const;
+    size_t next_bin(size_t index) const;
+    void bin_insert(malloc_tag* block);
+    void bin_remove(malloc_tag* block);
+    malloc_tag* find_block(size_t length);
+    malloc_tag* release_block(malloc_tag* block);
+    size_t decommit(malloc_tag* block, const heap_decommit_policy& policy);
+    bool recommit(uint64_t start, uint64_t end);
+    void shrink_block(malloc_tag* block, size_t length, uint32_t flags);
 public:
-    // Free memory
+    heap_decommit_policy decommit_policy = { HEAP_DECOMMIT_RETAIN, HEAP_DECOMMIT_MIN };
+
+    // Bytes in used and free blocks, tags included. They add up to the committed memory.
     size_t available_memory = 0;
     size_t used_memory = 0;
 
-    size_t committed_memory_pages = 0;
+    size_t committed_memory_pages = 0;  // The heap's extent, decommitted pages included.
+    size_t decommitted_pages = 0;
     uint64_t base_address = 0;
     size_t entry_count = 0;
 
-    void init();
-    void commit_page(); // Add page and map it.
+    void init(uint64_t base);
+    bool commit_page(); // Add page and map it.
+
+    // Add `count` pages, mapped in one go and merged with a free block at the end. False if memory ran out,
+    // whatever was committed until then is still added.
+    bool commit_pages(size_t count);
     void free(void* ptr);
-    void merge_block();
     void print_memory_entries();
 
+    // nullptr if the heap can't grow.
     void* alloc_normal(size_t len);
+    void* alloc_aligned(size_t len, size_t alignment);
+
+    // Shrinks the block or grows it into a free block behind it, false if it would have to move.
+    bool resize(void* ptr, size_t len);
+
+    // Payload of a used block, 0 if `ptr` isn't allocated. Safe from any CPU.
+    size_t usable_size(const void* ptr) const;
+
+    void free_remote(void* ptr);
+    void drain_remote_frees();
+
+    // Unmaps the free pages of the largest free blocks first, ignoring the decommit policy, until about
+    // `pages` frames went back. Returns how many did.
+    size_t trim(size_t pages);
 };
 
 void heap_init();
-void* kmalloc(size_t len);
-void kfree(void* ptr);
+
+// kmalloc() and kfree() without the profiler hooks, for allocator entry points that record their own caller.
+void* heap_alloc(size_t len);
+void heap_free(void* ptr);
+
 void commit_page();
-void merge_blocks();
 void heap_print_entries();
 uint64_t heap_get_available_memory();
 uint64_t heap_get_used_memory();
 uint64_t heap_get_used_virtual_memory();
+uint64_t heap_get_resident_memory();   // Heap memory that's actually backed by frames.
+void heap_set_decommit_policy(const heap_decommit_policy& policy);
 
 #endif //KITTY_OS_CPP_HEAP_HPP
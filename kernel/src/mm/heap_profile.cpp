@@ -0,0 +1,293 @@
+#include <kstd/kstdio.hpp>
+#include <kstd/kstring.hpp>
+#include <kstd/kmutex.hpp>
+#include <kernel/clock.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include "heap_profile.hpp"
+
+bool heap_profile_enabled = false;
+
+// Open addressing with linear probing. The tables are static, the profiler can't allocate from the
+// heap it watches. Always taken with interrupts disabled.
+static kstd::mutex heap_profile_lock;
+
+static heap_profile_allocation heap_profile_live[HEAP_PROFILE_MAX_LIVE];
+static heap_profile_site heap_profile_sites[HEAP_PROFILE_MAX_SITES];
+static uint64_t heap_profile_histogram[HEAP_PROFILE_SIZE_CLASSES];
+
+static size_t heap_profile_live_count = 0;
+static size_t heap_profile_site_count = 0;
+static uint64_t heap_profile_live_bytes = 0;
+static uint64_t heap_profile_peak_bytes = 0;
+static uint64_t heap_profile_dropped = 0;      // Allocations that didn't fit the tables.
+static uint64_t heap_profile_start_ticks = 0;
+
+static inline size_t heap_profile_hash(uint64_t key, size_t capacity)
+{
+    return ((key >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & (capacity - 1);
+}
+
+static inline size_t heap_profile_size_class(size_t size)
+{
+    size_t size_class = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+    return HEAP_PROFILE_SIZE_CLASSES > size_class ? size_class : HEAP_PROFILE_SIZE_CLASSES - 1;
+}
+
+// Slot of `caller`'s site, added if it's new. HEAP_PROFILE_MAX_SITES if the table is full.
+static size_t heap_profile_find_site(uint64_t caller)
+{
+    size_t index = heap_profile_hash(caller, HEAP_PROFILE_MAX_SITES);
+
+    while (heap_profile_sites[index].caller != 0)
+    {
+        if (heap_profile_sites[index].caller == caller) return index;
+        index = (index + 1) & (HEAP_PROFILE_MAX_SITES - 1);
+    }
+
+    // Kept at most 3/4 full, probes stay short.
+    if (heap_profile_site_count >= HEAP_PROFILE_MAX_SITES / 4 * 3) return HEAP_PROFILE_MAX_SITES;
+
+    heap_profile_sites[index] = {};
+    heap_profile_sites[index].caller = caller;
+    heap_profile_site_count++;
+
+    return index;
+}
+
+// Slot of `ptr` in the live table, HEAP_PROFILE_MAX_LIVE if it isn't there.
+static size_t heap_profile_find_live(uint64_t ptr)
+{
+    size_t index = heap_profile_hash(ptr, HEAP_PROFILE_MAX_LIVE);
+
+    while (heap_profile_live[index].ptr != 0)
+    {
+        if (heap_profile_live[index].ptr == ptr) return index;
+        index = (index + 1) & (HEAP_PROFILE_MAX_LIVE - 1);
+    }
+
+    return HEAP_PROFILE_MAX_LIVE;
+}
+
+// Empties a live slot, entries after it move back so no probe sequence gets cut short.
+static void heap_profile_remove_live(size_t index)
+{
+    size_t next = (index + 1) & (HEAP_PROFILE_MAX_LIVE - 1);
+
+    while (heap_profile_live[next].ptr != 0)
+    {
+        size_t home = heap_profile_hash(heap_profile_live[next].ptr, HEAP_PROFILE_MAX_LIVE);
+
+        // Moves if its home slot isn't between the hole and where it sits now.
+        bool moves = index > next ? (home <= index && home > next) : (home <= index || home > next);
+        if (moves)
+        {
+            heap_profile_live[index] = heap_profile_live[next];
+            index = next;
+        }
+
+        next = (next + 1) & (HEAP_PROFILE_MAX_LIVE - 1);
+    }
+
+    heap_profile_live[index].ptr = 0;
+    heap_profile_live_count--;
+}
+
+void heap_profile_start()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_profile_lock.lock();
+
+    kstd::memset(heap_profile_live, 0, sizeof(heap_profile_live));
+    kstd::memset(heap_profile_sites, 0, sizeof(heap_profile_sites));
+    kstd::memset(heap_profile_histogram, 0, sizeof(heap_profile_histogram));
+
+    heap_profile_live_count = 0;
+    heap_profile_site_count = 0;
+    heap_profile_live_bytes = 0;
+    heap_profile_peak_bytes = 0;
+    heap_profile_dropped = 0;
+    heap_profile_start_ticks = clk_get_ticks();
+
+    heap_profile_enabled = true;
+
+    heap_profile_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+void heap_profile_stop()
+{
+    heap_profile_enabled = false;
+}
+
+void heap_profile_record_alloc(const void* ptr, size_t size, const void* caller)
+{
+    auto address = reinterpret_cast<uint64_t>(ptr);
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_profile_lock.lock();
+
+    heap_profile_histogram[heap_profile_size_class(size)]++;
+
+    size_t site = heap_profile_find_site(reinterpret_cast<uint64_t>(caller));
+
+    if (site == HEAP_PROFILE_MAX_SITES || heap_profile_live_count >= HEAP_PROFILE_MAX_LIVE / 4 * 3)
+    {
+        heap_profile_dropped++;
+    }
+    else
+    {
+        size_t index = heap_profile_hash(address, HEAP_PROFILE_MAX_LIVE);
+        while (heap_profile_live[index].ptr != 0) index = (index + 1) & (HEAP_PROFILE_MAX_LIVE - 1);
+
+        heap_profile_live[index] = {
+                .ptr = address,
+                .size = size,
+                .timestamp = clk_get_ticks(),
+                .site = static_cast<uint32_t>(site)
+        };
+        heap_profile_live_count++;
+
+        heap_profile_site& s = heap_profile_sites[site];
+        s.allocs++;
+        s.total_bytes += size;
+        s.live_bytes += size;
+        s.live_count++;
+
+        heap_profile_live_bytes += size;
+        if (heap_profile_live_bytes > heap_profile_peak_bytes) heap_profile_peak_bytes = heap_profile_live_bytes;
+    }
+
+    heap_profile_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+void heap_profile_record_free(const void* ptr)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_profile_lock.lock();
+
+    // Allocations made before heap_profile_start() or dropped ones aren't in the table.
+    size_t index = heap_profile_find_live(reinterpret_cast<uint64_t>(ptr));
+
+    if (index != HEAP_PROFILE_MAX_LIVE)
+    {
+        heap_profile_allocation& allocation = heap_profile_live[index];
+        heap_profile_site& s = heap_profile_sites[allocation.site];
+
+        s.frees++;
+        s.live_bytes -= allocation.size;
+        s.live_count--;
+        heap_profile_live_bytes -= allocation.size;
+
+        heap_profile_remove_live(index);
+    }
+
+    heap_profile_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+// Up to `max` sites ordered by `key`, highest first, skipping the ones `filter` rejects. `oldest` gets the
+// timestamp of every site's oldest live allocation, if it isn't nullptr.
+template <typename Key, typename Filter>
+static size_t heap_profile_top_sites(heap_profile_site* out, uint64_t* oldest, size_t max, Key key, Filter filter)
+{
+    size_t picked[HEAP_PROFILE_TOP_SITES];
+    size_t count = 0;
+
+    while (max > count)
+    {
+        size_t best = HEAP_PROFILE_MAX_SITES;
+
+        for (size_t i = 0; HEAP_PROFILE_MAX_SITES > i; i++)
+        {
+            const heap_profile_site& s = heap_profile_sites[i];
+            if (s.caller == 0 || !filter(s)) continue;
+
+            bool taken = false;
+            for (size_t j = 0; count > j; j++) taken |= picked[j] == i;
+
+            if (!taken && (best == HEAP_PROFILE_MAX_SITES || key(s) > key(heap_profile_sites[best]))) best = i;
+        }
+
+        if (best == HEAP_PROFILE_MAX_SITES) break;
+
+        picked[count] = best;
+        out[count] = heap_profile_sites[best];
+        if (oldest != nullptr) oldest[count] = UINT64_MAX;
+        count++;
+    }
+
+    if (oldest == nullptr) return count;
+
+    // Age of the oldest live allocation of every picked site.
+    for (size_t i = 0; HEAP_PROFILE_MAX_LIVE > i; i++)
+    {
+        if (heap_profile_live[i].ptr == 0) continue;
+
+        for (size_t j = 0; count > j; j++)
+        {
+            if (heap_profile_live[i].site == picked[j] && oldest[j] > heap_profile_live[i].timestamp) oldest[j] = heap_profile_live[i].timestamp;
+        }
+    }
+
+    return count;
+}
+
+void heap_profile_print()
+{
+    heap_profile_site top[HEAP_PROFILE_TOP_SITES];
+    heap_profile_site leaks[HEAP_PROFILE_TOP_SITES];
+    uint64_t leak_oldest[HEAP_PROFILE_TOP_SITES];
+    uint64_t histogram[HEAP_PROFILE_SIZE_CLASSES];
+
+    // Everything is copied out under the lock, printing may allocate.
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    heap_profile_lock.lock();
+
+    size_t top_count = heap_profile_top_sites(top, nullptr, HEAP_PROFILE_TOP_SITES,
+            [](const heap_profile_site& s) { return s.total_bytes; },
+            [](const heap_profile_site&) { return true; });
+
+    size_t leak_count = heap_profile_top_sites(leaks, leak_oldest, HEAP_PROFILE_TOP_SITES,
+            [](const heap_profile_site& s) { return s.live_bytes; },
+            [](const heap_profile_site& s) { return s.live_count >= HEAP_PROFILE_LEAK_MIN_LIVE && s.allocs > s.frees * 4; });
+
+    kstd::memcpy(histogram, heap_profile_histogram, sizeof(histogram));
+
+    uint64_t live_bytes = heap_profile_live_bytes;
+    uint64_t peak_bytes = heap_profile_peak_bytes;
+    uint64_t live_count = heap_profile_live_count;
+    uint64_t dropped = heap_profile_dropped;
+    uint64_t start_ticks = heap_profile_start_ticks;
+    bool enabled = heap_profile_enabled;
+
+    heap_profile_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    uint64_t now = clk_get_ticks();
+
+    kstd::printf("Heap profile (%s, %lu ms):\n", enabled ? "recording" : "stopped", clk_ticks_to_ms(now - start_ticks));
+    kstd::printf("    Live: %lu bytes in %lu allocations, peak %lu bytes, %lu dropped\n", live_bytes, live_count, peak_bytes, dropped);
+
+    kstd::printf("Top allocators:\n");
+    for (size_t i = 0; top_count > i; i++)
+    {
+        kstd::printf("    %p: %lu bytes in %lu allocs, %lu frees, %lu bytes live\n",
+                reinterpret_cast<void*>(top[i].caller), top[i].total_bytes, top[i].allocs, top[i].frees, top[i].live_bytes);
+    }
+
+    kstd::printf("Size histogram:\n");
+    for (size_t i = 0; HEAP_PROFILE_SIZE_CLASSES > i; i++)
+    {
+        if (histogram[i] != 0) kstd::printf("    <= %lu bytes: %lu\n", 1UL << i, histogram[i]);
+    }
+
+    kstd::printf("Suspected leaks:\n");
+    for (size_t i = 0; leak_count > i; i++)
+    {
+        kstd::printf("    %p: %lu allocations live (%lu bytes), oldest %lu ms old\n",
+                reinterpret_cast<void*>(leaks[i].caller), leaks[i].live_count, leaks[i].live_bytes, clk_ticks_to_ms(now - leak_oldest[i]));
+    }
+
+    if (leak_count == 0) kstd::printf("    None\n");
+}
@@ -0,0 +1,76 @@
+#ifndef KITTY_OS_CPP_HEAP_PROFILE_HPP
+#define KITTY_OS_CPP_HEAP_PROFILE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define HEAP_PROFILE_MAX_LIVE 16384     // Live allocations tracked at once, the rest are counted as dropped.
+#define HEAP_PROFILE_MAX_SITES 1024     // Call sites tracked at once.
+#define HEAP_PROFILE_SIZE_CLASSES 32    // Power of two histogram buckets, class n holds sizes up to 2^n.
+#define HEAP_PROFILE_TOP_SITES 10       // Call sites Get-HeapProfile lists.
+
+// A call site is reported as a suspected leak once it has this many live allocations and has freed
+// less than a quarter of what it allocated.
+#define HEAP_PROFILE_LEAK_MIN_LIVE 16
+
+/*
+ * Structs
+ */
+
+// Allocation that hasn't been freed yet.
+struct heap_profile_allocation
+{
+    uint64_t ptr;           // 0 = empty slot.
+    uint64_t size;
+    uint64_t timestamp;     // clk_get_ticks() when it was made.
+    uint32_t site;          // Index into the call site table.
+};
+
+struct heap_profile_site
+{
+    uint64_t caller;        // Return address of the allocation, 0 = empty slot.
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t total_bytes;
+    uint64_t live_bytes;
+    uint64_t live_count;
+};
+
+/*
+ * externs.
+ */
+extern bool heap_profile_enabled;
+
+/*
+ * Global function definitions
+ */
+
+// Clears every table and starts recording, allocations made before aren't known to the profiler.
+void heap_profile_start();
+void heap_profile_stop();
+
+// Top call sites by bytes allocated, the size histogram, the peak footprint and suspected leaks.
+void heap_profile_print();
+
+void heap_profile_record_alloc(const void* ptr, size_t size, const void* caller);
+void heap_profile_record_free(const void* ptr);
+
+/*
+ * inline functions
+ */
+
+// Hooks for the allocator entry points, they cost a load and a branch while profiling is off.
+inline void heap_profile_alloc(const void* ptr, size_t size, const void* caller)
+{
+    if (heap_profile_enabled && ptr != nullptr) heap_profile_record_alloc(ptr, size, caller);
+}
+
+inline void heap_profile_free(const void* ptr)
+{
+    if (heap_profile_enabled && ptr != nullptr) heap_profile_record_free(ptr);
+}
+
+#endif //KITTY_OS_CPP_HEAP_PROFILE_HPP
@@ -0,0 +1,22 @@
+#ifndef KITTY_OS_CPP_KMALLOC_HPP
+#define KITTY_OS_CPP_KMALLOC_HPP
+
+#include <stddef.h>
+
+// The kernel's general purpose allocator, kept apart from heap.hpp so kstd containers can use it
+// without pulling in the PMM and VMM. kfree() and krealloc() take memory from kmalloc(),
+// kmalloc_aligned() and operator new alike.
+// Sizes from VMALLOC_THRESHOLD on are page aligned vmalloc() mappings, see mm/vmalloc.hpp.
+
+void* kmalloc(size_t len);
+
+// `alignment` has to be a power of two, nullptr if it isn't.
+void* kmalloc_aligned(size_t len, size_t alignment);
+
+// Grows or shrinks in place where it can, otherwise moves the contents to a new block. krealloc(nullptr, len)
+// is kmalloc(len), krealloc(ptr, 0) frees `ptr` and returns nullptr.
+void* krealloc(void* ptr, size_t len);
+
+void kfree(void* ptr);
+
+#endif //KITTY_OS_CPP_KMALLOC_HPP
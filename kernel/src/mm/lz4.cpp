@@ -0,0 +1,179 @@
+#include <kstd/kstring.hpp>
+#include "lz4.hpp"
+
+// Limits of the block format: a match is at least 4 bytes, the last 5 bytes are always literals and
+// the last match starts at least 12 bytes before the end.
+constexpr size_t lz4_min_match = 4;
+constexpr size_t lz4_last_literals = 5;
+constexpr size_t lz4_match_limit = 12;
+
+static inline uint32_t lz4_read32(const uint8_t* p)
+{
+    uint32_t v;
+    kstd::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes the 255 continuation bytes of a length that didn't fit its token nibble.
+static inline uint8_t* lz4_write_length(uint8_t* op, size_t length)
+{
+    for (; length >= 255; length -= 255) *op++ = 255;
+    *op++ = static_cast<uint8_t>(length);
+
+    return op;
+}
+
+// Emits one sequence: literals [anchor, anchor + literals), then a match of `match_length` at `offset`
+// (none with match_length 0, for the last sequence). nullptr if it doesn't fit before `end`.
+static uint8_t* lz4_write_sequence(uint8_t* op, uint8_t* end, const uint8_t* anchor, size_t literals, size_t offset, size_t match_length)
+{
+    size_t needed = 1 + literals + literals / 255 + 1 + (match_length != 0 ? 2 + (match_length - lz4_min_match) / 255 + 1 : 0);
+    if (needed > static_cast<size_t>(end - op)) return nullptr;
+
+    uint8_t* token = op++;
+    *token = static_cast<uint8_t>((literals >= 15 ? 15 : literals) << 4);
+    if (literals >= 15) op = lz4_write_length(op, literals - 15);
+
+    kstd::memcpy(op, anchor, literals);
+    op += literals;
+
+    if (match_length == 0) return op;
+
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+
+    size_t extra = match_length - lz4_min_match;
+    *token |= static_cast<uint8_t>(extra >= 15 ? 15 : extra);
+    if (extra >= 15) op = lz4_write_length(op, extra - 15);
+
+    return op;
+}
+
+size_t lz4_compress(lz4_state* state, const void* source, size_t length, void* dest, size_t capacity)
+{
+    auto in = static_cast<const uint8_t*>(source);
+    auto op = static_cast<uint8_t*>(dest);
+    uint8_t* end = op + capacity;
+
+    if (length > LZ4_MAX_INPUT) return 0;
+
+    size_t anchor = 0;
+
+    if (length > lz4_match_limit)
+    {
+        // Stale entries point somewhere in the input as well, every candidate gets compared anyway.
+        kstd::memset(state->table, 0, sizeof(state->table));
+
+        size_t limit = length - lz4_match_limit;
+        size_t match_end = length - lz4_last_literals;
+        size_t ip = 1;
+
+        while (limit > ip)
+        {
+            uint32_t sequence = lz4_read32(in + ip);
+            uint32_t hash = lz4_hash(sequence);
+            size_t ref = state->table[hash];
+            state->table[hash] = static_cast<uint16_t>(ip);
+
+            if (ref >= ip || lz4_read32(in + ref) != sequence)
+            {
+                ip++;
+                continue;
+            }
+
+            // Grow the match backwards into the pending literals, then forwards.
+            while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1])
+            {
+                ip--;
+                ref--;
+            }
+
+            size_t match_length = lz4_min_match;
+            while (match_end > ip + match_length && in[ip + match_length] == in[ref + match_length]) match_length++;
+
+            op = lz4_write_sequence(op, end, in + anchor, ip - anchor, ip - ref, match_length);
+            if (op == nullptr) return 0;
+
+            ip += match_length;
+            anchor = ip;
+
+            if (limit > ip) state->table[lz4_hash(lz4_read32(in + ip - 2))] = static_cast<uint16_t>(ip - 2);
+        }
+    }
+
+    op = lz4_write_sequence(op, end, in + anchor, length - anchor, 0, 0);
+    if (op == nullptr) return 0;
+
+    return op - static_cast<uint8_t*>(dest);
+}
+
+// Adds the continuation bytes of a length to `length`, false if the input ends first.
+static inline bool lz4_read_length(const uint8_t* in, size_t in_length, size_t& ip, size_t& length)
+{
+    uint8_t b;
+
+    do
+    {
+        if (ip >= in_length) return false;
+
+        b = in[ip++];
+        length += b;
+    } while (b == 255);
+
+    return true;
+}
+
+bool lz4_decompress(const void* source, size_t length, void* dest, size_t dest_length)
+{
+    auto in = static_cast<const uint8_t*>(source);
+    auto out = static_cast<uint8_t*>(dest);
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (length > ip)
+    {
+        uint8_t token = in[ip++];
+
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz4_read_length(in, length, ip, literals)) return false;
+
+        if (literals > length - ip || literals > dest_length - op) return false;
+
+        kstd::memcpy(out + op, in + ip, literals);
+        ip += literals;
+        op += literals;
+
+        // The last sequence has no match.
+        if (ip == length) break;
+
+        if (2 > length - ip) return false;
+
+        size_t offset = in[ip] | (static_cast<size_t>(in[ip + 1]) << 8);
+        ip += 2;
+
+        size_t match_length = token & 15;
+        if (match_length == 15 && !lz4_read_length(in, length, ip, match_length)) return false;
+        match_length += lz4_min_match;
+
+        if (offset == 0 || offset > op || match_length > dest_length - op) return false;
+
+        // Matches may overlap what they write, those are copied byte by byte.
+        if (offset >= match_length)
+        {
+            kstd::memcpy(out + op, out + op - offset, match_length);
+        }
+        else
+        {
+            for (size_t i = 0; match_length > i; i++) out[op + i] = out[op + i - offset];
+        }
+
+        op += match_length;
+    }
+
+    return op == dest_length;
+}
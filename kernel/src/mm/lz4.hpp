@@ -0,0 +1,40 @@
+#ifndef KITTY_OS_CPP_LZ4_HPP
+#define KITTY_OS_CPP_LZ4_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define LZ4_HASH_LOG 12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_LOG)
+#define LZ4_MAX_INPUT 0xFFFF                // Positions in the hash table are 16 bit.
+
+// Output size that's always enough for `n` bytes of input, even if they don't compress at all.
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+/*
+ * Structs
+ */
+
+// Hash table the compressor works in. 8 KiB, too large for a kernel stack.
+struct lz4_state
+{
+    uint16_t table[LZ4_HASH_SIZE];
+};
+
+/*
+ * Global function definitions
+ */
+
+// Compresses `length` bytes (at most LZ4_MAX_INPUT) into an LZ4 block, the format of the reference
+// implementation without the frame around it. Greedy matching, fast rather than small.
+// Returns the compressed size, 0 if it doesn't fit `capacity`.
+size_t lz4_compress(lz4_state* state, const void* source, size_t length, void* dest, size_t capacity);
+
+// Decompresses an LZ4 block that has to come out at exactly `dest_length` bytes. Never reads or
+// writes out of bounds, false if the block is corrupted.
+bool lz4_decompress(const void* source, size_t length, void* dest, size_t dest_length);
+
+#endif //KITTY_OS_CPP_LZ4_HPP
@@ -0,0 +1,137 @@
+#include <kstd/kstdio.hpp>
+#include <arch/x64/cpu/cpuinfo.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include <mm/vmm.hpp>
+#include "pcid.hpp"
+
+// Nothing is cached for a PCID in this state but it can't be trusted either (freed without INVPCID).
+static constexpr uint64_t pcid_stale_pml4 = UINT64_MAX;
+
+static bool pcid_enabled = false;
+static bool pcid_has_invpcid = false;
+
+// APs aren't started yet, so there's one TLB to keep track of.
+static pcid_slot pcid_slots[PCID_COUNT];
+static uint64_t pcid_generation = 1;
+
+static uint64_t pcid_used[PCID_COUNT / 64];
+static size_t pcid_next = 1;
+
+void pcid_init()
+{
+    if (!CPUInfo::HasPCID())
+    {
+        kstd::printf("[PCID] Not supported, every address space switch flushes the TLB.\n");
+        return;
+    }
+
+    pcid_has_invpcid = CPUInfo::HasINVPCID();
+
+    // CR4.PCIDE can only be set while CR3[11:0] is 0, the kernel's tables become PCID_KERNEL.
+    uint64_t pml4 = vmm_get_pml4();
+    vmm_write_cr3(pml4);
+
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+    asm volatile ("mov %0, %%cr4" :: "r"(cr4 | (1 << 17)) : "memory");
+
+    pcid_used[0] |= 1;
+    pcid_slots[PCID_KERNEL] = { .pml4 = pml4, .generation = pcid_generation };
+    pcid_enabled = true;
+
+    kstd::printf("[PCID] Enabled, INVPCID: %s.\n", pcid_has_invpcid ? "yes" : "no");
+}
+
+bool pcid_is_enabled()
+{
+    return pcid_enabled;
+}
+
+uint16_t pcid_alloc()
+{
+    if (!pcid_enabled) return PCID_KERNEL;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    // Round robin, so a freed PCID isn't reused right away.
+    for (size_t i = 0; PCID_COUNT > i; i++)
+    {
+        size_t pcid = (pcid_next + i) % PCID_COUNT;
+        if (pcid_used[pcid / 64] & (1ULL << (pcid % 64))) continue;
+
+        pcid_used[pcid / 64] |= (1ULL << (pcid % 64));
+        pcid_next = pcid + 1;
+
+        cpu_restore_interrupts(flags);
+        return static_cast<uint16_t>(pcid);
+    }
+
+    cpu_restore_interrupts(flags);
+    return PCID_KERNEL;
+}
+
+void pcid_free(uint16_t pcid)
+{
+    if (!pcid_enabled || pcid == PCID_KERNEL) return;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    pcid_flush(pcid);
+    pcid_used[pcid / 64] &= ~(1ULL << (pcid % 64));
+
+    cpu_restore_interrupts(flags);
+}
+
+uint64_t pcid_switch_cr3(uint64_t cr3)
+{
+    if (!pcid_enabled) return cr3;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    uint64_t pml4 = cr3 & VMM_ENTRY_ADDRESS_MASK;
+    pcid_slot& slot = pcid_slots[cr3 & PCID_CR3_MASK];
+
+    // Entries cached for this PCID are only usable if they came from the same tables and no kernel mapping changed since.
+    bool keep = (slot.pml4 == pml4 || slot.pml4 == 0) && slot.generation == pcid_generation;
+
+    slot = { .pml4 = pml4, .generation = pcid_generation };
+
+    cpu_restore_interrupts(flags);
+
+    return keep ? (cr3 | PCID_CR3_NO_FLUSH) : (cr3 & ~PCID_CR3_NO_FLUSH);
+}
+
+void pcid_kernel_mappings_changed()
+{
+    if (!pcid_enabled) return;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    pcid_generation++;
+    pcid_slots[vmm_read_cr3() & PCID_CR3_MASK].generation = pcid_generation;
+
+    cpu_restore_interrupts(flags);
+}
+
+void pcid_flush(uint16_t pcid)
+{
+    if (!pcid_enabled) return;
+
+    if (pcid_has_invpcid)
+    {
+        pcid_invpcid(PCID_INVALIDATE_CONTEXT, pcid, 0);
+        pcid_slots[pcid] = { .pml4 = 0, .generation = pcid_generation };
+        return;
+    }
+
+    // Flushed by the next switch to it instead.
+    pcid_slots[pcid] = { .pml4 = pcid_stale_pml4, .generation = 0 };
+}
+
+bool pcid_flush_all()
+{
+    if (!pcid_enabled || !pcid_has_invpcid) return false;
+
+    pcid_invpcid(PCID_INVALIDATE_ALL_GLOBAL, 0, 0);
+    return true;
+}
@@ -0,0 +1,66 @@
+#ifndef KITTY_OS_CPP_PCID_HPP
+#define KITTY_OS_CPP_PCID_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Raw defines
+ */
+#define PCID_COUNT 4096
+#define PCID_KERNEL 0                       // The kernel's own page tables, also handed out when every PCID is taken.
+#define PCID_CR3_MASK 0xFFFULL
+#define PCID_CR3_NO_FLUSH (1ULL << 63)      // MOV to CR3 keeps the TLB entries of the new PCID.
+
+// INVPCID types.
+#define PCID_INVALIDATE_ADDRESS 0
+#define PCID_INVALIDATE_CONTEXT 1
+#define PCID_INVALIDATE_ALL_GLOBAL 2
+#define PCID_INVALIDATE_ALL 3
+
+/*
+ * Structs
+ */
+
+// What the TLB may still hold for a PCID.
+struct pcid_slot
+{
+    uint64_t pml4;          // PML4 last loaded with the PCID, 0 if nothing is cached.
+    uint64_t generation;    // pcid_generation at that time, older means kernel mappings changed since.
+};
+
+/*
+ * Global function definitions
+ */
+
+// Turns on CR4.PCIDE when the CPU has PCIDs, everything below works (and does nothing) without them.
+void pcid_init();
+bool pcid_is_enabled();
+
+// PCID for a new address space, PCID_KERNEL if PCIDs are off or all of them are taken.
+// Sharing a PCID is fine, switching between its users just flushes.
+uint16_t pcid_alloc();
+void pcid_free(uint16_t pcid);
+
+// CR3 value for switching to `cr3` (PML4 | PCID), with the no-flush bit when the TLB can't have stale entries for it.
+uint64_t pcid_switch_cr3(uint64_t cr3);
+
+// Called once kernel half mappings were flushed on this CPU, the other PCIDs may still cache them.
+void pcid_kernel_mappings_changed();
+
+// Drops everything cached for `pcid`, e.g. after changing an address space that isn't loaded.
+void pcid_flush(uint16_t pcid);
+
+// Flushes every PCID, global entries included. Returns false without INVPCID.
+bool pcid_flush_all();
+
+/*
+ * inline functions
+ */
+inline void pcid_invpcid(uint64_t type, uint16_t pcid, uint64_t virt_address)
+{
+    struct { uint64_t pcid; uint64_t address; } descriptor = { pcid, virt_address };
+    asm volatile ("invpcid %0, %1" :: "m"(descriptor), "r"(type) : "memory");
+}
+
+#endif //KITTY_OS_CPP_PCID_HPP
@@ -2,6 +2,8 @@
 // Created by Piotr on 17.05.2024.
 //
 
+#include <firmware/acpi/numa.hpp>
+#include <mm/shrinker.hpp>
 #include "pmm.hpp"
 
 /*
@@ -9,6 +11,22 @@
  */
 static size_t pmm_limine_memmap_entry_count = 0;
 static limine_memmap_entry** pmm_limine_memmap_entries = nullptr;
+
+// Limine's memory map lives in bootloader reclaimable memory, so the PMM keeps its own copy.
+static limine_memmap_entry pmm_memmap_entry_storage[PMM_MAX_MEMMAP_ENTRIES];
+static limine_memmap_entry* pmm_memmap_entry_pointers[PMM_MAX_MEMMAP_ENTRIES];
+
+// Boot memory that has to survive pmm_reclaim_memory().
+struct pmm_boot_range
+{
+    uint64_t base;
+    uint64_t length;
+};
+
+static pmm_boot_range pmm_kept_boot_ranges[PMM_MAX_KEPT_BOOT_RANGES];
+static size_t pmm_kept_boot_range_count = 0;
+static uint64_t pmm_reclaimed_types = 0;
+static uint64_t pmm_boot_stack = 0;
 static limine_memmap_response* pmm_limine_memmap_response = nullptr;
 limine_memmap_request pmm_limine_memmap_request = {
         .id = LIMINE_MEMMAP_REQUEST,
@@ -21,6 +39,7 @@ static size_t pmm_unusable_memory = 0;
 static size_t pmm_reserved_memory = 0;
 static size_t pmm_bad_memory = 0;
 static uint8_t* pmm_memory_bitmap_raw = nullptr;
+static uint8_t* pmm_memory_bitmap_summary_raw = nullptr;
 static size_t pmm_memory_bitmap_size = 0;
 
 constexpr bool pmm_verbose = true;
@@ -28,6 +47,56 @@ static bool memory_calc_lock = false;
 
 static PMMBitmap pmm_bitmap_controller;
 
+// Piece of a node's memory, [base, end), with its own buddy allocator.
+struct pmm_zone
+{
+    size_t node;
+    pmm_zone_type type;
+    uint64_t base;
+    uint64_t end;
+    BuddyAllocator buddy;
+};
+
+static pmm_zone pmm_zones[PMM_MAX_ZONES];
+static size_t pmm_zone_count = 0;
+
+// Zones every node allocates from, in order: nearest node first, higher zones of a node before lower ones.
+static uint8_t pmm_zonelists[NUMA_MAX_NODES][PMM_MAX_ZONES];
+static size_t pmm_zonelist_lengths[NUMA_MAX_NODES];
+
+// Protects the bitmap, the zones, the emergency reserve and the memory counters.
+// Always taken with interrupts disabled.
+static kstd::mutex pmm_lock;
+
+// Per-CPU stacks of free frames in front of the buddy allocator. Only touched by their own CPU
+// with interrupts disabled, so the common path doesn't take pmm_lock.
+struct pmm_cpu_cache
+{
+    size_t count;
+    uint64_t frames[PMM_CACHE_SIZE];
+};
+
+static pmm_cpu_cache pmm_cpu_caches[CPU_MAX_COUNT];
+
+// Frames only interrupt handlers may take once their cache and the global pool are empty.
+static uint64_t pmm_emergency_reserve[PMM_EMERGENCY_RESERVE_SIZE];
+static size_t pmm_emergency_reserve_count = 0;
+
+// Frames cleared ahead of time by pmm_zero_task(), protected by pmm_lock.
+static uint64_t pmm_zeroed_pool[PMM_ZEROED_POOL_SIZE];
+static size_t pmm_zeroed_pool_count = 0;
+static uint8_t* pmm_buddy_metadata_raw = nullptr;
+
+// Extra mappings of every frame (0 = one owner), for copy-on-write. Kept after the buddy metadata.
+static uint16_t* pmm_page_shares = nullptr;
+static size_t pmm_page_count = 0;
+
+// In pages, set from the free memory by pmm_update_watermarks(). Read without the lock, they only change at boot.
+static size_t pmm_watermark_min = 0;
+static size_t pmm_watermark_low = 0;
+static size_t pmm_watermark_high = 0;
+static bool pmm_reclaim_wanted = false;     // Set by allocations that went below low, cleared by the reclaim task.
+
 static void pmm_lock_memory_recalculation()
 {
     memory_calc_lock = true;
@@ -104,6 +173,7 @@ void pmm_print_memory_information()
     pmm_print_limine_memmap_entries();
     pmm_print_memory_usage();
     pmm_print_unaligned_memory_map_entries();
+    pmm_print_buddy_information();
 }
 
 void pmm_print_limine_memmap_entries()
@@ -202,6 +272,8 @@ void pmm_print_memory_usage()
 
     mem_size free_pages = pmm_calculate_effective_size(pmm_usable_memory / PAGE_SIZE);
     kstd::printf("[PMM] Free pages: %f [%sP]\n", free_pages.size, free_pages.prefix);
+
+    kstd::printf("[PMM] Cached pages (per-CPU and emergency reserve): %zu\n", pmm_get_cached_pages());
 }
 
 static uint64_t pmm_get_maximum_address()
@@ -228,6 +300,115 @@ uint64_t pmm_round_to_next_page(uint64_t address)
     return (address + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
 }
 
+static void pmm_create_zone(size_t node, pmm_zone_type type, uint64_t base, uint64_t end)
+{
+    base = pmm_round_to_next_page(base);
+    end = end / PAGE_SIZE * PAGE_SIZE;
+
+    if (end <= base) return;
+
+    if (pmm_zone_count >= PMM_MAX_ZONES)
+    {
+        kstd::printf("[PMM] Too many zones, %lx - %lx won't be used.\n", base, end);
+        return;
+    }
+
+    pmm_zone* zone = &pmm_zones[pmm_zone_count++];
+    zone->node = node;
+    zone->type = type;
+    zone->base = base;
+    zone->end = end;
+}
+
+// Splits a node's memory range at the DMA32 boundary.
+static void pmm_add_node_range(size_t node, uint64_t base, uint64_t end)
+{
+    if (PMM_ZONE_DMA32_END > base)
+        pmm_create_zone(node, PMM_ZONE_DMA32, base, end < PMM_ZONE_DMA32_END ? end : PMM_ZONE_DMA32_END);
+
+    if (end > PMM_ZONE_DMA32_END)
+        pmm_create_zone(node, PMM_ZONE_NORMAL, base > PMM_ZONE_DMA32_END ? base : PMM_ZONE_DMA32_END, end);
+}
+
+static void pmm_build_zones(uint64_t max_address)
+{
+    size_t range_count = numa_get_memory_range_count();
+
+    // No SRAT, it's all node 0.
+    if (range_count == 0)
+    {
+        pmm_add_node_range(0, 0, max_address);
+    }
+
+    for (size_t i = 0; i < range_count; i++)
+    {
+        const numa_memory_range* range = numa_get_memory_range(i);
+        if (range->base >= max_address) continue;
+
+        uint64_t end = range->base + range->length;
+        pmm_add_node_range(range->node, range->base, end < max_address ? end : max_address);
+    }
+
+    for (size_t node = 0; node < numa_get_node_count(); node++)
+    {
+        const size_t* fallback_order = numa_get_fallback_order(node);
+
+        for (size_t i = 0; i < numa_get_node_count(); i++)
+        {
+            for (size_t type = PMM_ZONE_TYPE_COUNT; type > 0; type--)
+            {
+                for (size_t zone = 0; zone < pmm_zone_count; zone++)
+                {
+                    if (pmm_zones[zone].node != fallback_order[i] || pmm_zones[zone].type != type - 1) continue;
+
+                    pmm_zonelists[node][pmm_zonelist_lengths[node]++] = zone;
+                }
+            }
+        }
+    }
+}
+
+static pmm_zone* pmm_find_zone(uint64_t addr)
+{
+    for (size_t i = 0; i < pmm_zone_count; i++)
+    {
+        if (addr >= pmm_zones[i].base && pmm_zones[i].end > addr) return &pmm_zones[i];
+    }
+
+    return nullptr;
+}
+
+// Hands [base, base + length) over to the zones covering it, returns the number of bytes they took.
+static uint64_t pmm_zones_add_range(uint64_t base, uint64_t length)
+{
+    uint64_t end = base + length;
+    uint64_t added = 0;
+
+    for (size_t i = 0; i < pmm_zone_count; i++)
+    {
+        uint64_t range_base = base > pmm_zones[i].base ? base : pmm_zones[i].base;
+        uint64_t range_end = end < pmm_zones[i].end ? end : pmm_zones[i].end;
+
+        if (range_end <= range_base) continue;
+
+        pmm_zones[i].buddy.add_range(range_base, range_end - range_base);
+        added += range_end - range_base;
+    }
+
+    return added;
+}
+
+// pmm_lock has to be held.
+static void pmm_update_watermarks()
+{
+    size_t min = pmm_usable_memory / PAGE_SIZE / PMM_WATERMARK_DIVISOR;
+    if (PMM_WATERMARK_MIN_PAGES > min) min = PMM_WATERMARK_MIN_PAGES;
+
+    pmm_watermark_min = min;
+    pmm_watermark_low = min * 2;
+    pmm_watermark_high = min * 3;
+}
+
 void pmm_init()
 {
     [[gnu::used]] static bool run_once = []() {
@@ -240,9 +421,25 @@ void pmm_init()
         }
 
         pmm_limine_memmap_response = pmm_limine_memmap_request.response;
-        pmm_limine_memmap_entries = pmm_limine_memmap_response->entries;
+
+        // We're still on the stack Limine gave us, remember where it is for reclaim.
+        pmm_boot_stack = reinterpret_cast<uint64_t>(__builtin_frame_address(0));
         pmm_limine_memmap_entry_count = pmm_limine_memmap_response->entry_count;
 
+        if (pmm_limine_memmap_entry_count > PMM_MAX_MEMMAP_ENTRIES)
+        {
+            kstd::printf("[PMM] Memory map has %zu entries, only %d will be used.\n", pmm_limine_memmap_entry_count, PMM_MAX_MEMMAP_ENTRIES);
+            pmm_limine_memmap_entry_count = PMM_MAX_MEMMAP_ENTRIES;
+        }
+
+        for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
+        {
+            pmm_memmap_entry_storage[i] = *pmm_limine_memmap_response->entries[i];
+            pmm_memmap_entry_pointers[i] = &pmm_memmap_entry_storage[i];
+        }
+
+        pmm_limine_memmap_entries = pmm_memmap_entry_pointers;
+
         pmm_calculate_memory(pmm_limine_memmap_entries, pmm_limine_memmap_entry_count);
 
         // Find the max address.
@@ -285,6 +482,27 @@ void pmm_init()
             bitmap_size = pmm_round_to_next_page(bitmap_size);
         }
 
+        // Split the memory into zones per NUMA node (numa_init() has run already).
+        pmm_build_zones(rounded_max_address);
+
+        // The bitmap's summary level and the zones' buddy free maps are kept right after the bitmap.
+        size_t page_count = rounded_max_address / PAGE_SIZE;
+        size_t summary_size = Bitmap::SummaryWords(page_count) * sizeof(uint64_t);
+        size_t buddy_metadata_size = 0;
+
+        for (size_t i = 0; i < pmm_zone_count; i++)
+        {
+            buddy_metadata_size += BuddyAllocator::metadata_size(pmm_zones[i].base / PAGE_SIZE, (pmm_zones[i].end - pmm_zones[i].base) / PAGE_SIZE);
+        }
+        size_t shares_size = page_count * sizeof(uint16_t);
+        size_t metadata_size = pmm_round_to_next_page(bitmap_size + summary_size + buddy_metadata_size + shares_size);
+
+        if constexpr (pmm_verbose)
+        {
+            mem_size _size = pmm_calculate_effective_size(buddy_metadata_size);
+            kstd::printf("[PMM] Space required for the buddy allocator: %f (%sB)\n", _size.size, _size.prefix);
+        }
+
         // Bitmap size is aligned to the page. We can start looking for place for the bitmap to store.
         for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
         {
@@ -292,27 +510,27 @@ void pmm_init()
 
             // We're checking if entry is:
             // - Usable
-            // - Size is greater or equal than the size of our bitmap.
+            // - Size is greater or equal than the size of our bitmap and buddy metadata.
             // - If the entry is aligned.
-            if (entry->type == LIMINE_MEMMAP_USABLE && bitmap_size <= entry->length && (entry->base % PAGE_SIZE == 0))
+            if (entry->type == LIMINE_MEMMAP_USABLE && metadata_size <= entry->length && (entry->base % PAGE_SIZE == 0))
             {
                 if constexpr(pmm_verbose)
                 {
                     kstd::printf("[PMM] Found perfect entry for the bitmap.\n");
                     pmm_print_memmap_entry(i, entry);
+                }
 
-                    pmm_memory_bitmap_size = bitmap_size;
-
-                    kstd::printf("%p", reinterpret_cast<void*>(vmm_hhdm));
-
-                    // This shitty line is causing the bug:
-                    pmm_memory_bitmap_raw = reinterpret_cast<uint8_t*>(vmm_make_virtual_singular(entry->base));
+                pmm_memory_bitmap_size = bitmap_size;
+                pmm_memory_bitmap_raw = vmm_make_virtual<uint8_t*>(entry->base);
+                pmm_memory_bitmap_summary_raw = pmm_memory_bitmap_raw + bitmap_size;
+                pmm_buddy_metadata_raw = pmm_memory_bitmap_summary_raw + summary_size;
+                pmm_page_shares = reinterpret_cast<uint16_t*>(pmm_buddy_metadata_raw + buddy_metadata_size);
+                pmm_page_count = page_count;
 
-                    entry->length -= bitmap_size;
-                    entry->base += bitmap_size;
+                entry->length -= metadata_size;
+                entry->base += metadata_size;
 
-                    break;
-                }
+                break;
             }
         }
 
@@ -335,9 +553,10 @@ void pmm_init()
 
         kstd::printf("BITMAP ADDRESS: %p\n", static_cast<void*>(pmm_memory_bitmap_raw));
 
-        pmm_bitmap_controller.Initialize(pmm_memory_bitmap_raw, pmm_memory_bitmap_size);
+        pmm_bitmap_controller.Initialize(reinterpret_cast<uint64_t*>(pmm_memory_bitmap_raw), page_count);
 
         kstd::memset(pmm_memory_bitmap_raw, 0xff, pmm_memory_bitmap_size);
+        kstd::memset(pmm_page_shares, 0, pmm_page_count * sizeof(uint16_t));
 
         // fill the bitmap with goodies.
         for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
@@ -355,6 +574,50 @@ void pmm_init()
             }
         }
 
+        // Build the summary level once the bitmap is filled.
+        pmm_bitmap_controller.InitializeSummary(reinterpret_cast<uint64_t*>(pmm_memory_bitmap_summary_raw));
+
+        // Seed the zones with every usable entry.
+        uint8_t* zone_metadata = pmm_buddy_metadata_raw;
+        for (size_t i = 0; i < pmm_zone_count; i++)
+        {
+            uint64_t first_page = pmm_zones[i].base / PAGE_SIZE;
+            size_t pages = (pmm_zones[i].end - pmm_zones[i].base) / PAGE_SIZE;
+
+            pmm_zones[i].buddy.init(zone_metadata, first_page, pages);
+            zone_metadata += BuddyAllocator::metadata_size(first_page, pages);
+        }
+
+        for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
+        {
+            const limine_memmap_entry* entry = pmm_limine_memmap_entries[i];
+
+            if (entry->type != LIMINE_MEMMAP_USABLE) continue;
+
+            uint64_t added = pmm_zones_add_range(entry->base, entry->length);
+
+            // SRAT is supposed to cover all the memory, whatever it leaves out stays unused.
+            if (added != entry->length)
+            {
+                kstd::printf("[PMM] %lx - %lx isn't fully covered by NUMA memory ranges.\n", entry->base, entry->base + entry->length);
+                pmm_usable_memory -= entry->length - added;
+            }
+        }
+
+        if constexpr (pmm_verbose)
+        {
+            for (size_t i = 0; i < pmm_zone_count; i++)
+            {
+                kstd::printf("[PMM] Zone %zu (node %zu, %s) %lx - %lx holds %zu free pages.\n", i, pmm_zones[i].node,
+                             pmm_zone_type_to_string(pmm_zones[i].type), pmm_zones[i].base, pmm_zones[i].end, pmm_zones[i].buddy.get_free_pages());
+            }
+        }
+
+        pmm_update_watermarks();
+
+        // Fill the pre-zeroed pool up front, page tables get allocated long before the zeroing task runs.
+        pmm_refill_zeroed_pages(PMM_ZEROED_POOL_SIZE);
+
         if constexpr (pmm_verbose)
         {
             kstd::printf("[PMM] Finished!\n");
@@ -389,57 +652,660 @@ void PMMBitmap::unmark_addr(uint64_t address)
 
 void PMMBitmap::mark_pages_used_in_range(uint64_t page_index, size_t len)
 {
-    for (size_t i = 0; i < len; i++)
+    this->SetRange(page_index, len);
+}
+
+// Any page touched by the range is marked as used.
+void PMMBitmap::mark_addrs_used_in_range(uint64_t address, size_t len)
+{
+    if (len == 0) return;
+
+    uint64_t first_page = address / PAGE_SIZE;
+    uint64_t end_page = (address + len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    this->SetRange(first_page, end_page - first_page);
+}
+
+void PMMBitmap::unmark_pages_in_range(uint64_t page_index, size_t len)
+{
+    this->ClearRange(page_index, len);
+}
+
+// Only pages fully covered by the range are marked as free.
+void PMMBitmap::unmark_addrs_in_range(uint64_t address, size_t len)
+{
+    uint64_t first_page = (address + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint64_t end_page = (address + len) / PAGE_SIZE;
+
+    if (end_page <= first_page) return;
+
+    this->ClearRange(first_page, end_page - first_page);
+}
+
+size_t pmm_get_local_node()
+{
+    size_t node = cpu_this()->numa_node;
+
+    return numa_get_node_count() > node ? node : 0;
+}
+
+// Global pool, pmm_lock has to be held. Walks the zonelist of `node`.
+static uint64_t pmm_global_alloc_pages(size_t order, size_t node, pmm_zone_type highest_zone)
+{
+    if (node >= numa_get_node_count()) node = 0;
+
+    for (size_t i = 0; i < pmm_zonelist_lengths[node]; i++)
     {
-        this->Set(page_index + i);
+        pmm_zone* zone = &pmm_zones[pmm_zonelists[node][i]];
+        if (zone->type > highest_zone) continue;
+
+        uint64_t addr = zone->buddy.alloc(order);
+        if (addr == 0) continue;
+
+        pmm_bitmap_controller.mark_pages_used_in_range(addr / PAGE_SIZE, 1ULL << order);
+        pmm_usable_memory -= PAGE_SIZE << order;
+
+        if (pmm_watermark_low > pmm_usable_memory / PAGE_SIZE) pmm_reclaim_wanted = true;
+
+        return addr;
     }
+
+    return 0;
 }
 
-void PMMBitmap::mark_addrs_used_in_range(uint64_t address, size_t len)
+// Global pool, pmm_lock has to be held.
+static void pmm_global_free_pages(uint64_t addr, size_t order)
 {
-    uint64_t end_address = address + len;
-    while (address < end_address)
+    pmm_zone* zone = pmm_find_zone(addr);
+    if (zone == nullptr)
     {
-        this->mark_addr(address);
-        address += PAGE_SIZE;
+        kstd::printf("[PMM] Block %lx doesn't belong to any zone.\n", addr);
+        return;
     }
+
+    pmm_bitmap_controller.unmark_pages_in_range(addr / PAGE_SIZE, 1ULL << order);
+    pmm_usable_memory += PAGE_SIZE << order;
+
+    zone->buddy.free(addr, order);
 }
 
-void PMMBitmap::unmark_pages_in_range(uint64_t page_index, size_t len)
+// Moves a batch of frames from the global pool into the cache and tops up the emergency reserve.
+// pmm_lock has to be held.
+static void pmm_cache_refill(pmm_cpu_cache* cache)
+{
+    while (PMM_EMERGENCY_RESERVE_SIZE > pmm_emergency_reserve_count)
+    {
+        uint64_t frame = pmm_global_alloc_pages(0, pmm_get_local_node(), PMM_ZONE_NORMAL);
+        if (frame == 0) break;
+
+        pmm_emergency_reserve[pmm_emergency_reserve_count++] = frame;
+    }
+
+    // Grab the whole batch as one block if we can, it's a single buddy operation.
+    uint64_t block = pmm_global_alloc_pages(buddy_order_for_pages(PMM_CACHE_BATCH_SIZE), pmm_get_local_node(), PMM_ZONE_NORMAL);
+    if (block != 0)
+    {
+        for (size_t i = PMM_CACHE_BATCH_SIZE; i > 0; i--)
+        {
+            cache->frames[cache->count++] = block + (i - 1) * PAGE_SIZE;
+        }
+
+        return;
+    }
+
+    for (size_t i = 0; PMM_CACHE_BATCH_SIZE > i; i++)
+    {
+        uint64_t frame = pmm_global_alloc_pages(0, pmm_get_local_node(), PMM_ZONE_NORMAL);
+        if (frame == 0) break;
+
+        cache->frames[cache->count++] = frame;
+    }
+}
+
+// Returns the coldest batch of frames (bottom of the stack) to the global pool.
+// pmm_lock has to be held.
+static void pmm_cache_drain(pmm_cpu_cache* cache)
 {
-    for (size_t i = 0; i < len; i++)
+    size_t batch = cache->count < PMM_CACHE_BATCH_SIZE ? cache->count : PMM_CACHE_BATCH_SIZE;
+
+    for (size_t i = 0; batch > i; i++)
     {
-        this->Clear(page_index + i);
+        pmm_global_free_pages(cache->frames[i], 0);
     }
+
+    cache->count -= batch;
+    kstd::memmove(cache->frames, &cache->frames[batch], cache->count * sizeof(uint64_t));
 }
 
-void PMMBitmap::unmark_addrs_in_range(uint64_t address, size_t len)
+static uint64_t pmm_cache_alloc_page()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_cpu_cache* cache = &pmm_cpu_caches[cpu_current_id()];
+    uint64_t addr = 0;
+
+    if (cache->count == 0)
+    {
+        pmm_lock.lock();
+
+        pmm_cache_refill(cache);
+
+        // IRQ handlers can't wait for memory to come back, let them dip into the reserve. Syscalls and
+        // demand paging go through interrupt_handler() too, but they can fail like any other caller.
+        if (cache->count == 0 && cpu_in_irq() && pmm_emergency_reserve_count > 0)
+        {
+            addr = pmm_emergency_reserve[--pmm_emergency_reserve_count];
+        }
+
+        pmm_lock.unlock();
+    }
+
+    if (addr == 0 && cache->count > 0)
+    {
+        addr = cache->frames[--cache->count];
+    }
+
+    cpu_restore_interrupts(flags);
+
+    return addr;
+}
+
+static void pmm_cache_free_page(uint64_t addr)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_cpu_cache* cache = &pmm_cpu_caches[cpu_current_id()];
+
+    if (cache->count == PMM_CACHE_SIZE)
+    {
+        pmm_lock.lock();
+        pmm_cache_drain(cache);
+        pmm_lock.unlock();
+    }
+
+    cache->frames[cache->count++] = addr;
+
+    cpu_restore_interrupts(flags);
+}
+
+uint64_t pmm_alloc_pages(size_t order)
+{
+    return pmm_alloc_pages_node(order, PMM_NODE_LOCAL, PMM_ZONE_NORMAL);
+}
+
+static uint64_t pmm_try_alloc_pages(size_t order, size_t node, pmm_zone_type highest_zone)
+{
+    // The per-CPU caches only hold frames for plain local allocations.
+    if (order == 0 && node == pmm_get_local_node() && highest_zone == PMM_ZONE_NORMAL)
+    {
+        return pmm_cache_alloc_page();
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    uint64_t addr = pmm_global_alloc_pages(order, node, highest_zone);
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return addr;
+}
+
+// Set while some task runs the shrinkers, they allocate themselves (zram's pool) and mustn't recurse.
+static bool pmm_reclaiming = false;
+
+bool pmm_direct_reclaim(size_t pages)
+{
+    // Every allocator runs its critical sections with interrupts disabled, a shrinker can't land in the middle of one this way.
+    if (cpu_in_interrupt() || !cpu_interrupts_enabled()) return false;
+    if (__atomic_exchange_n(&pmm_reclaiming, true, __ATOMIC_ACQUIRE)) return false;
+
+    size_t reclaimed = shrinker_scan(pages > PMM_RECLAIM_BATCH_SIZE ? pages : PMM_RECLAIM_BATCH_SIZE);
+
+    __atomic_store_n(&pmm_reclaiming, false, __ATOMIC_RELEASE);
+
+    return reclaimed != 0;
+}
+
+uint64_t pmm_alloc_pages_node(size_t order, size_t node, pmm_zone_type highest_zone)
+{
+    if (node == PMM_NODE_LOCAL) node = pmm_get_local_node();
+
+    if (pmm_get_pressure() == PMM_PRESSURE_MIN) pmm_direct_reclaim(1ULL << order);
+
+    uint64_t addr = pmm_try_alloc_pages(order, node, highest_zone);
+
+    if (addr == 0 && pmm_direct_reclaim(1ULL << order)) addr = pmm_try_alloc_pages(order, node, highest_zone);
+
+    return addr;
+}
+
+void pmm_free_pages(uint64_t addr, size_t order)
 {
-    uint64_t end_address = address + len;
-    while (address < end_address)
+    if (addr == 0 || addr % (PAGE_SIZE << order) != 0)
     {
-        this->unmark_addr(address);
-        address += PAGE_SIZE;
+        kstd::printf("pmm_free_pages(): Invalid block %lx of order %zu\n", addr, order);
+        return;
     }
+
+    if (order == 0)
+    {
+        pmm_cache_free_page(addr);
+        return;
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    pmm_global_free_pages(addr, order);
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
 }
 
 uint64_t pmm_alloc_page()
 {
-    uint64_t addr = pmm_bitmap_controller.FindFirstCleared() * 4096;
-    if (addr == 0)
+    // kstd::printf("Usable memory: %f [%%]\n", ((double)pmm_usable_memory / (double)pmm_overall_memory) * 100);
+    return pmm_alloc_pages(0);
+}
+
+void pmm_free_page(uint64_t addr)
+{
+    pmm_free_pages(addr, 0);
+}
+
+void pmm_share_page(uint64_t addr)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    uint16_t& shares = pmm_page_shares[addr / PAGE_SIZE];
+    if (shares == UINT16_MAX)
     {
-        kstd::printf("pmm_alloc_page(): OOM\n");
+        kstd::printf("[PMM] Frame %lx is shared too many times.\n", addr);
         unreachable();
     }
-    pmm_bitmap_controller.Set(addr / 4096);
-    pmm_usable_memory -= 4096;
-    // kstd::printf("Usable memory: %f [%%]\n", ((double)pmm_usable_memory / (double)pmm_overall_memory) * 100);
+    shares++;
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+bool pmm_page_is_shared(uint64_t addr)
+{
+    return addr / PAGE_SIZE < pmm_page_count && pmm_page_shares[addr / PAGE_SIZE] != 0;
+}
+
+void pmm_put_page(uint64_t addr)
+{
+    // A frame nobody shares can't become shared behind our back, only its one owner could share it.
+    if (!pmm_page_is_shared(addr))
+    {
+        pmm_free_page(addr);
+        return;
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    uint16_t& shares = pmm_page_shares[addr / PAGE_SIZE];
+    bool last = shares == 0;
+    if (!last) shares--;
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    if (last) pmm_free_page(addr);
+}
+
+// Clears a frame that's needed right away, through the cache.
+static void pmm_zero_frame(uint64_t addr)
+{
+    void* dest = vmm_make_virtual<void*>(addr);
+    size_t count = PAGE_SIZE / sizeof(uint64_t);
+
+    asm volatile ("rep stosq" : "+D"(dest), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Clears a frame that won't be touched for a while. Non-temporal stores keep it out of the cache,
+// pmm_zero_frames_fence() has to run before anyone else sees the frame.
+static void pmm_zero_frame_nt(uint64_t addr)
+{
+    auto dest = vmm_make_virtual<uint64_t*>(addr);
+
+    for (size_t i = 0; PAGE_SIZE / sizeof(uint64_t) > i; i += 4)
+    {
+        asm volatile ("movnti %1, 0(%0)\n"
+                      "movnti %1, 8(%0)\n"
+                      "movnti %1, 16(%0)\n"
+                      "movnti %1, 24(%0)" :: "r"(dest + i), "r"(0ULL) : "memory");
+    }
+}
+
+static void pmm_zero_frames_fence()
+{
+    asm volatile ("sfence" ::: "memory");
+}
+
+uint64_t pmm_alloc_zeroed_page()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    uint64_t addr = pmm_zeroed_pool_count > 0 ? pmm_zeroed_pool[--pmm_zeroed_pool_count] : 0;
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    if (addr != 0) return addr;
+
+    addr = pmm_alloc_page();
+    if (addr != 0) pmm_zero_frame(addr);
+
     return addr;
 }
 
-void pmm_free_page(uint64_t addr)
+size_t pmm_refill_zeroed_pages(size_t max_pages)
+{
+    size_t refilled = 0;
+
+    // The pool is a cache like any other, it doesn't grow while memory is short.
+    while (max_pages > refilled && PMM_ZEROED_POOL_SIZE > pmm_zeroed_pool_count && pmm_get_pressure() == PMM_PRESSURE_NONE)
+    {
+        uint64_t addr = pmm_alloc_pages(0);
+        if (addr == 0) break;
+
+        // Zeroing happens without the lock, only publishing the frame takes it.
+        pmm_zero_frame_nt(addr);
+        pmm_zero_frames_fence();
+
+        uint64_t flags = cpu_save_and_disable_interrupts();
+        pmm_lock.lock();
+
+        bool added = PMM_ZEROED_POOL_SIZE > pmm_zeroed_pool_count;
+        if (added) pmm_zeroed_pool[pmm_zeroed_pool_count++] = addr;
+
+        pmm_lock.unlock();
+        cpu_restore_interrupts(flags);
+
+        if (!added)
+        {
+            pmm_free_pages(addr, 0);
+            break;
+        }
+
+        refilled++;
+    }
+
+    return refilled;
+}
+
+void pmm_zero_task()
+{
+    while (true)
+    {
+        // Nothing to do until somebody takes frames out of the pool, sleep till the next interrupt.
+        if (pmm_refill_zeroed_pages(PMM_ZEROED_BATCH_SIZE) == 0)
+        {
+            asm volatile ("hlt");
+        }
+    }
+}
+
+size_t pmm_get_free_pages()
+{
+    return pmm_usable_memory / PAGE_SIZE;
+}
+
+pmm_pressure pmm_get_pressure()
+{
+    size_t free = pmm_get_free_pages();
+
+    if (pmm_watermark_min > free) return PMM_PRESSURE_MIN;
+    if (pmm_watermark_low > free) return PMM_PRESSURE_LOW;
+
+    return PMM_PRESSURE_NONE;
+}
+
+void pmm_get_watermarks(size_t* min, size_t* low, size_t* high)
+{
+    *min = pmm_watermark_min;
+    *low = pmm_watermark_low;
+    *high = pmm_watermark_high;
+}
+
+static size_t pmm_zeroed_pool_shrinker_count()
+{
+    return pmm_zeroed_pool_count;
+}
+
+static size_t pmm_zeroed_pool_shrinker_scan(size_t pages)
+{
+    size_t freed = 0;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    while (pages > freed && pmm_zeroed_pool_count > 0)
+    {
+        pmm_global_free_pages(pmm_zeroed_pool[--pmm_zeroed_pool_count], 0);
+        freed++;
+    }
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return freed;
+}
+
+static shrinker pmm_zeroed_pool_shrinker = {
+        .name = "pmm-zeroed-pool",
+        .count = pmm_zeroed_pool_shrinker_count,
+        .scan = pmm_zeroed_pool_shrinker_scan,
+        .next = nullptr,
+        .exhausted = false
+};
+
+void pmm_reclaim_task()
+{
+    shrinker_register(&pmm_zeroed_pool_shrinker);
+
+    bool stalled = false;   // Nothing was left to reclaim last time, reported once until the pressure is gone.
+
+    while (true)
+    {
+        if (!pmm_reclaim_wanted && pmm_get_pressure() == PMM_PRESSURE_NONE)
+        {
+            stalled = false;
+            asm volatile ("hlt");
+            continue;
+        }
+
+        pmm_reclaim_wanted = false;
+
+        // Up to the high watermark, or until the shrinkers have nothing left.
+        size_t free = pmm_get_free_pages();
+        if (pmm_watermark_high > free && shrinker_scan(pmm_watermark_high - free) == 0)
+        {
+            if (!stalled) kstd::printf("[PMM] Low on memory and nothing left to reclaim, %zu pages free.\n", pmm_get_free_pages());
+            stalled = true;
+        }
+
+        asm volatile ("hlt");
+    }
+}
+
+size_t pmm_get_cached_pages()
+{
+    size_t pages = pmm_emergency_reserve_count + pmm_zeroed_pool_count;
+    for (size_t i = 0; CPU_MAX_COUNT > i; i++)
+    {
+        pages += pmm_cpu_caches[i].count;
+    }
+    return pages;
+}
+
+void pmm_keep_boot_memory(const void* hhdm_pointer, size_t len)
+{
+    if (hhdm_pointer == nullptr || len == 0) return;
+
+    if (pmm_kept_boot_range_count >= PMM_MAX_KEPT_BOOT_RANGES)
+    {
+        kstd::printf("[PMM] Too many kept boot ranges, %p won't be kept.\n", hhdm_pointer);
+        return;
+    }
+
+    // Translated to physical at reclaim time, the HHDM offset might not be known yet.
+    pmm_kept_boot_ranges[pmm_kept_boot_range_count++] = {
+            .base = reinterpret_cast<uint64_t>(hhdm_pointer),
+            .length = len
+    };
+}
+
+static uint64_t pmm_boot_to_physical(uint64_t address)
+{
+    // Limine hands out HHDM pointers, but accept physical ones as well.
+    if (address >= vmm_hhdm->offset) return address - vmm_hhdm->offset;
+
+    return address;
+}
+
+// Sets every frame of the page table hierarchy at `table` in the bitmap.
+static void pmm_keep_page_tables(uint64_t table, size_t level)
+{
+    pmm_bitmap_controller.mark_page(table / PAGE_SIZE);
+
+    if (level == 1) return;
+
+    auto entries = vmm_make_virtual<uint64_t*>(table);
+    for (size_t i = 0; 512 > i; i++)
+    {
+        uint64_t entry = entries[i];
+
+        // Skip non-present entries and large pages (PS bit on PDPE/PDE).
+        if (!(entry & 1) || (level != 4 && (entry & (1 << 7)))) continue;
+
+        pmm_keep_page_tables(entry & 0x000ffffffffff000, level - 1);
+    }
+}
+
+void pmm_reclaim_memory(uint64_t memmap_type)
+{
+    if (memmap_type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && memmap_type != LIMINE_MEMMAP_ACPI_RECLAIMABLE)
+    {
+        kstd::printf("[PMM] Memory of type \"%s\" can't be reclaimed.\n", pmm_limine_memmap_type_to_string(memmap_type));
+        return;
+    }
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    pmm_lock.lock();
+
+    if (pmm_reclaimed_types & (1ULL << memmap_type))
+    {
+        pmm_lock.unlock();
+        cpu_restore_interrupts(flags);
+        return;
+    }
+
+    pmm_reclaimed_types |= (1ULL << memmap_type);
+
+    // Free the whole regions in the bitmap first...
+    for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
+    {
+        const limine_memmap_entry* entry = pmm_limine_memmap_entries[i];
+
+        if (entry->type == memmap_type)
+            pmm_bitmap_controller.unmark_addrs_in_range(entry->base, entry->length);
+    }
+
+    // ...then mark back everything that's still in use: the page tables we're running on,
+    // the boot stack and ranges consumers asked to keep.
+    pmm_keep_page_tables(vmm_get_pml4(), 4);
+
+    // Limine doesn't say how large the stack is or where it starts, only that it's bootloader memory.
+    // The whole memmap entry it's in stays.
+    uint64_t boot_stack = pmm_boot_to_physical(pmm_boot_stack);
+
+    for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
+    {
+        const limine_memmap_entry* entry = pmm_limine_memmap_entries[i];
+
+        if (entry->type == memmap_type && boot_stack >= entry->base && entry->base + entry->length > boot_stack)
+            pmm_bitmap_controller.mark_addrs_used_in_range(entry->base, entry->length);
+    }
+
+    for (size_t i = 0; i < pmm_kept_boot_range_count; i++)
+    {
+        pmm_bitmap_controller.mark_addrs_used_in_range(pmm_boot_to_physical(pmm_kept_boot_ranges[i].base), pmm_kept_boot_ranges[i].length);
+    }
+
+    // Hand the runs that stayed free over to the zones.
+    size_t reclaimed = 0;
+    for (size_t i = 0; i < pmm_limine_memmap_entry_count; i++)
+    {
+        const limine_memmap_entry* entry = pmm_limine_memmap_entries[i];
+
+        if (entry->type != memmap_type) continue;
+
+        uint64_t page = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint64_t end_page = (entry->base + entry->length) / PAGE_SIZE;
+
+        while (end_page > page)
+        {
+            if (pmm_bitmap_controller.Check(page))
+            {
+                page++;
+                continue;
+            }
+
+            uint64_t run_start = page;
+            while (end_page > page && !pmm_bitmap_controller.Check(page)) page++;
+
+            reclaimed += pmm_zones_add_range(run_start * PAGE_SIZE, (page - run_start) * PAGE_SIZE);
+        }
+    }
+
+    pmm_usable_memory += reclaimed;
+    pmm_reserved_memory -= reclaimed;
+
+    pmm_update_watermarks();
+
+    pmm_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    if constexpr (pmm_verbose)
+    {
+        mem_size _size = pmm_calculate_effective_size(reclaimed);
+        kstd::printf("[PMM] Reclaimed %f (%sB) of %s.\n", _size.size, _size.prefix, pmm_limine_memmap_type_to_string(memmap_type));
+    }
+}
+
+void pmm_reclaim_boot_memory()
 {
-    uint64_t idx = addr / 4096;
-    pmm_bitmap_controller.Clear(idx);
-    pmm_usable_memory += 4096;
-}
\ No newline at end of file
+    pmm_reclaim_memory(LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE);
+    pmm_reclaim_memory(LIMINE_MEMMAP_ACPI_RECLAIMABLE);
+}
+
+void pmm_print_buddy_information()
+{
+    for (size_t i = 0; i < pmm_zone_count; i++)
+    {
+        const pmm_zone* zone = &pmm_zones[i];
+
+        mem_size free_size = pmm_calculate_effective_size(zone->buddy.get_free_pages() * PAGE_SIZE);
+        kstd::printf("[PMM] Zone %zu (node %zu, %s) %lx - %lx, free: %f (%sB)\n", i, zone->node, pmm_zone_type_to_string(zone->type),
+                     zone->base, zone->end, free_size.size, free_size.prefix);
+    }
+
+    kstd::printf("[PMM] Buddy free blocks per order: \n");
+    for (size_t order = 0; BUDDY_ORDER_COUNT > order; order++)
+    {
+        size_t blocks = 0;
+        for (size_t i = 0; i < pmm_zone_count; i++)
+        {
+            blocks += pmm_zones[i].buddy.get_free_blocks(order);
+        }
+
+        mem_size block_size = pmm_calculate_effective_size(PAGE_SIZE << order);
+        kstd::printf("\t%zu. (%f %sB) %zu\n", order, block_size.size, block_size.prefix, blocks);
+    }
+}
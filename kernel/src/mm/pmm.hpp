@@ -16,6 +16,9 @@
 #include <arch/x64/control/control.hpp>
 #include <kstd/kbitmap.hpp>
 #include <kstd/kstring.hpp>
+#include <mm/buddy.hpp>
+#include <kstd/kmutex.hpp>
+#include <arch/x64/cpu/percpu.hpp>
 
 /*
  * Structs
@@ -25,10 +28,39 @@ typedef struct {
     const char* prefix;
 } mem_size;
 
+// Zones a node's memory is split into, ordered by address. Allocations may fall back to lower zones.
+enum pmm_zone_type
+{
+    PMM_ZONE_DMA32,     // Below 4 GiB, for devices with 32-bit DMA.
+    PMM_ZONE_NORMAL,    // Everything else.
+    PMM_ZONE_TYPE_COUNT
+};
+
+// Free frames compared against the watermarks, see pmm_get_pressure().
+enum pmm_pressure
+{
+    PMM_PRESSURE_NONE,  // Above the low watermark.
+    PMM_PRESSURE_LOW,   // Below low, the reclaim task is shrinking caches.
+    PMM_PRESSURE_MIN    // Below min, allocations reclaim themselves before they take a frame.
+};
+
 /*
  * Raw defines
  */
 #define PAGE_SIZE 4096
+#define PMM_MAX_MEMMAP_ENTRIES 256
+#define PMM_MAX_KEPT_BOOT_RANGES 64
+#define PMM_CACHE_SIZE 64             // Frames held by every per-CPU cache.
+#define PMM_CACHE_BATCH_SIZE 32       // Frames moved between a cache and the global pool at once.
+#define PMM_EMERGENCY_RESERVE_SIZE 16 // Frames set aside for hardware IRQ handlers.
+#define PMM_ZEROED_POOL_SIZE 256      // Pre-zeroed frames kept for page tables and new processes.
+#define PMM_ZEROED_BATCH_SIZE 16      // Frames the zeroing task clears between checks.
+#define PMM_MAX_ZONES 32
+#define PMM_ZONE_DMA32_END 0x100000000
+#define PMM_NODE_LOCAL SIZE_MAX       // Node of the calling CPU.
+#define PMM_WATERMARK_MIN_PAGES 128   // Floor of the min watermark.
+#define PMM_WATERMARK_DIVISOR 256     // The min watermark is 1/256 of the free frames at boot, low is twice and high three times that.
+#define PMM_RECLAIM_BATCH_SIZE 64     // Frames an allocation asks the shrinkers for when it reclaims directly.
 
 /*
  * constexpr functions
@@ -75,6 +107,19 @@ constexpr const char* pmm_limine_memmap_type_to_string(uint64_t memmap_type)
     }
 }
 
+constexpr const char* pmm_zone_type_to_string(pmm_zone_type type)
+{
+    switch (type)
+    {
+        case PMM_ZONE_DMA32:
+            return "DMA32";
+        case PMM_ZONE_NORMAL:
+            return "Normal";
+        default:
+            return "Invalid zone type.";
+    }
+}
+
 /*
  * static functions
  */
@@ -89,14 +134,70 @@ void pmm_print_limine_memmap_entries();
 void pmm_print_memory_usage();
 void pmm_print_memory_information();
 void pmm_print_unaligned_memory_map_entries();
+void pmm_print_buddy_information();
 
+// 0 when out of memory, after the shrinkers had a go if the caller can reclaim (see pmm_direct_reclaim()).
 uint64_t pmm_alloc_page();
 void pmm_free_page(uint64_t addr);
 
+// Copy-on-write sharing. A frame starts with one owner, pmm_share_page() adds a mapping and
+// pmm_put_page() drops one, freeing the frame with the last of them.
+void pmm_share_page(uint64_t addr);
+bool pmm_page_is_shared(uint64_t addr);
+void pmm_put_page(uint64_t addr);
+
+// Same as pmm_alloc_page(), but the frame is already cleared. Served from the pre-zeroed pool,
+// falls back to clearing a frame on the spot when the pool is empty.
+uint64_t pmm_alloc_zeroed_page();
+
+// Zeroes up to `max_pages` frames into the pre-zeroed pool, returns how many were added.
+size_t pmm_refill_zeroed_pages(size_t max_pages);
+
+// Idle priority kernel task keeping the pre-zeroed pool full.
+void pmm_zero_task();
+
+// Frames left in the buddy allocator, the per-CPU caches and pools not included.
+size_t pmm_get_free_pages();
+pmm_pressure pmm_get_pressure();
+void pmm_get_watermarks(size_t* min, size_t* low, size_t* high);
+
+// Runs the shrinkers for about `pages` frames on the caller's time, true if any came back. Does nothing
+// with interrupts disabled or in an interrupt handler, so allocators call it once they've left their
+// critical section and then try again. Doesn't nest, allocations made while reclaiming just fail.
+bool pmm_direct_reclaim(size_t pages);
+
+// Kernel task that wakes up once free frames drop below the low watermark and runs the shrinkers
+// (see mm/shrinker.hpp) until they're back above high, before allocations start failing.
+void pmm_reclaim_task();
+
+// Allocate/free 2^order physically contiguous pages, aligned to their size (order 0 - BUDDY_MAX_ORDER).
+// pmm_alloc_pages returns 0 when no block is available.
+// Allocations prefer the local node and fall back to the other nodes ordered by SLIT distance.
+uint64_t pmm_alloc_pages(size_t order);
+void pmm_free_pages(uint64_t addr, size_t order);
+
+// Same as pmm_alloc_pages(), but starts at `node` (or PMM_NODE_LOCAL) and only uses zones up to `highest_zone`,
+// e.g. PMM_ZONE_DMA32 for memory below 4 GiB.
+uint64_t pmm_alloc_pages_node(size_t order, size_t node, pmm_zone_type highest_zone);
+
+size_t pmm_get_local_node();
+
+// Frames sitting in the per-CPU caches, the emergency reserve and the pre-zeroed pool (allocated from the buddy allocator's point of view).
+size_t pmm_get_cached_pages();
+
+// Keeps a piece of bootloader/ACPI reclaimable memory (e.g. a Limine response) alive across reclaim.
+// Can be called before pmm_init().
+void pmm_keep_boot_memory(const void* hhdm_pointer, size_t len);
+
+// Returns LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE or LIMINE_MEMMAP_ACPI_RECLAIMABLE regions to the free pool.
+// Only call it once everything that reads those regions is either done or kept.
+void pmm_reclaim_memory(uint64_t memmap_type);
+void pmm_reclaim_boot_memory();
+
 /*
  * Classes
  */
-class PMMBitmap : public Bitmap<uint8_t>
+class PMMBitmap : public Bitmap
 {
 public:
     void mark_page(uint64_t page_index);
@@ -0,0 +1,89 @@
+#include <kstd/kstdio.hpp>
+#include <kstd/kmutex.hpp>
+#include "shrinker.hpp"
+
+// Protects the list against concurrent (un)registration. Scans run one at a time, a second one gives up right away.
+static kstd::mutex shrinker_lock;
+static kstd::mutex shrinker_scan_lock;
+static shrinker* shrinker_head = nullptr;
+
+void shrinker_register(shrinker* s)
+{
+    shrinker_lock.lock();
+
+    s->next = shrinker_head;
+    shrinker_head = s;
+
+    shrinker_lock.unlock();
+}
+
+void shrinker_unregister(shrinker* s)
+{
+    shrinker_lock.lock();
+
+    for (shrinker** link = &shrinker_head; *link != nullptr; link = &(*link)->next)
+    {
+        if (*link != s) continue;
+
+        *link = s->next;
+        break;
+    }
+
+    shrinker_lock.unlock();
+}
+
+size_t shrinker_scan(size_t pages)
+{
+    if (!shrinker_scan_lock.try_lock()) return 0;
+
+    size_t freed = 0;
+
+    for (shrinker* s = shrinker_head; s != nullptr; s = s->next) s->exhausted = false;
+
+    // Each round takes the shrinker with the most to give, so no cache is drained while others sit full.
+    while (pages > freed)
+    {
+        shrinker* best = nullptr;
+        size_t best_count = 0;
+
+        for (shrinker* s = shrinker_head; s != nullptr; s = s->next)
+        {
+            if (s->exhausted) continue;
+
+            size_t count = s->count();
+            if (count > best_count)
+            {
+                best = s;
+                best_count = count;
+            }
+        }
+
+        if (best == nullptr) break;
+
+        size_t done = best->scan(pages - freed);
+        if (done == 0) best->exhausted = true;
+
+        freed += done;
+    }
+
+    shrinker_scan_lock.unlock();
+
+    return freed;
+}
+
+size_t shrinker_count()
+{
+    size_t total = 0;
+    for (shrinker* s = shrinker_head; s != nullptr; s = s->next) total += s->count();
+
+    return total;
+}
+
+void shrinker_print()
+{
+    kstd::printf("Shrinkers:\n");
+    for (shrinker* s = shrinker_head; s != nullptr; s = s->next)
+    {
+        kstd::printf("    %s: %zu pages reclaimable\n", s->name, s->count());
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef KITTY_OS_CPP_SHRINKER_HPP
+#define KITTY_OS_CPP_SHRINKER_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Structs
+ */
+
+// A cache that can give frames back under memory pressure. Owned by whoever registers it, usually a static.
+// Both callbacks run with interrupts enabled, outside of any allocator, and mustn't wait on memory.
+struct shrinker
+{
+    const char* name;
+    size_t (*count)();              // Frames it could free right now, an estimate is fine.
+    size_t (*scan)(size_t pages);   // Frees up to about `pages` frames, returns how many it did.
+    shrinker* next;
+    bool exhausted;                 // Set during a scan once it had nothing to give.
+};
+
+/*
+ * Global function definitions
+ */
+void shrinker_register(shrinker* s);
+
+// Scans don't lock the list, only unregister a shrinker whose callbacks can still run when they'd return 0.
+void shrinker_unregister(shrinker* s);
+
+// Runs the shrinkers, the ones with the most to give first, until `pages` frames came back or they're
+// out of things to free. Returns the frames freed.
+size_t shrinker_scan(size_t pages);
+
+// Frames all shrinkers together could free.
+size_t shrinker_count();
+
+void shrinker_print();
+
+#endif //KITTY_OS_CPP_SHRINKER_HPP
@@ -0,0 +1,398 @@
+#include <kstd/kstdio.hpp>
+#include <mm/address_space.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include <mm/shrinker.hpp>
+#include "slab.hpp"
+
+static SlabCache slab_kmalloc_caches[SLAB_KMALLOC_COUNT];
+static const char* slab_kmalloc_names[SLAB_KMALLOC_COUNT] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k"
+};
+static bool slab_ready = false;
+
+static kstd::mutex slab_caches_lock;
+static SlabCache* slab_caches = nullptr;
+
+static inline uint64_t slab_align_up(uint64_t v, uint64_t alignment)
+{
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+static inline void** slab_link(void* object, size_t link_offset)
+{
+    return reinterpret_cast<void**>(static_cast<uint8_t*>(object) + link_offset);
+}
+
+// Slab `object` belongs to. Buddy blocks are aligned to their size physically, so the rounding is done on
+// the physical address.
+static inline slab* slab_of(const void* object)
+{
+    uint64_t phys = reinterpret_cast<uint64_t>(object) - vmm_hhdm->offset;
+    return vmm_make_virtual<slab*>(phys & ~(static_cast<uint64_t>(SLAB_SIZE) - 1));
+}
+
+static void slab_list_push(slab*& head, slab* s)
+{
+    s->prev = nullptr;
+    s->next = head;
+    if (head != nullptr) head->prev = s;
+    head = s;
+}
+
+static void slab_list_remove(slab*& head, slab* s)
+{
+    if (s->prev != nullptr) s->prev->next = s->next;
+    else head = s->next;
+
+    if (s->next != nullptr) s->next->prev = s->prev;
+    s->prev = s->next = nullptr;
+}
+
+bool SlabCache::init(const char* name, size_t object_size, size_t alignment, void (*constructor)(void*))
+{
+    if (alignment < alignof(void*)) alignment = alignof(void*);
+
+    this->name = name;
+    this->object_size = object_size;
+    this->constructor = constructor;
+
+    if (object_size == 0 || (alignment & (alignment - 1)) != 0 || alignment > SLAB_SIZE / SLAB_MIN_OBJECTS)
+    {
+        kstd::printf("[SLAB] Cache \"%s\": alignment %zu isn't usable.\n", name, alignment);
+        this->capacity = 0;
+        return false;
+    }
+
+    // Constructed objects keep their state while free, the link goes behind them.
+    size_t footprint = object_size < sizeof(void*) ? sizeof(void*) : object_size;
+    if (constructor != nullptr)
+    {
+        this->link_offset = slab_align_up(object_size, alignof(void*));
+        footprint = this->link_offset + sizeof(void*);
+    }
+
+    this->stride = slab_align_up(footprint, alignment);
+    this->first_offset = slab_align_up(sizeof(slab), alignment);
+    this->capacity = SLAB_SIZE > this->first_offset ? (SLAB_SIZE - this->first_offset) / this->stride : 0;
+
+    if (SLAB_MIN_OBJECTS > this->capacity)
+    {
+        kstd::printf("[SLAB] Cache \"%s\": objects of %zu bytes are too large for a slab.\n", name, object_size);
+        this->capacity = 0;
+        return false;
+    }
+
+    slab_caches_lock.lock();
+    this->next = slab_caches;
+    slab_caches = this;
+    slab_caches_lock.unlock();
+
+    return true;
+}
+
+// New slab with every object free, cache lock has to be held.
+slab* SlabCache::grow()
+{
+    uint64_t phys = pmm_alloc_pages(SLAB_ORDER);
+    if (phys == 0) return nullptr;
+
+    auto s = vmm_make_virtual<slab*>(phys);
+    s->magic = SLAB_MAGIC;
+    s->cache = this;
+    s->prev = s->next = nullptr;
+    s->free_list = nullptr;
+    s->in_use = 0;
+
+    // Linked back to front, so objects are handed out in address order.
+    auto base = reinterpret_cast<uint8_t*>(s) + this->first_offset;
+    for (size_t i = this->capacity; i > 0; i--)
+    {
+        void* object = base + (i - 1) * this->stride;
+        if (this->constructor != nullptr) this->constructor(object);
+
+        *slab_link(object, this->link_offset) = s->free_list;
+        s->free_list = object;
+    }
+
+    this->slab_count++;
+
+    return s;
+}
+
+// Object off the slabs, cache lock has to be held. nullptr if there's no memory for a new slab.
+void* SlabCache::take_object()
+{
+    slab* s = this->partial;
+
+    if (s == nullptr && this->empty != nullptr)
+    {
+        s = this->empty;
+        slab_list_remove(this->empty, s);
+        slab_list_push(this->partial, s);
+        this->empty_count--;
+    }
+
+    if (s == nullptr)
+    {
+        s = this->grow();
+        if (s == nullptr) return nullptr;
+
+        slab_list_push(this->partial, s);
+    }
+
+    void* object = s->free_list;
+    s->free_list = *slab_link(object, this->link_offset);
+    s->in_use++;
+    this->objects_in_use++;
+
+    if (s->in_use == this->capacity)
+    {
+        slab_list_remove(this->partial, s);
+        slab_list_push(this->full, s);
+    }
+
+    return object;
+}
+
+// Puts an object back on its slab, cache lock has to be held.
+void SlabCache::return_object(void* object)
+{
+    slab* s = slab_of(object);
+
+    if (s->in_use == this->capacity)
+    {
+        slab_list_remove(this->full, s);
+        slab_list_push(this->partial, s);
+    }
+
+    *slab_link(object, this->link_offset) = s->free_list;
+    s->free_list = object;
+    s->in_use--;
+    this->objects_in_use--;
+
+    if (s->in_use == 0)
+    {
+        slab_list_remove(this->partial, s);
+
+        if (this->empty_count >= SLAB_MAX_EMPTY)
+        {
+            s->magic = 0;
+            pmm_free_pages(reinterpret_cast<uint64_t>(s) - vmm_hhdm->offset, SLAB_ORDER);
+            this->slab_count--;
+        }
+        else
+        {
+            slab_list_push(this->empty, s);
+            this->empty_count++;
+        }
+    }
+}
+
+void* SlabCache::alloc()
+{
+    if (this->capacity == 0) return nullptr;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    slab_cpu_cache* cache = &this->cpu_caches[cpu_current_id()];
+
+    if (cache->count == 0)
+    {
+        this->lock.lock();
+
+        while (SLAB_CPU_CACHE_BATCH_SIZE > cache->count)
+        {
+            void* object = this->take_object();
+            if (object == nullptr) break;
+
+            cache->objects[cache->count++] = object;
+        }
+
+        this->lock.unlock();
+    }
+
+    void* object = cache->count > 0 ? cache->objects[--cache->count] : nullptr;
+
+    cpu_restore_interrupts(flags);
+
+    // No memory for a new slab. Reclaiming with the cache left alone may give it some, then it's one more try.
+    if (object == nullptr && pmm_direct_reclaim(1ULL << SLAB_ORDER))
+    {
+        flags = cpu_save_and_disable_interrupts();
+        cache = &this->cpu_caches[cpu_current_id()];
+
+        this->lock.lock();
+        object = cache->count > 0 ? cache->objects[--cache->count] : this->take_object();
+        this->lock.unlock();
+
+        cpu_restore_interrupts(flags);
+    }
+
+    if (object == nullptr) kstd::printf("[SLAB] Cache \"%s\" is out of memory.\n", this->name);
+
+    return object;
+}
+
+void SlabCache::free(void* object)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    slab_cpu_cache* cache = &this->cpu_caches[cpu_current_id()];
+
+    // Full, the coldest batch (bottom of the stack) goes back to the slabs.
+    if (cache->count == SLAB_CPU_CACHE_SIZE)
+    {
+        this->lock.lock();
+
+        for (size_t i = 0; SLAB_CPU_CACHE_BATCH_SIZE > i; i++)
+        {
+            this->return_object(cache->objects[i]);
+        }
+
+        this->lock.unlock();
+
+        cache->count -= SLAB_CPU_CACHE_BATCH_SIZE;
+        kstd::memmove(cache->objects, &cache->objects[SLAB_CPU_CACHE_BATCH_SIZE], cache->count * sizeof(void*));
+    }
+
+    cache->objects[cache->count++] = object;
+
+    cpu_restore_interrupts(flags);
+}
+
+const char* SlabCache::get_name() const
+{
+    return this->name;
+}
+
+size_t SlabCache::get_object_size() const
+{
+    return this->object_size;
+}
+
+bool SlabCache::holds(const slab* s, const void* object) const
+{
+    auto offset = static_cast<size_t>(static_cast<const uint8_t*>(object) - reinterpret_cast<const uint8_t*>(s));
+
+    if (s->cache != this || this->first_offset > offset) return false;
+
+    offset -= this->first_offset;
+
+    return offset % this->stride == 0 && this->capacity > offset / this->stride;
+}
+
+size_t SlabCache::get_slab_count() const
+{
+    return this->slab_count;
+}
+
+size_t SlabCache::get_objects_in_use() const
+{
+    return this->objects_in_use;
+}
+
+size_t SlabCache::get_reclaimable_pages() const
+{
+    size_t slabs = this->empty_count + this->cpu_caches[cpu_current_id()].count;
+    return (slabs < this->slab_count ? slabs : this->slab_count) << SLAB_ORDER;
+}
+
+size_t SlabCache::shrink()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    slab_cpu_cache* cache = &this->cpu_caches[cpu_current_id()];
+
+    this->lock.lock();
+
+    while (cache->count > 0) this->return_object(cache->objects[--cache->count]);
+
+    size_t freed = 0;
+    while (this->empty != nullptr)
+    {
+        slab* s = this->empty;
+        slab_list_remove(this->empty, s);
+
+        s->magic = 0;
+        pmm_free_pages(reinterpret_cast<uint64_t>(s) - vmm_hhdm->offset, SLAB_ORDER);
+        this->empty_count--;
+        this->slab_count--;
+        freed += 1ULL << SLAB_ORDER;
+    }
+
+    this->lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return freed;
+}
+
+// Caches are never torn down, the list is only walked, not locked.
+static size_t slab_shrinker_count()
+{
+    size_t pages = 0;
+    for (SlabCache* cache = slab_caches; cache != nullptr; cache = cache->next) pages += cache->get_reclaimable_pages();
+
+    return pages;
+}
+
+static size_t slab_shrinker_scan(size_t pages)
+{
+    size_t freed = 0;
+    for (SlabCache* cache = slab_caches; cache != nullptr && pages > freed; cache = cache->next) freed += cache->shrink();
+
+    return freed;
+}
+
+static shrinker slab_shrinker = {
+        .name = "slab",
+        .count = slab_shrinker_count,
+        .scan = slab_shrinker_scan,
+        .next = nullptr,
+        .exhausted = false
+};
+
+void slab_init()
+{
+    for (size_t i = 0; SLAB_KMALLOC_COUNT > i; i++)
+    {
+        size_t size = SLAB_KMALLOC_MIN_SIZE << i;
+
+        // Naturally aligned, an object never straddles more cache lines than it has to.
+        slab_kmalloc_caches[i].init(slab_kmalloc_names[i], size, size, nullptr);
+    }
+
+    slab_ready = true;
+
+    shrinker_register(&slab_shrinker);
+}
+
+void* slab_kmalloc(size_t size)
+{
+    if (!slab_ready || size > SLAB_KMALLOC_MAX_SIZE) return nullptr;
+
+    size_t index = 0;
+    while (size > (static_cast<size_t>(SLAB_KMALLOC_MIN_SIZE) << index)) index++;
+
+    return slab_kmalloc_caches[index].alloc();
+}
+
+void slab_free(void* object)
+{
+    if (object == nullptr) return;
+
+    slab_of(object)->cache->free(object);
+}
+
+size_t slab_object_size(const void* object)
+{
+    return slab_of(object)->cache->get_object_size();
+}
+
+bool slab_owns(const void* ptr)
+{
+    auto address = reinterpret_cast<uint64_t>(ptr);
+
+    if (vmm_hhdm == nullptr || vmm_hhdm->offset > address || address >= ADDRESS_SPACE_KERNEL_START) return false;
+
+    // Other HHDM memory (DMA buffers, page tables, ...) has no slab header in front of it.
+    slab* s = slab_of(ptr);
+
+    return s->magic == SLAB_MAGIC && s->cache != nullptr && s->cache->holds(s, ptr);
+}
@@ -0,0 +1,129 @@
+#ifndef KITTY_OS_CPP_SLAB_HPP
+#define KITTY_OS_CPP_SLAB_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/pmm.hpp>
+#include <kstd/kmutex.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+
+/*
+ * Raw defines
+ */
+#define SLAB_ORDER 2                        // Every slab is one 16 KiB buddy block, aligned to its size.
+#define SLAB_SIZE (PAGE_SIZE << SLAB_ORDER)
+#define SLAB_MIN_OBJECTS 4                  // Objects that don't fit this many times in a slab are refused.
+#define SLAB_MAX_EMPTY 1                    // Empty slabs a cache holds on to, the rest go back to the PMM.
+#define SLAB_CPU_CACHE_SIZE 16              // Objects held by every per-CPU cache.
+#define SLAB_CPU_CACHE_BATCH_SIZE 8         // Objects moved between a per-CPU cache and the slabs at once.
+#define SLAB_MAGIC 0x51AB51AB51AB51ABULL    // Marks a live slab header, cleared before the slab goes back.
+
+#define SLAB_KMALLOC_MIN_SIZE 16
+#define SLAB_KMALLOC_COUNT 8                // Power of two size classes, 16 B - 2 KiB.
+#define SLAB_KMALLOC_MAX_SIZE (SLAB_KMALLOC_MIN_SIZE << (SLAB_KMALLOC_COUNT - 1))
+
+/*
+ * Structs
+ */
+class SlabCache;
+
+// Sits at the start of every slab, objects follow it. A slab is on its cache's empty, partial
+// or full list depending on `in_use`.
+struct slab
+{
+    uint64_t magic;
+    SlabCache* cache;
+    slab* prev;
+    slab* next;
+    void* free_list;
+    size_t in_use;
+};
+
+// Stack of free objects in front of a cache's slabs. Only touched by its own CPU with interrupts
+// disabled, so the common path doesn't take the cache lock.
+struct slab_cpu_cache
+{
+    size_t count;
+    void* objects[SLAB_CPU_CACHE_SIZE];
+};
+
+/*
+ * Classes
+ */
+
+// Objects of one size carved out of slabs. Allocating and freeing is a free list pop/push, the slab
+// an object belongs to is found by rounding its address down to SLAB_SIZE.
+// With a constructor, objects are constructed once when their slab is made and have to be freed in
+// their constructed state. Their free list link is kept behind the object, so that state survives.
+// alloc() and free() go through a per-CPU cache first, the slabs and the lock are only touched in batches.
+class SlabCache
+{
+private:
+    const char* name = nullptr;
+    size_t object_size = 0;
+    size_t stride = 0;
+    size_t first_offset = 0;    // Offset of the first object, past the slab header.
+    size_t link_offset = 0;     // Where a free object keeps the next one.
+    size_t capacity = 0;
+    void (*constructor)(void*) = nullptr;
+
+    slab* empty = nullptr;
+    slab* partial = nullptr;
+    slab* full = nullptr;
+    size_t empty_count = 0;
+    size_t slab_count = 0;
+    size_t objects_in_use = 0;     // Objects sitting in the per-CPU caches included.
+
+    slab_cpu_cache cpu_caches[CPU_MAX_COUNT] = {};
+    kstd::mutex lock;
+
+    slab* grow();
+    void* take_object();
+    void return_object(void* object);
+public:
+    SlabCache* next = nullptr;  // Every initialized cache is on one list, for the slab shrinker.
+
+    // Returns false if the object doesn't fit SLAB_MIN_OBJECTS times in a slab or `alignment` isn't a power of two.
+    bool init(const char* name, size_t object_size, size_t alignment, void (*constructor)(void*));
+
+    // nullptr if there's no memory for a new slab.
+    void* alloc();
+    void free(void* object);
+
+    const char* get_name() const;
+    size_t get_object_size() const;
+
+    // True if `object` is where one of this cache's objects starts in slab `s`.
+    bool holds(const slab* s, const void* object) const;
+    size_t get_slab_count() const;
+    size_t get_objects_in_use() const;
+    // Frames shrink() would free at most: the empty slabs and those the calling CPU's cached objects keep in use.
+    size_t get_reclaimable_pages() const;
+
+    // Gives the calling CPU's cached objects back to their slabs and frees every empty slab.
+    // Returns the frames freed.
+    size_t shrink();
+};
+
+/*
+ * Global function definitions
+ */
+
+// Sets up the kmalloc size classes, needs the PMM.
+void slab_init();
+
+// Object of at least `size` bytes from the smallest size class that fits, aligned to that class.
+// nullptr above SLAB_KMALLOC_MAX_SIZE, before slab_init() or if there's no memory.
+void* slab_kmalloc(size_t size);
+
+// Frees an object of any cache.
+void slab_free(void* object);
+
+// Size of the objects in the cache `object` belongs to.
+size_t slab_object_size(const void* object);
+
+// True if `ptr` is a slab object. Slabs live in the HHDM, the heap and vmalloc in the kernel window,
+// other HHDM memory is told apart by the slab header.
+bool slab_owns(const void* ptr);
+
+#endif //KITTY_OS_CPP_SLAB_HPP
@@ -0,0 +1,49 @@
+bits 64
+
+%define EFAULT 14
+
+; Every instruction touching a user pointer gets an entry: its address and the label to resume at.
+%macro EX_TABLE 2
+    section .ex_table
+        dq %1, %2
+    section .text
+%endmacro
+
+section .ex_table progbits alloc noexec write align=8
+section .text
+
+; long uaccess_copy(void* dst, const void* src, size_t count) -> 0, or -EFAULT.
+global uaccess_copy
+uaccess_copy:
+    mov rcx, rdx
+.copy:
+    rep movsb
+    xor eax, eax
+    ret
+.fault:
+    mov rax, -EFAULT
+    ret
+
+EX_TABLE uaccess_copy.copy, uaccess_copy.fault
+
+; long uaccess_strncpy(char* dst, const char* src, size_t count) -> length, or -EFAULT.
+global uaccess_strncpy
+uaccess_strncpy:
+    xor eax, eax
+.next:
+    cmp rax, rdx
+    je .done
+.load:
+    movzx ecx, byte [rsi + rax]
+    mov [rdi + rax], cl
+    test cl, cl
+    jz .done
+    inc rax
+    jmp .next
+.done:
+    ret
+.fault:
+    mov rax, -EFAULT
+    ret
+
+EX_TABLE uaccess_strncpy.load, uaccess_strncpy.fault
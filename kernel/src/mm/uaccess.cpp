@@ -0,0 +1,80 @@
+#include <mm/address_space.hpp>
+#include "uaccess.hpp"
+
+extern exception_table_entry __ex_table_start[];
+extern exception_table_entry __ex_table_end[];
+
+extern "C" long uaccess_copy(void* dst, const void* src, size_t count);
+extern "C" long uaccess_strncpy(char* dst, const char* src, size_t count);
+
+// [address, address + count) is in the lower half. Checked up front, a kernel address wouldn't fault.
+static inline bool uaccess_range_ok(const void* address, size_t count)
+{
+    auto start = reinterpret_cast<uint64_t>(address);
+    return ADDRESS_SPACE_USER_END >= start && ADDRESS_SPACE_USER_END - start >= count;
+}
+
+void uaccess_init()
+{
+    size_t count = __ex_table_end - __ex_table_start;
+
+    // A handful of entries, already in order unless the linker moved a file around.
+    for (size_t i = 1; count > i; i++)
+    {
+        exception_table_entry entry = __ex_table_start[i];
+        size_t j = i;
+
+        for (; j > 0 && __ex_table_start[j - 1].fault_address > entry.fault_address; j--) __ex_table_start[j] = __ex_table_start[j - 1];
+        __ex_table_start[j] = entry;
+    }
+}
+
+bool uaccess_fixup(Registers_x86_64* regs)
+{
+    // User mode never runs kernel code from the table.
+    if ((regs->cs & 3) != 0) return false;
+
+    size_t low = 0;
+    size_t high = __ex_table_end - __ex_table_start;
+
+    while (high > low)
+    {
+        size_t middle = low + (high - low) / 2;
+        uint64_t fault_address = __ex_table_start[middle].fault_address;
+
+        if (fault_address == regs->rip)
+        {
+            regs->rip = __ex_table_start[middle].fixup_address;
+            return true;
+        }
+
+        if (regs->rip > fault_address) low = middle + 1;
+        else high = middle;
+    }
+
+    return false;
+}
+
+long copy_from_user(void* dst, const void* src, size_t count)
+{
+    if (!uaccess_range_ok(src, count)) return -EFAULT;
+    return uaccess_copy(dst, src, count);
+}
+
+long copy_to_user(void* dst, const void* src, size_t count)
+{
+    if (!uaccess_range_ok(dst, count)) return -EFAULT;
+    return uaccess_copy(dst, src, count);
+}
+
+long strncpy_from_user(char* dst, const char* src, size_t count)
+{
+    // Only what's below the end of the lower half is read, a string running into it is as bad as a fault.
+    auto start = reinterpret_cast<uint64_t>(src);
+    if (start >= ADDRESS_SPACE_USER_END) return -EFAULT;
+
+    size_t limit = ADDRESS_SPACE_USER_END - start > count ? count : ADDRESS_SPACE_USER_END - start;
+    long length = uaccess_strncpy(dst, src, limit);
+
+    return count > limit && length == static_cast<long>(limit) ? -EFAULT : length;
+}
@@ -0,0 +1,44 @@
+#ifndef KITTY_OS_CPP_UACCESS_HPP
+#define KITTY_OS_CPP_UACCESS_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <hal/x64/idt/idt.hpp>
+
+/*
+ * Raw defines
+ */
+#define EFAULT 14
+
+/*
+ * Structs
+ */
+
+// An instruction that may fault on a user pointer and where to go when it does. Put in .ex_table by uaccess.asm.
+struct exception_table_entry
+{
+    uint64_t fault_address;
+    uint64_t fixup_address;
+};
+
+/*
+ * Global function definitions
+ */
+
+// Sorts the exception table, page faults look it up with a binary search.
+void uaccess_init();
+
+// Resumes at the fixup of the instruction `regs` faulted on, false if it has none.
+bool uaccess_fixup(Registers_x86_64* regs);
+
+// Copies between the kernel and the lower half, 0 or -EFAULT if a byte can't be reached. There's no
+// page table walk up front: unmapped pages are faulted in like any other access, only what the fault
+// handler gives up on fails. Not to be called with an address space lock held.
+long copy_from_user(void* dst, const void* src, size_t count);
+long copy_to_user(void* dst, const void* src, size_t count);
+
+// Copies a string of at most `count` bytes, the terminator included if it fits. Its length, `count` if
+// there's no terminator in the first `count` bytes, or -EFAULT.
+long strncpy_from_user(char* dst, const char* src, size_t count);
+
+#endif //KITTY_OS_CPP_UACCESS_HPP
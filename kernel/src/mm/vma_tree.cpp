@@ -0,0 +1,331 @@
+#include "vma_tree.hpp"
+
+static inline int vma_height(const vm_area* area)
+{
+    return area != nullptr ? area->height : 0;
+}
+
+static inline uint64_t vma_max_gap(const vm_area* area)
+{
+    return area != nullptr ? area->max_gap : 0;
+}
+
+// Height and max_gap from the children, which have to be up to date.
+static void vma_fix(vm_area* area)
+{
+    int left = vma_height(area->left);
+    int right = vma_height(area->right);
+    area->height = 1 + (left > right ? left : right);
+
+    uint64_t gap = area->gap_before;
+    if (vma_max_gap(area->left) > gap) gap = vma_max_gap(area->left);
+    if (vma_max_gap(area->right) > gap) gap = vma_max_gap(area->right);
+    area->max_gap = gap;
+}
+
+static inline uint64_t vma_align_up(uint64_t v, uint64_t alignment)
+{
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+void VMATree::refresh_gap(vm_area* area)
+{
+    vm_area* previous = prev(area);
+    area->gap_before = area->start - (previous != nullptr ? previous->end : 0);
+}
+
+void VMATree::refresh_path(vm_area* area)
+{
+    for (; area != nullptr; area = area->parent)
+    {
+        vma_fix(area);
+    }
+}
+
+void VMATree::replace_child(vm_area* parent, vm_area* old_child, vm_area* new_child)
+{
+    if (parent == nullptr) this->root = new_child;
+    else if (parent->left == old_child) parent->left = new_child;
+    else parent->right = new_child;
+}
+
+void VMATree::rotate_left(vm_area* area)
+{
+    vm_area* pivot = area->right;
+
+    area->right = pivot->left;
+    if (pivot->left != nullptr) pivot->left->parent = area;
+
+    pivot->parent = area->parent;
+    this->replace_child(area->parent, area, pivot);
+
+    pivot->left = area;
+    area->parent = pivot;
+
+    vma_fix(area);
+    vma_fix(pivot);
+}
+
+void VMATree::rotate_right(vm_area* area)
+{
+    vm_area* pivot = area->left;
+
+    area->left = pivot->right;
+    if (pivot->right != nullptr) pivot->right->parent = area;
+
+    pivot->parent = area->parent;
+    this->replace_child(area->parent, area, pivot);
+
+    pivot->right = area;
+    area->parent = pivot;
+
+    vma_fix(area);
+    vma_fix(pivot);
+}
+
+// Fixes heights and gaps from `area` up to the root, rotating wherever the balance is off by more than one.
+void VMATree::rebalance(vm_area* area)
+{
+    while (area != nullptr)
+    {
+        vma_fix(area);
+
+        int balance = vma_height(area->left) - vma_height(area->right);
+
+        if (balance > 1)
+        {
+            if (vma_height(area->left->left) < vma_height(area->left->right)) this->rotate_left(area->left);
+            this->rotate_right(area);
+            area = area->parent;
+        }
+        else if (balance < -1)
+        {
+            if (vma_height(area->right->right) < vma_height(area->right->left)) this->rotate_right(area->right);
+            this->rotate_left(area);
+            area = area->parent;
+        }
+
+        area = area->parent;
+    }
+}
+
+vm_area* VMATree::find(uint64_t address) const
+{
+    vm_area* area = this->root;
+
+    while (area != nullptr)
+    {
+        if (area->start > address) area = area->left;
+        else if (address >= area->end) area = area->right;
+        else return area;
+    }
+
+    return nullptr;
+}
+
+vm_area* VMATree::first_ending_after(uint64_t address) const
+{
+    vm_area* found = nullptr;
+    vm_area* area = this->root;
+
+    // Areas don't overlap, so their ends are sorted just like their starts.
+    while (area != nullptr)
+    {
+        if (area->end > address)
+        {
+            found = area;
+            area = area->left;
+        }
+        else
+        {
+            area = area->right;
+        }
+    }
+
+    return found;
+}
+
+vm_area* VMATree::first() const
+{
+    vm_area* area = this->root;
+    while (area != nullptr && area->left != nullptr) area = area->left;
+    return area;
+}
+
+vm_area* VMATree::last() const
+{
+    vm_area* area = this->root;
+    while (area != nullptr && area->right != nullptr) area = area->right;
+    return area;
+}
+
+vm_area* VMATree::next(vm_area* area)
+{
+    if (area->right != nullptr)
+    {
+        area = area->right;
+        while (area->left != nullptr) area = area->left;
+        return area;
+    }
+
+    while (area->parent != nullptr && area->parent->right == area) area = area->parent;
+    return area->parent;
+}
+
+vm_area* VMATree::prev(vm_area* area)
+{
+    if (area->left != nullptr)
+    {
+        area = area->left;
+        while (area->right != nullptr) area = area->right;
+        return area;
+    }
+
+    while (area->parent != nullptr && area->parent->left == area) area = area->parent;
+    return area->parent;
+}
+
+void VMATree::insert(vm_area* area)
+{
+    vm_area* parent = nullptr;
+    vm_area* current = this->root;
+
+    while (current != nullptr)
+    {
+        parent = current;
+        current = area->start < current->start ? current->left : current->right;
+    }
+
+    area->left = nullptr;
+    area->right = nullptr;
+    area->parent = parent;
+    area->height = 1;
+
+    if (parent == nullptr) this->root = area;
+    else if (area->start < parent->start) parent->left = area;
+    else parent->right = area;
+
+    this->count++;
+
+    this->refresh_gap(area);
+    this->rebalance(area);
+
+    // The next area's gap shrank.
+    vm_area* successor = next(area);
+    if (successor != nullptr)
+    {
+        this->refresh_gap(successor);
+        this->refresh_path(successor);
+    }
+}
+
+void VMATree::erase(vm_area* area)
+{
+    vm_area* successor = next(area);
+    vm_area* predecessor = prev(area);
+    vm_area* fix_from = nullptr;
+
+    if (area->left == nullptr || area->right == nullptr)
+    {
+        vm_area* child = area->left != nullptr ? area->left : area->right;
+
+        fix_from = area->parent;
+        this->replace_child(area->parent, area, child);
+        if (child != nullptr) child->parent = area->parent;
+    }
+    else
+    {
+        // The successor is the leftmost area of the right subtree, it takes the erased area's place.
+        vm_area* replacement = successor;
+
+        if (replacement->parent != area)
+        {
+            fix_from = replacement->parent;
+
+            this->replace_child(replacement->parent, replacement, replacement->right);
+            if (replacement->right != nullptr) replacement->right->parent = replacement->parent;
+
+            replacement->right = area->right;
+            replacement->right->parent = replacement;
+        }
+        else
+        {
+            fix_from = replacement;
+        }
+
+        this->replace_child(area->parent, area, replacement);
+        replacement->parent = area->parent;
+
+        replacement->left = area->left;
+        replacement->left->parent = replacement;
+        replacement->height = area->height;
+    }
+
+    this->count--;
+
+    // The next area's gap grows by the erased one.
+    if (successor != nullptr) successor->gap_before = successor->start - (predecessor != nullptr ? predecessor->end : 0);
+
+    this->rebalance(fix_from);
+    if (successor != nullptr) this->refresh_path(successor);
+
+    area->left = area->right = area->parent = nullptr;
+}
+
+void VMATree::update(vm_area* area)
+{
+    this->refresh_gap(area);
+    this->refresh_path(area);
+
+    vm_area* successor = next(area);
+    if (successor != nullptr)
+    {
+        this->refresh_gap(successor);
+        this->refresh_path(successor);
+    }
+}
+
+uint64_t VMATree::search_gap(vm_area* area, uint64_t length, uint64_t alignment, uint64_t low, uint64_t high) const
+{
+    if (area == nullptr || length > area->max_gap) return 0;
+
+    // Everything on the left ends below this area's start, nothing there if that's below `low`.
+    if (area->start > low)
+    {
+        uint64_t found = this->search_gap(area->left, length, alignment, low, high);
+        if (found != 0) return found;
+    }
+
+    uint64_t gap_start = area->start - area->gap_before;
+    if (low > gap_start) gap_start = low;
+    gap_start = vma_align_up(gap_start, alignment);
+
+    // Gaps further right only start higher.
+    if (gap_start >= high || length > high - gap_start) return 0;
+
+    if (area->start >= gap_start && area->start - gap_start >= length) return gap_start;
+
+    return this->search_gap(area->right, length, alignment, low, high);
+}
+
+uint64_t VMATree::find_gap(uint64_t length, uint64_t alignment, uint64_t low, uint64_t high) const
+{
+    if (length == 0 || alignment == 0 || low >= high) return 0;
+
+    uint64_t found = this->search_gap(this->root, length, alignment, low, high);
+    if (found != 0) return found;
+
+    // Past the last area.
+    vm_area* tail = this->last();
+    uint64_t gap_start = tail != nullptr && tail->end > low ? tail->end : low;
+    gap_start = vma_align_up(gap_start, alignment);
+
+    if (gap_start >= high || length > high - gap_start) return 0;
+
+    return gap_start;
+}
+
+size_t VMATree::size() const
+{
+    return this->count;
+}
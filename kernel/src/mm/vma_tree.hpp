@@ -0,0 +1,72 @@
+#ifndef KITTY_OS_CPP_VMA_TREE_HPP
+#define KITTY_OS_CPP_VMA_TREE_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Structs
+ */
+
+// A range of virtual memory with one protection, [start, end) page aligned.
+struct vm_area
+{
+    uint64_t start;
+    uint64_t end;
+    int prot_flags;
+    int area_flags;
+
+    vm_area* left;
+    vm_area* right;
+    vm_area* parent;
+    int height;
+
+    uint64_t gap_before;    // Free space between the previous area's end (or 0) and start.
+    uint64_t max_gap;       // Largest gap_before in the subtree, lets the gap search skip whole subtrees.
+};
+
+/*
+ * Classes
+ */
+
+// AVL tree of non-overlapping areas ordered by address. Lookups, gap searches and updates are O(log n).
+// Nodes are owned by the caller, the tree only links them.
+class VMATree
+{
+private:
+    vm_area* root = nullptr;
+    size_t count = 0;
+
+    void refresh_gap(vm_area* area);
+    void refresh_path(vm_area* area);
+    void rotate_left(vm_area* area);
+    void rotate_right(vm_area* area);
+    void rebalance(vm_area* area);
+    void replace_child(vm_area* parent, vm_area* old_child, vm_area* new_child);
+    uint64_t search_gap(vm_area* area, uint64_t length, uint64_t alignment, uint64_t low, uint64_t high) const;
+public:
+    // Area containing `address`, nullptr if it's in a gap.
+    vm_area* find(uint64_t address) const;
+
+    // First area ending above `address`, i.e. the one containing it or the next one.
+    vm_area* first_ending_after(uint64_t address) const;
+
+    vm_area* first() const;
+    vm_area* last() const;
+    static vm_area* next(vm_area* area);
+    static vm_area* prev(vm_area* area);
+
+    // `area` mustn't overlap anything in the tree.
+    void insert(vm_area* area);
+    void erase(vm_area* area);
+
+    // Call after moving an area's start/end in place, without passing its neighbours.
+    void update(vm_area* area);
+
+    // Lowest `alignment` aligned start of `length` free bytes within [low, high), 0 if there's none.
+    uint64_t find_gap(uint64_t length, uint64_t alignment, uint64_t low, uint64_t high) const;
+
+    size_t size() const;
+};
+
+#endif //KITTY_OS_CPP_VMA_TREE_HPP
@@ -0,0 +1,84 @@
+#include <kstd/kstdio.hpp>
+#include <mm/address_space.hpp>
+#include "vmalloc.hpp"
+
+// Frames mapped per vmm_map_frames() call.
+constexpr size_t vmalloc_map_batch = 64;
+
+static size_t vmalloc_pages = 0;
+
+void* vmalloc(size_t len)
+{
+    size_t pages = len != 0 ? (len + PAGE_SIZE - 1) / PAGE_SIZE : 1;
+    AddressSpace* kernel = address_space_kernel();
+
+    uint64_t start = kernel->reserve((pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE, PAGE_SIZE, PROT_SUPERVISOR | PROT_RW, VM_AREA_VMALLOC);
+    if (start == 0) return nullptr;
+
+    uint64_t frames[vmalloc_map_batch];
+
+    for (size_t done = 0; pages > done;)
+    {
+        size_t batch = pages - done < vmalloc_map_batch ? pages - done : vmalloc_map_batch;
+        size_t allocated = 0;
+
+        while (batch > allocated)
+        {
+            frames[allocated] = pmm_alloc_page();
+            if (frames[allocated] == 0) break;
+
+            allocated++;
+        }
+
+        if (allocated != batch ||
+            !vmm_map_frames(kernel->get_pml4(), start + done * PAGE_SIZE, frames, batch, PROT_SUPERVISOR | PROT_RW, MAP_PRESENT | MAP_GLOBAL, MISC_INVLPG))
+        {
+            // release() takes care of what's mapped already, a failed map may have mapped part of the batch.
+            for (size_t i = 0; allocated > i; i++)
+            {
+                if (vmm_virt_to_phys(kernel->get_pml4(), start + (done + i) * PAGE_SIZE) == 0) pmm_free_page(frames[i]);
+            }
+
+            kernel->release(start, (pages + VMALLOC_GUARD_PAGES) * PAGE_SIZE);
+
+            kstd::printf("[VMALLOC] No memory for %zu bytes.\n", len);
+            return nullptr;
+        }
+
+        done += batch;
+    }
+
+    __atomic_add_fetch(&vmalloc_pages, pages, __ATOMIC_RELAXED);
+
+    return reinterpret_cast<void*>(start);
+}
+
+void vfree(void* ptr)
+{
+    if (ptr == nullptr) return;
+
+    size_t size = vmalloc_size(ptr);
+    if (size == 0)
+    {
+        kstd::printf("[VMALLOC] Freeing %p, which isn't a vmalloc() mapping.\n", ptr);
+        return;
+    }
+
+    address_space_kernel()->release(reinterpret_cast<uint64_t>(ptr), size + VMALLOC_GUARD_PAGES * PAGE_SIZE);
+    __atomic_sub_fetch(&vmalloc_pages, size / PAGE_SIZE, __ATOMIC_RELAXED);
+}
+
+size_t vmalloc_size(const void* ptr)
+{
+    auto address = reinterpret_cast<uint64_t>(ptr);
+    vm_area area {};
+
+    if (!address_space_kernel()->find_area(address, &area) || !(area.area_flags & VM_AREA_VMALLOC) || area.start != address) return 0;
+
+    return area.end - area.start - VMALLOC_GUARD_PAGES * PAGE_SIZE;
+}
+
+uint64_t vmalloc_get_used_memory()
+{
+    return __atomic_load_n(&vmalloc_pages, __ATOMIC_RELAXED) * PAGE_SIZE;
+}
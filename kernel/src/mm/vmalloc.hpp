@@ -0,0 +1,30 @@
+#ifndef KITTY_OS_CPP_VMALLOC_HPP
+#define KITTY_OS_CPP_VMALLOC_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/pmm.hpp>
+
+/*
+ * Raw defines
+ */
+#define VMALLOC_THRESHOLD PAGE_SIZE     // kmalloc() sizes from here on get a mapping of their own instead of a heap block.
+#define VMALLOC_GUARD_PAGES 1           // Unmapped pages after every mapping, running off the end faults.
+
+/*
+ * Global function definitions
+ */
+
+// Page aligned memory of at least `len` bytes, virtually contiguous and backed by whatever frames
+// the PMM has. nullptr if there's no memory or kernel virtual memory left.
+void* vmalloc(size_t len);
+
+// Unmaps a vmalloc() mapping and gives all its frames back at once.
+void vfree(void* ptr);
+
+// Mapped bytes of the mapping starting at `ptr`, 0 if `ptr` isn't one.
+size_t vmalloc_size(const void* ptr);
+
+uint64_t vmalloc_get_used_memory();
+
+#endif //KITTY_OS_CPP_VMALLOC_HPP
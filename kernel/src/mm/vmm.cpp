@@ -2,8 +2,18 @@
 // Created by Piotr on 18.05.2024.
 //
 
+#include <hal/x64/cpuid.hpp>
+#include <hal/x64/msr.hpp>
+#include <mm/pcid.hpp>
+#include <mm/zram.hpp>
 #include "vmm.hpp"
 
+extern "C" char __kernel_text_start[], __kernel_text_end[];
+extern "C" char __kernel_rodata_start[], __kernel_rodata_end[];
+
+static bool vmm_1g_pages = false;
+static bool vmm_pat = false;
+
 limine_hhdm_response* vmm_hhdm = nullptr;
 limine_hhdm_request vmm_hhdm_request = {
         .id = LIMINE_HHDM_REQUEST,
@@ -25,6 +35,31 @@ void vmm_init()
 
         vmm_hhdm = vmm_hhdm_request.response;
 
+        // The response is read on every physical -> virtual translation, keep it through reclaim.
+        pmm_keep_boot_memory(vmm_hhdm, sizeof(limine_hhdm_response));
+
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0x80000001, eax, ebx, ecx, edx);
+        vmm_1g_pages = (edx & (1 << 26)) != 0;
+
+        // Global pages survive CR3 reloads, the kernel half is the same in every address space.
+        cpuid(1, eax, ebx, ecx, edx);
+        if (edx & (1 << 13))
+        {
+            uint64_t cr4;
+            asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+            asm volatile ("mov %0, %%cr4" :: "r"(cr4 | (1 << 7)) : "memory");
+        }
+
+        // Nothing is mapped WC yet and the first four entries keep their types, no cache flush needed.
+        vmm_pat = (edx & (1 << 16)) != 0;
+        if (vmm_pat)
+        {
+            cpu_write_msr(MSR_IA32_PAT, VMM_PAT_VALUE);
+        }
+
+        pcid_init();
+
         uint64_t this_pml4e = vmm_get_pml4();
         kstd::printf("PML4e address: %lx\n", this_pml4e);
 
@@ -34,10 +69,22 @@ void vmm_init()
 
 bool vmm_map(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, int prot_flags, int map_flags, int misc_flags)
 {
-    vmm_address va = vmm_split_va(virt_address);
+    size_t pages = 1;
+    if (map_flags & MAP_LARGE) pages = VMM_PAGES_PER_2M;
+    if (map_flags & MAP_HUGE) pages = VMM_PAGES_PER_1G;
+
+    if ((map_flags & MAP_HUGE) && !vmm_1g_pages)
+    {
+        if constexpr (vmm_verbose)
+        {
+            kstd::printf("[VMM] 1 GiB pages aren't supported by this CPU.\n");
+        }
+
+        return false;
+    }
 
     // Alignment check.
-    if (phys_address % PAGE_SIZE != 0)
+    if (phys_address % (pages * PAGE_SIZE) != 0)
     {
         if constexpr (vmm_verbose)
         {
@@ -48,7 +95,7 @@ bool vmm_map(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, int pro
         return false;
     }
 
-    if (virt_address % PAGE_SIZE != 0)
+    if (virt_address % (pages * PAGE_SIZE) != 0)
     {
         if constexpr (vmm_verbose)
         {
@@ -57,88 +104,758 @@ bool vmm_map(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, int pro
         unreachable();
     }
 
-    // Get separate flags already.
-    bool protection_rw = (prot_flags & PROT_RW) > 0 ? true : false;
-    bool protection_noexec = (prot_flags & PROT_NOEXEC) > 0 ?  true : false;
-    bool protection_supervisor = (prot_flags & PROT_SUPERVISOR) > 0 ?  true : false;
+    if (!(prot_flags & PROT_RW)) kstd::printf("WARNING! NO RW FLAG SET.\n");
+    if (!(map_flags & MAP_PRESENT)) kstd::printf("WARNING! NO PRESENT FLAG SET.\n");
 
-    bool map_present = (map_flags & MAP_PRESENT) > 0 ?  true : false;
-    bool map_global = (map_flags & MAP_GLOBAL) > 0 ?  true : false;
+    // An aligned range covering a whole 2 MiB/1 GiB page is always mapped with one.
+    return vmm_map_range(pml4e, virt_address, phys_address, pages, prot_flags, map_flags, misc_flags);
+}
+
+// Page table entries on the way from the PML4 to a page table.
+struct vmm_table_path
+{
+    uint64_t* pml4_entry;
+    uint64_t* pdpt_entry;
+    uint64_t* pd_entry;
+};
 
-    if (!protection_rw) kstd::printf("WARNING! NO RW FLAG SET.\n");
-    if (!map_present) kstd::printf("WARNING! NO PRESENT FLAG SET.\n");
+// Pages mapped by one PDPT (level 3) or page directory (level 2) entry.
+static constexpr size_t vmm_level_pages(size_t level)
+{
+    return level == 3 ? VMM_PAGES_PER_1G : VMM_PAGES_PER_2M;
+}
 
-    bool misc_invlpg = (misc_flags & MISC_INVLPG) > 0 ?  true : false;
+// Returns the table `entry` points to, nullptr for holes and huge pages.
+// With `create` missing tables get allocated and the entry is opened up for the leaf entries to decide.
+static uint64_t* vmm_lower_table(uint64_t* entry, bool create, bool user)
+{
+    uint64_t flags = VMM_ENTRY_PRESENT | VMM_ENTRY_RW | (user ? VMM_ENTRY_USER : 0);
+
+    if ((*entry & VMM_ENTRY_ADDRESS_MASK) != 0)
+    {
+        if (*entry & VMM_ENTRY_HUGE) return nullptr;
+
+        if (create) *entry |= flags;
+        return vmm_make_virtual<uint64_t*>(*entry & VMM_ENTRY_ADDRESS_MASK);
+    }
 
-    if (pml4e[va.pml4e].pdpe_ptr == 0) {
-        uint64_t p = pmm_alloc_page();
+    if (!create) return nullptr;
 
-        kstd::memset(vmm_make_virtual<uint8_t*>(p), 0, 4096);
+    uint64_t table = pmm_alloc_zeroed_page();
+    if (table == 0) return nullptr;
 
-        pml4e[va.pml4e].pdpe_ptr = p >> 12;
-        pml4e[va.pml4e].present = map_present;
-        pml4e[va.pml4e].read_write = protection_rw;
+    *entry = table | flags;
 
+    return vmm_make_virtual<uint64_t*>(table);
+}
+
+// Replaces the huge page at `entry` with a table of the next smaller pages, mapping the same frames with the same flags.
+static bool vmm_split_huge_page(uint64_t* entry, size_t level)
+{
+    uint64_t table = pmm_alloc_zeroed_page();
+    if (table == 0)
+    {
+        kstd::printf("[VMM] Out of memory splitting a huge page.\n");
+        return false;
+    }
+
+    uint64_t base = *entry & VMM_ENTRY_ADDRESS_MASK & ~VMM_ENTRY_HUGE_PAT;
+    uint64_t flags = *entry & ~VMM_ENTRY_ADDRESS_MASK;
+    uint64_t step = level == 3 ? VMM_PAGES_PER_2M * PAGE_SIZE : PAGE_SIZE;
+
+    // PTEs keep PAT in the bit PDEs use for PS.
+    if (level == 2)
+    {
+        flags &= ~VMM_ENTRY_HUGE;
+        if (*entry & VMM_ENTRY_HUGE_PAT) flags |= VMM_ENTRY_HUGE;
+    }
+    else if (*entry & VMM_ENTRY_HUGE_PAT)
+    {
+        flags |= VMM_ENTRY_HUGE_PAT;
+    }
+
+    auto entries = vmm_make_virtual<uint64_t*>(table);
+    for (size_t i = 0; 512 > i; i++)
+    {
+        entries[i] = (base + i * step) | flags;
+    }
+
+    *entry = table | VMM_ENTRY_PRESENT | VMM_ENTRY_RW | (flags & VMM_ENTRY_USER);
+    return true;
+}
+
+// Frees the table `entry` points to and every table below it, the frames they map are left alone.
+static void vmm_free_tables(uint64_t entry, size_t level)
+{
+    uint64_t table = entry & VMM_ENTRY_ADDRESS_MASK;
+
+    if (level == 3)
+    {
+        auto entries = vmm_make_virtual<uint64_t*>(table);
+        for (size_t i = 0; 512 > i; i++)
+        {
+            if ((entries[i] & VMM_ENTRY_ADDRESS_MASK) != 0 && !(entries[i] & VMM_ENTRY_HUGE))
+                pmm_free_page(entries[i] & VMM_ENTRY_ADDRESS_MASK);
+        }
+    }
+
+    pmm_free_page(table);
+}
+
+// The entry structs are packed, a plain cast to uint64_t* trips -Waddress-of-packed-member.
+static uint64_t* vmm_raw_entries(pml4e* table)
+{
+    return __builtin_bit_cast(uint64_t*, table);
+}
+
+// One step of vmm_walk_range() at a PDPT (level 3) or page directory (level 2) entry.
+// Returns the table below the entry, or nullptr with `count` set to the pages the entry took care of:
+// handed to leaf_fn whole, a hole, or a huge page that wasn't split.
+template <typename L>
+static uint64_t* vmm_walk_entry(uint64_t* entry, size_t level, uint64_t virt_address, size_t pages, bool create, bool split, bool user,
+                                vmm_table_path& path, size_t& count, bool& ok, L& leaf_fn)
+{
+    size_t level_pages = vmm_level_pages(level);
+    size_t offset = (virt_address / PAGE_SIZE) % level_pages;
+
+    count = level_pages - offset;
+    if (count > pages) count = pages;
+
+    if (offset == 0 && count == level_pages && leaf_fn(entry, level, virt_address, path)) return nullptr;
+
+    if (*entry & VMM_ENTRY_HUGE)
+    {
+        if (!split) return nullptr;
+
+        if (!vmm_split_huge_page(entry, level))
+        {
+            ok = false;
+            return nullptr;
+        }
+    }
+
+    uint64_t* table = vmm_lower_table(entry, create, user);
+    if (table == nullptr && create) ok = false;
+
+    return table;
+}
+
+// Calls leaf_fn(entry, level, virt_address, path) for PDPT/PD entries the range covers whole, it returns false to
+// go down a level instead. The rest goes to fn(table, first, count, virt_address, path), once for every page table,
+// descending from the PML4 once per table instead of once per page. Huge pages in the way are split with `split`.
+// Returns false if a part of the range couldn't be reached.
+template <typename F, typename L>
+static bool vmm_walk_range(uint64_t* pml4, uint64_t virt_address, size_t pages, bool create, bool split, bool user, F&& fn, L&& leaf_fn)
+{
+    constexpr size_t pml4_entry_pages = VMM_PAGES_PER_1G * 512;
+    bool ok = true;
+
+    while (pages > 0)
+    {
+        vmm_address va = vmm_split_va(virt_address);
+        vmm_table_path path = { &pml4[va.pml4e], nullptr, nullptr };
+
+        size_t count = pml4_entry_pages - (virt_address / PAGE_SIZE) % pml4_entry_pages;
+        if (count > pages) count = pages;
+
+        uint64_t* pdpt = vmm_lower_table(path.pml4_entry, create, user);
+        if (pdpt == nullptr && create) ok = false;
+
+        if (pdpt != nullptr)
+        {
+            path.pdpt_entry = &pdpt[va.pdpe];
+            uint64_t* pd = vmm_walk_entry(path.pdpt_entry, 3, virt_address, pages, create, split, user, path, count, ok, leaf_fn);
+
+            if (pd != nullptr)
+            {
+                path.pd_entry = &pd[va.pde];
+                uint64_t* pt = vmm_walk_entry(path.pd_entry, 2, virt_address, pages, create, split, user, path, count, ok, leaf_fn);
+
+                if (pt != nullptr)
+                {
+                    count = 512 - va.pte;
+                    if (count > pages) count = pages;
+
+                    fn(reinterpret_cast<pte*>(pt), static_cast<size_t>(va.pte), count, virt_address, path);
+                }
+            }
+        }
+
+        virt_address += count * PAGE_SIZE;
+        pages -= count;
+    }
+
+    return ok;
+}
+
+// PWT/PCD/PAT bits selecting the cache type in `map_flags`, see VMM_PAT_VALUE. PAT is bit 7 of
+// a PTE and bit 12 of a 2 MiB/1 GiB page.
+static uint64_t vmm_cache_flags(int map_flags, bool huge)
+{
+    switch (map_flags & MAP_CACHE_MASK)
+    {
+        case MAP_CACHE_WT:
+            return VMM_ENTRY_PWT;
+        case MAP_CACHE_UC:
+            return VMM_ENTRY_PCD | VMM_ENTRY_PWT;
+        case MAP_CACHE_WC:
+            if (!vmm_pat) return VMM_ENTRY_PCD | VMM_ENTRY_PWT;
+            return (huge ? VMM_ENTRY_HUGE_PAT : VMM_ENTRY_HUGE) | VMM_ENTRY_PWT;
+        default:
+            return 0;
+    }
+}
+
+// Leaf flags of 2 MiB/1 GiB pages.
+static uint64_t vmm_leaf_flags(int prot_flags, int map_flags)
+{
+    uint64_t flags = vmm_cache_flags(map_flags, true);
+
+    if (map_flags & MAP_PRESENT) flags |= VMM_ENTRY_PRESENT;
+    if (map_flags & MAP_GLOBAL) flags |= VMM_ENTRY_GLOBAL;
+    if (prot_flags & PROT_RW) flags |= VMM_ENTRY_RW;
+    if (!(prot_flags & PROT_SUPERVISOR)) flags |= VMM_ENTRY_USER;
+    if (prot_flags & PROT_NOEXEC) flags |= VMM_ENTRY_NO_EXECUTE;
+
+    return flags;
+}
+
+static void vmm_set_pte(pte& entry, uint64_t phys_address, int prot_flags, int map_flags)
+{
+    entry.present = (map_flags & MAP_PRESENT) != 0;
+    entry.read_write = (prot_flags & PROT_RW) != 0;
+    entry.user_supervisor = (prot_flags & PROT_SUPERVISOR) == 0;
+    entry.no_execute = (prot_flags & PROT_NOEXEC) != 0;
+    entry.global = (map_flags & MAP_GLOBAL) != 0;
+    entry.phys_ptr = phys_address >> 12;
+
+    uint64_t cache = vmm_cache_flags(map_flags, false);
+    entry.page_write_through = (cache & VMM_ENTRY_PWT) != 0;
+    entry.page_cache_disable = (cache & VMM_ENTRY_PCD) != 0;
+    entry.page_attribute_table = (cache & VMM_ENTRY_HUGE) != 0;
+}
+
+static bool vmm_table_is_empty(const uint64_t* table)
+{
+    for (size_t i = 0; 512 > i; i++)
+    {
+        if (table[i] != 0) return false;
+    }
+
+    return true;
+}
+
+// Frees the tables along `path` bottom up for as long as they're empty.
+static void vmm_release_empty_tables(const vmm_table_path& path, uint64_t virt_address)
+{
+    uint64_t* entries[3] = { path.pd_entry, path.pdpt_entry, path.pml4_entry };
+
+    for (size_t level = 0; 3 > level; level++)
+    {
+        // Levels that are gone already (the huge page that was just unmapped).
+        if (entries[level] == nullptr || *entries[level] == 0) continue;
+
+        // PDPTs of the higher half are shared by every address space.
+        if (entries[level] == path.pml4_entry && vmm_split_va(virt_address).pml4e >= 256) return;
+
+        uint64_t table = *entries[level] & VMM_ENTRY_ADDRESS_MASK;
+        if (!vmm_table_is_empty(vmm_make_virtual<uint64_t*>(table))) return;
+
+        *entries[level] = 0;
+        pmm_free_page(table);
+    }
+}
+
+static void vmm_flush_range(uint64_t virt_address, size_t pages)
+{
+    if (pages > VMM_FLUSH_ALL_THRESHOLD)
+    {
+        vmm_flush_tlb_all();
+        return;
+    }
+
+    for (size_t i = 0; pages > i; i++)
+    {
+        flush_tlb(virt_address + i * PAGE_SIZE);
+    }
+
+    // invlpg only reaches the current PCID (and global pages), the kernel half is in every address space.
+    if (vmm_split_va(virt_address).pml4e >= 256) pcid_kernel_mappings_changed();
+}
+
+void vmm_flush_tlb_all()
+{
+    if (pcid_flush_all()) return;
+
+    uint64_t cr4;
+    asm volatile ("mov %%cr4, %0" : "=r"(cr4));
+
+    // Reloading CR3 leaves global entries alone, toggling CR4.PGE doesn't (and flushes every PCID).
+    if (cr4 & (1 << 7))
+    {
+        asm volatile ("mov %0, %%cr4" :: "r"(cr4 & ~(1ULL << 7)) : "memory");
+        asm volatile ("mov %0, %%cr4" :: "r"(cr4) : "memory");
+        return;
+    }
+
+    vmm_write_cr3(vmm_read_cr3());
+    pcid_kernel_mappings_changed();
+}
+
+bool vmm_map_range(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, size_t pages, int prot_flags, int map_flags, int misc_flags)
+{
+    if (virt_address % PAGE_SIZE != 0 || phys_address % PAGE_SIZE != 0)
+    {
         if constexpr (vmm_verbose)
-                kstd::printf("PDPE ptr: %lx\n", p);
+        {
+            kstd::printf("[VMM] vmm_map_range(): %lx -> %lx isn't aligned to the page.\n", virt_address, phys_address);
+        }
+
+        return false;
     }
 
-    pdpe* pdpe = reinterpret_cast<struct pdpe*>((pml4e[va.pml4e].pdpe_ptr << 12) + vmm_hhdm->offset);
-    if (pdpe[va.pdpe].pde_ptr == 0) {
-        uint64_t p = pmm_alloc_page();
+    uint64_t leaf_flags = vmm_leaf_flags(prot_flags, map_flags);
+    bool free_tables = (misc_flags & MISC_BOOT_TABLES) == 0;
+
+    bool ok = vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, true, true, (prot_flags & PROT_SUPERVISOR) == 0,
+                             [&](pte* table, size_t first, size_t count, uint64_t va, vmm_table_path&) {
+        uint64_t pa = phys_address + (va - virt_address);
+
+        for (size_t i = 0; count > i; i++)
+        {
+            vmm_set_pte(table[first + i], pa + i * PAGE_SIZE, prot_flags, map_flags);
+        }
+    }, [&](uint64_t* entry, size_t level, uint64_t va, vmm_table_path&) {
+        uint64_t pa = phys_address + (va - virt_address);
+
+        if (pa % (vmm_level_pages(level) * PAGE_SIZE) != 0) return false;
+        if (level == 3 && !vmm_1g_pages) return false;
+
+        // Whatever was mapped below is replaced as a whole.
+        if ((*entry & VMM_ENTRY_ADDRESS_MASK) != 0 && !(*entry & VMM_ENTRY_HUGE) && free_tables)
+            vmm_free_tables(*entry, level);
+
+        *entry = pa | leaf_flags | VMM_ENTRY_HUGE;
+        return true;
+    });
 
-        kstd::memset(vmm_make_virtual<uint8_t*>(p), 0, 4096);
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
 
-        pdpe[va.pdpe].pde_ptr = p >> 12;
-        pdpe[va.pdpe].present = map_present;
-        pdpe[va.pdpe].read_write = protection_rw;
+    return ok;
+}
 
+bool vmm_map_frames(pml4e* pml4e, uint64_t virt_address, const uint64_t* frames, size_t pages, int prot_flags, int map_flags, int misc_flags)
+{
+    if (virt_address % PAGE_SIZE != 0)
+    {
         if constexpr (vmm_verbose)
-            kstd::printf("PDE ptr: %lx\n", p);
+        {
+            kstd::printf("[VMM] vmm_map_frames(): %lx isn't aligned to the page.\n", virt_address);
+        }
+
+        return false;
     }
 
-    pde* pde =  reinterpret_cast<struct pde*>((pdpe[va.pdpe].pde_ptr << 12) + vmm_hhdm->offset);
-    if (pde[va.pde].pte_ptr == 0) {
-        uint64_t p = pmm_alloc_page();
+    bool ok = vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, true, true, (prot_flags & PROT_SUPERVISOR) == 0,
+                             [&](pte* table, size_t first, size_t count, uint64_t va, vmm_table_path&) {
+        const uint64_t* chunk = frames + (va - virt_address) / PAGE_SIZE;
 
-        kstd::memset(vmm_make_virtual<uint8_t*>(p), 0, 4096);
+        for (size_t i = 0; count > i; i++)
+        {
+            vmm_set_pte(table[first + i], chunk[i], prot_flags, map_flags);
+        }
+    }, [](uint64_t*, size_t, uint64_t, vmm_table_path&) {
+        // Frames aren't contiguous, always 4 KiB pages.
+        return false;
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+
+    return ok;
+}
+
+size_t vmm_unmap_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int misc_flags)
+{
+    bool free_frames = (misc_flags & MISC_FREE_FRAMES) != 0;
+    size_t unmapped = 0;
+
+    // Frames and tables are freed before the flush at the end, keep interrupt handlers from reusing them meanwhile.
+    uint64_t flags = cpu_save_and_disable_interrupts();
+
+    vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, false, true, false,
+                   [&](pte* table, size_t first, size_t count, uint64_t va, vmm_table_path& path) {
+        for (size_t i = 0; count > i; i++)
+        {
+            pte& entry = table[first + i];
+            uint64_t& raw = __builtin_bit_cast(uint64_t*, table)[first + i];
+            if (entry.present) unmapped++;
+
+            if (free_frames && entry.present && (entry.phys_ptr << 12) != vmm_get_zero_page()) pmm_put_page(entry.phys_ptr << 12);
+            if (free_frames && zram_is_swap_entry(raw)) zram_free_entry(raw);
+
+            raw = 0;
+        }
+
+        vmm_release_empty_tables(path, va);
+    }, [&](uint64_t* entry, size_t level, uint64_t va, vmm_table_path& path) {
+        if (*entry == 0) return true;
+        if (!(*entry & VMM_ENTRY_HUGE)) return false;
+
+        if (*entry & VMM_ENTRY_PRESENT) unmapped += vmm_level_pages(level);
+
+        if (free_frames && (*entry & VMM_ENTRY_PRESENT))
+            pmm_free_pages(*entry & VMM_ENTRY_ADDRESS_MASK & ~VMM_ENTRY_HUGE_PAT, buddy_order_for_pages(vmm_level_pages(level)));
+
+        *entry = 0;
+        vmm_release_empty_tables(path, va);
+        return true;
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+
+    cpu_restore_interrupts(flags);
+
+    return unmapped;
+}
+
+void vmm_protect_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int prot_flags, int misc_flags)
+{
+    uint64_t protection = vmm_leaf_flags(prot_flags, MAP_NONE);
+
+    vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, false, true, false,
+                   [&](pte* table, size_t first, size_t count, uint64_t, vmm_table_path&) {
+        for (size_t i = 0; count > i; i++)
+        {
+            pte& entry = table[first + i];
+            if (!entry.present) continue;
+
+            entry.read_write = (prot_flags & PROT_RW) != 0;
+            entry.user_supervisor = (prot_flags & PROT_SUPERVISOR) == 0;
+            entry.no_execute = (prot_flags & PROT_NOEXEC) != 0;
+        }
+    }, [&](uint64_t* entry, size_t, uint64_t, vmm_table_path&) {
+        if (*entry == 0) return true;
+        if (!(*entry & VMM_ENTRY_HUGE)) return false;
+
+        if (*entry & VMM_ENTRY_PRESENT)
+            *entry = (*entry & ~(VMM_ENTRY_RW | VMM_ENTRY_USER | VMM_ENTRY_NO_EXECUTE)) | protection;
+
+        return true;
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+}
+
+void vmm_set_cache_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int map_flags, int misc_flags)
+{
+    uint64_t small_cache = vmm_cache_flags(map_flags, false);
+    uint64_t huge_cache = vmm_cache_flags(map_flags, true);
+
+    asm volatile ("wbinvd" ::: "memory");
+
+    vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, false, true, false,
+                   [&](pte* table, size_t first, size_t count, uint64_t, vmm_table_path&) {
+        for (size_t i = 0; count > i; i++)
+        {
+            pte& entry = table[first + i];
+            if (!entry.present) continue;
+
+            entry.page_write_through = (small_cache & VMM_ENTRY_PWT) != 0;
+            entry.page_cache_disable = (small_cache & VMM_ENTRY_PCD) != 0;
+            entry.page_attribute_table = (small_cache & VMM_ENTRY_HUGE) != 0;
+        }
+    }, [&](uint64_t* entry, size_t, uint64_t, vmm_table_path&) {
+        if (*entry == 0) return true;
+        if (!(*entry & VMM_ENTRY_HUGE)) return false;
+
+        if (*entry & VMM_ENTRY_PRESENT)
+            *entry = (*entry & ~(VMM_ENTRY_PWT | VMM_ENTRY_PCD | VMM_ENTRY_HUGE_PAT)) | huge_cache;
 
-        pde[va.pde].pte_ptr = p >> 12;
-        pde[va.pde].present = map_present;
-        pde[va.pde].read_write = protection_rw;
+        return true;
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+}
+
+bool vmm_share_range(pml4e* source, pml4e* target, uint64_t virt_address, size_t pages, int misc_flags)
+{
+    uint64_t* target_pml4 = vmm_raw_entries(target);
+    uint64_t zero_page = vmm_get_zero_page();
+    bool target_ok = true;
+
+    bool ok = vmm_walk_range(vmm_raw_entries(source), virt_address, pages, false, true, false,
+                             [&](pte* table, size_t first, size_t count, uint64_t va, vmm_table_path& path) {
+        // Out of memory for the target's tables, the rest of the range is left alone.
+        if (!target_ok) return;
 
-if constexpr (vmm_verbose)
-        kstd::printf("PTE ptr: %lx\n", p);
+        auto entries = __builtin_bit_cast(uint64_t*, table);
+        bool user = (*path.pd_entry & VMM_ENTRY_USER) != 0;
+
+        // The target has nothing mapped here yet, so its tables are found once per page table.
+        vmm_address split = vmm_split_va(va);
+        uint64_t* pdpt = vmm_lower_table(&target_pml4[split.pml4e], true, user);
+        uint64_t* pd = pdpt != nullptr ? vmm_lower_table(&pdpt[split.pdpe], true, user) : nullptr;
+        uint64_t* target_table = pd != nullptr ? vmm_lower_table(&pd[split.pde], true, user) : nullptr;
+
+        if (target_table == nullptr)
+        {
+            // Tables allocated on the way down are still empty, the unmap on teardown wouldn't find them.
+            vmm_table_path target_path = { &target_pml4[split.pml4e], pdpt != nullptr ? &pdpt[split.pdpe] : nullptr, nullptr };
+            vmm_release_empty_tables(target_path, va);
+
+            target_ok = false;
+            return;
+        }
+
+        for (size_t i = first; first + count > i; i++)
+        {
+            // Compressed pages gain a reference, each side decompresses a copy of its own.
+            if (zram_is_swap_entry(entries[i]))
+            {
+                zram_dup_entry(entries[i]);
+                target_table[i] = entries[i];
+            }
+
+            if (!(entries[i] & VMM_ENTRY_PRESENT)) continue;
+
+            uint64_t frame = entries[i] & VMM_ENTRY_ADDRESS_MASK;
+            if (frame != zero_page)
+            {
+                entries[i] &= ~VMM_ENTRY_RW;
+                pmm_share_page(frame);
+            }
+
+            target_table[i] = entries[i];
+        }
+    }, [](uint64_t* entry, size_t, uint64_t, vmm_table_path&) {
+        // Holes are skipped whole, huge pages get split so their frames can be shared one by one.
+        return *entry == 0;
+    });
 
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+
+    return ok && target_ok;
+}
+
+uint64_t vmm_virt_to_phys(pml4e* pml4e, uint64_t virt_address)
+{
+    vmm_address va = vmm_split_va(virt_address);
+    uint64_t entry = vmm_raw_entries(pml4e)[va.pml4e];
+    uint64_t indices[3] = { va.pdpe, va.pde, va.pte };
+
+    for (size_t level = 3; level > 0; level--)
+    {
+        if (!(entry & VMM_ENTRY_PRESENT)) return 0;
+
+        entry = vmm_make_virtual<uint64_t*>(entry & VMM_ENTRY_ADDRESS_MASK)[indices[3 - level]];
+        if (!(entry & VMM_ENTRY_PRESENT)) return 0;
+
+        if (level > 1 && (entry & VMM_ENTRY_HUGE))
+        {
+            uint64_t size = vmm_level_pages(level) * PAGE_SIZE;
+            return (entry & VMM_ENTRY_ADDRESS_MASK & ~(size - 1)) + (virt_address & (size - 1));
+        }
     }
 
-    pte* pte = reinterpret_cast<struct pte*>((pde[va.pde].pte_ptr << 12) + vmm_hhdm->offset);
+    return (entry & VMM_ENTRY_ADDRESS_MASK) + (virt_address & (PAGE_SIZE - 1));
+}
+
+// PTE of the 4 KiB page at `virt_address`, nullptr if there's no page table for it or it's in a huge page.
+static uint64_t* vmm_find_pte(pml4e* pml4e, uint64_t virt_address)
+{
+    vmm_address va = vmm_split_va(virt_address);
+
+    uint64_t* pdpt = vmm_lower_table(&vmm_raw_entries(pml4e)[va.pml4e], false, false);
+    if (pdpt == nullptr) return nullptr;
+
+    uint64_t* pd = vmm_lower_table(&pdpt[va.pdpe], false, false);
+    if (pd == nullptr) return nullptr;
+
+    uint64_t* pt = vmm_lower_table(&pd[va.pde], false, false);
+    if (pt == nullptr) return nullptr;
+
+    return &pt[va.pte];
+}
+
+uint64_t vmm_get_pte(pml4e* pml4e, uint64_t virt_address)
+{
+    uint64_t* entry = vmm_find_pte(pml4e, virt_address);
+    return entry != nullptr ? *entry : 0;
+}
 
-    // Apply flags to everything that we know
-    pml4e[va.pml4e].present = map_present;
-    pml4e[va.pml4e].read_write = protection_rw; // Set read/write flag in PML4E
+uint64_t vmm_exchange_pte(pml4e* pml4e, uint64_t virt_address, uint64_t entry, int misc_flags)
+{
+    uint64_t* slot = vmm_find_pte(pml4e, virt_address);
+    if (slot == nullptr) return 0;
 
-    pdpe[va.pdpe].present = map_present;
-    pdpe[va.pdpe].read_write = protection_rw; // Set read/write flag in PDP
+    uint64_t old = __atomic_exchange_n(slot, entry, __ATOMIC_ACQ_REL);
+    if ((misc_flags & MISC_INVLPG) && (old & VMM_ENTRY_PRESENT)) vmm_flush_range(virt_address, 1);
 
-    pde[va.pde].present = map_present;
-    pde[va.pde].read_write = protection_rw; // Set read/write flag in PDE
+    return old;
+}
 
-    pte[va.pte].present = map_present;
-    pte[va.pte].read_write = protection_rw;
-    pte[va.pte].user_supervisor = !protection_supervisor; // Set user/supervisor flag in PTE
-    pte[va.pte].no_execute = protection_noexec; // Set no execute flag in PTE
-    pte[va.pte].global = map_global;
-    pte[va.pte].phys_ptr = phys_address >> 12;
+size_t vmm_collect_cold_pages(pml4e* pml4e, uint64_t virt_address, size_t pages, uint64_t* cold, size_t max, uint64_t* end, int misc_flags)
+{
+    uint64_t zero_page = vmm_get_zero_page();
+    size_t found = 0;
+
+    *end = virt_address + pages * PAGE_SIZE;
+
+    vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, false, false, false,
+                   [&](pte* table, size_t first, size_t count, uint64_t va, vmm_table_path&) {
+        auto entries = __builtin_bit_cast(uint64_t*, table);
+
+        for (size_t i = 0; count > i; i++)
+        {
+            // The walk can't be cut short, the rest of it only finds where it stopped.
+            if (found == max)
+            {
+                if (*end > va + i * PAGE_SIZE) *end = va + i * PAGE_SIZE;
+                return;
+            }
+
+            uint64_t& entry = entries[first + i];
+            if (!(entry & VMM_ENTRY_PRESENT) || (entry & VMM_ENTRY_ADDRESS_MASK) == zero_page) continue;
+
+            if (entry & VMM_ENTRY_ACCESSED) __atomic_fetch_and(&entry, ~VMM_ENTRY_ACCESSED, __ATOMIC_RELAXED);
+            else cold[found++] = va + i * PAGE_SIZE;
+        }
+    }, [](uint64_t* entry, size_t, uint64_t, vmm_table_path&) {
+        return *entry == 0 || (*entry & VMM_ENTRY_HUGE);
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, (*end - virt_address) / PAGE_SIZE);
+
+    return found;
+}
+
+uint64_t vmm_get_zero_page()
+{
+    static uint64_t zero_page = pmm_alloc_zeroed_page();
+    return zero_page;
+}
 
-    if (misc_invlpg) {
-        //kstd::printf("Invalidated.\n");
-        flush_tlb(virt_address);
+// Collapses the table below `entry` (level 2: a page table, level 3: a page directory of 2 MiB pages) into one huge
+// page if it maps a single aligned, physically contiguous block with the same flags throughout.
+static bool vmm_collapse_table(uint64_t* entry, size_t level, bool global, bool free_table)
+{
+    if ((*entry & VMM_ENTRY_ADDRESS_MASK) == 0 || (*entry & VMM_ENTRY_HUGE)) return false;
+    if (level == 3 && !vmm_1g_pages) return false;
+
+    uint64_t table = *entry & VMM_ENTRY_ADDRESS_MASK;
+    auto entries = vmm_make_virtual<uint64_t*>(table);
+
+    uint64_t step = level == 3 ? VMM_PAGES_PER_2M * PAGE_SIZE : PAGE_SIZE;
+    uint64_t address_mask = level == 3 ? VMM_ENTRY_ADDRESS_MASK & ~VMM_ENTRY_HUGE_PAT : VMM_ENTRY_ADDRESS_MASK;
+
+    // Pages that only differ in these are still mapped the same.
+    uint64_t ignored = VMM_ENTRY_ACCESSED | VMM_ENTRY_DIRTY | VMM_ENTRY_GLOBAL;
+
+    uint64_t base = entries[0] & address_mask;
+    uint64_t flags = entries[0] & ~address_mask & ~ignored;
+
+    if (!(flags & VMM_ENTRY_PRESENT) || base % (step * 512) != 0) return false;
+    if (level == 3 && !(flags & VMM_ENTRY_HUGE)) return false;
+
+    for (size_t i = 1; 512 > i; i++)
+    {
+        if ((entries[i] & ~ignored) != ((base + i * step) | flags)) return false;
+    }
+
+    // PAT moves from bit 7 of the PTEs to bit 12 of the huge page.
+    if (level == 2)
+    {
+        if (flags & VMM_ENTRY_HUGE) flags |= VMM_ENTRY_HUGE_PAT;
+        flags |= VMM_ENTRY_HUGE;
     }
 
+    if (global || (entries[0] & VMM_ENTRY_GLOBAL)) flags |= VMM_ENTRY_GLOBAL;
+
+    *entry = base | flags;
+    if (free_table) pmm_free_page(table);
+
     return true;
 }
 
+// Promotes what's below a PDPT/PD entry covered whole by vmm_promote_range().
+static void vmm_promote_entry(uint64_t* entry, size_t level, bool global, bool free_tables)
+{
+    if (*entry == 0) return;
+
+    // 2 MiB pages first, a page directory can only collapse once it's made of them.
+    if (level == 3 && !(*entry & VMM_ENTRY_HUGE))
+    {
+        auto pd = vmm_make_virtual<uint64_t*>(*entry & VMM_ENTRY_ADDRESS_MASK);
+        for (size_t i = 0; 512 > i; i++)
+        {
+            vmm_promote_entry(&pd[i], 2, global, free_tables);
+        }
+    }
+
+    if (vmm_collapse_table(entry, level, global, free_tables)) return;
+
+    if (*entry & VMM_ENTRY_HUGE)
+    {
+        if (global) *entry |= VMM_ENTRY_GLOBAL;
+        return;
+    }
+
+    if (level == 2 && global)
+    {
+        auto pt = vmm_make_virtual<uint64_t*>(*entry & VMM_ENTRY_ADDRESS_MASK);
+        for (size_t i = 0; 512 > i; i++)
+        {
+            if (pt[i] & VMM_ENTRY_PRESENT) pt[i] |= VMM_ENTRY_GLOBAL;
+        }
+    }
+}
+
+void vmm_promote_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int map_flags, int misc_flags)
+{
+    bool global = (map_flags & MAP_GLOBAL) != 0;
+    bool free_tables = (misc_flags & MISC_BOOT_TABLES) == 0;
+
+    // Huge pages only partly in the range are left alone, splitting them would defeat the point.
+    vmm_walk_range(vmm_raw_entries(pml4e), virt_address, pages, false, false, false,
+                   [&](pte* table, size_t first, size_t count, uint64_t, vmm_table_path&) {
+        if (!global) return;
+
+        for (size_t i = 0; count > i; i++)
+        {
+            if (table[first + i].present) table[first + i].global = 1;
+        }
+    }, [&](uint64_t* entry, size_t level, uint64_t, vmm_table_path&) {
+        vmm_promote_entry(entry, level, global, free_tables);
+        return true;
+    });
+
+    if (misc_flags & MISC_INVLPG) vmm_flush_range(virt_address, pages);
+}
+
+// Page aligned bounds of a kernel section, from the linker script.
+static void vmm_promote_kernel_section(pml4e* pml4e, const char* start, const char* end)
+{
+    uint64_t first = reinterpret_cast<uint64_t>(start) & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+    uint64_t last = (reinterpret_cast<uint64_t>(end) + PAGE_SIZE - 1) & ~static_cast<uint64_t>(PAGE_SIZE - 1);
+
+    vmm_promote_range(pml4e, first, (last - first) / PAGE_SIZE, MAP_GLOBAL, MISC_BOOT_TABLES | MISC_INVLPG);
+}
+
+void vmm_remap_kernel()
+{
+    auto pml4e = vmm_make_virtual<struct pml4e*>(vmm_get_pml4());
+
+    // Text and rodata are promoted apart, a huge page spanning both would have to be executable and lose W^X.
+    // The tables that get replaced are Limine's, they go back to the PMM with the rest of bootloader memory.
+    vmm_promote_kernel_section(pml4e, __kernel_text_start, __kernel_text_end);
+    vmm_promote_kernel_section(pml4e, __kernel_rodata_start, __kernel_rodata_end);
+}
+
+bool vmm_has_1g_pages()
+{
+    return vmm_1g_pages;
+}
+
 // On dear god, don't use this function.
 template <typename T>
 void vmm_print_flags(T v) {
@@ -191,6 +908,17 @@ void vmm_test(void* addr)
 
     kstd::printf("[VMM] PDPe address: %p\n", reinterpret_cast<void*>(pdpe));
 
+    if (pdpe[va.pdpe].page_size)
+    {
+        uint64_t frame = pdpe[va.pdpe].pde_ptr & ~1ULL; // Bit 0 is PAT.
+        uint64_t offset = vmm_sva_to_va(va) & (VMM_PAGES_PER_1G * PAGE_SIZE - 1);
+        kstd::printf("[VMM] 1 GiB page, physical address: %lx\n", (frame << 12) + offset);
+
+        kstd::printf("Flags for PDPe: \n");
+        vmm_print_flags(pdpe[va.pdpe]);
+        return;
+    }
+
     pde* pde = reinterpret_cast<struct pde*>(pdpe[va.pdpe].pde_ptr << 12);
     pde = vmm_make_virtual_singular(pde);
 
@@ -210,6 +938,17 @@ void vmm_test(void* addr)
 
     kstd::printf("[VMM] PDe address: %p\n", reinterpret_cast<void*>(pde));
 
+    if (pde[va.pde].page_size)
+    {
+        uint64_t frame = pde[va.pde].pte_ptr & ~1ULL; // Bit 0 is PAT.
+        uint64_t offset = vmm_sva_to_va(va) & (VMM_PAGES_PER_2M * PAGE_SIZE - 1);
+        kstd::printf("[VMM] 2 MiB page, physical address: %lx\n", (frame << 12) + offset);
+
+        kstd::printf("Flags for PDe: \n");
+        vmm_print_flags(pde[va.pde]);
+        return;
+    }
+
     pte* pte = reinterpret_cast<struct pte*>(pde[va.pde].pte_ptr << 12);
     pte = vmm_make_virtual_singular(pte);
 
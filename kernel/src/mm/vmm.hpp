@@ -56,7 +56,7 @@ struct pdpe
     uint64_t page_cache_disable : 1;
     uint64_t accessed : 1;
     uint64_t ignored : 1;
-    uint64_t zero : 1;
+    uint64_t page_size : 1; // 1 GiB page, pde_ptr holds the frame (bit 0 of it is PAT).
     uint64_t ignored1 : 1;
     uint64_t available_to_software1 : 3;
     uint64_t pde_ptr : 40;
@@ -73,7 +73,7 @@ struct pde
     uint64_t page_cache_disable : 1;
     uint64_t accessed : 1;
     uint64_t ignored : 1;
-    uint64_t zero : 1;
+    uint64_t page_size : 1; // 2 MiB page, pte_ptr holds the frame (bit 0 of it is PAT).
     uint64_t ignored1 : 1;
     uint64_t available_to_software1 : 3;
     uint64_t pte_ptr : 40;
@@ -112,15 +112,57 @@ typedef enum : int {
 typedef enum : int {
     MAP_NONE = 0,
     MAP_PRESENT = 1 << 0,
-    MAP_GLOBAL = 1 << 1
+    MAP_GLOBAL = 1 << 1,
+    MAP_LARGE = 1 << 2, // vmm_map(): map one 2 MiB page.
+    MAP_HUGE = 1 << 3,  // vmm_map(): map one 1 GiB page.
+
+    // Cache type, write-back unless one of these is given.
+    MAP_CACHE_WB = 0,
+    MAP_CACHE_WT = 1 << 4,
+    MAP_CACHE_UC = 2 << 4,
+    MAP_CACHE_WC = 3 << 4,  // Framebuffers and prefetchable BARs. Falls back to UC without PAT.
+    MAP_CACHE_MASK = 3 << 4
 } MAP_FLAGS;
 
 typedef enum : int {
     MISC_NONE = 0,
     MISC_INVLPG = 1 << 0,
-    MISC_FORCE = 1 << 1
+    MISC_FORCE = 1 << 1,
+    MISC_FREE_FRAMES = 1 << 2, // vmm_unmap_range(): hand the unmapped frames back to the PMM.
+    MISC_BOOT_TABLES = 1 << 3  // Page tables replaced by huge pages are Limine's, leave them to pmm_reclaim_boot_memory().
 } MISC_FLAGS;
 
+/*
+ * raw defines
+ */
+
+// Raw view of paging structure entries, the bits are the same on every level.
+#define VMM_ENTRY_PRESENT (1ULL << 0)
+#define VMM_ENTRY_RW (1ULL << 1)
+#define VMM_ENTRY_USER (1ULL << 2)
+#define VMM_ENTRY_PWT (1ULL << 3)
+#define VMM_ENTRY_PCD (1ULL << 4)
+#define VMM_ENTRY_ACCESSED (1ULL << 5)
+#define VMM_ENTRY_DIRTY (1ULL << 6)
+#define VMM_ENTRY_HUGE (1ULL << 7)          // PS on PDPEs/PDEs, PAT on PTEs.
+#define VMM_ENTRY_GLOBAL (1ULL << 8)
+#define VMM_ENTRY_HUGE_PAT (1ULL << 12)     // PAT of 2 MiB/1 GiB pages.
+#define VMM_ENTRY_SWAP (1ULL << 62)         // Software bit, non-present PTE holding a compressed page (see mm/zram.hpp).
+#define VMM_ENTRY_NO_EXECUTE (1ULL << 63)
+#define VMM_ENTRY_ADDRESS_MASK 0x000ffffffffff000ULL
+
+// IA32_PAT, laid out the way Limine leaves it so its mappings keep their cache types:
+// 0 WB, 1 WT, 2 UC-, 3 UC, 4 WP, 5 WC, 6 UC-, 7 UC. An entry picks one with PAT * 4 + PCD * 2 + PWT.
+#define MSR_IA32_PAT 0x277
+#define VMM_PAT_VALUE 0x0007010500070406ULL
+
+// 4 KiB pages covered by a 2 MiB and a 1 GiB page.
+#define VMM_PAGES_PER_2M 512ULL
+#define VMM_PAGES_PER_1G (512ULL * 512ULL)
+
+// Range operations touching more pages than this reload CR3 instead of issuing invlpg for every page.
+#define VMM_FLUSH_ALL_THRESHOLD 32
+
 /*
  * constexpr things
  */
@@ -142,6 +184,11 @@ inline uint64_t vmm_get_pml4()
     return vmm_read_cr3() & (0xfffffffffffff000);
 }
 
+inline void vmm_write_cr3(uint64_t cr3)
+{
+    asm volatile ("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
 template <typename T>
 constexpr vmm_address vmm_split_va(T va) {
     // Assuming vaddr is a virtual memory address represented as an integer type
@@ -194,12 +241,73 @@ T vmm_make_virtual_singular(T v)
 }
 
 // paging types: pml5e and pml4e. (pml5e unsupported for now)
+// MAP_LARGE/MAP_HUGE map a single 2 MiB/1 GiB page, both addresses have to be aligned to it.
 bool vmm_map(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, int prot_flags, int map_flags, int misc_flags);
 
 static inline  void flush_tlb(unsigned long addr) {
     asm volatile("invlpg (%0)" ::"r" (addr) : "memory");
 }
 
+// Range versions of vmm_map(). Every page table on the way is visited once per range and the TLB is
+// flushed once at the end (with MISC_INVLPG), either page by page or as a whole above VMM_FLUSH_ALL_THRESHOLD.
+// Huge pages only partly covered by a range are split into smaller ones first.
+
+// Maps `pages` pages starting at `virt_address` to the physically contiguous range at `phys_address`.
+// Uses 2 MiB/1 GiB pages wherever both addresses are aligned to them and the range covers them whole.
+bool vmm_map_range(pml4e* pml4e, uint64_t virt_address, uint64_t phys_address, size_t pages, int prot_flags, int map_flags, int misc_flags);
+
+// Maps `pages` pages starting at `virt_address` to the frames in `frames`, one frame per page.
+bool vmm_map_frames(pml4e* pml4e, uint64_t virt_address, const uint64_t* frames, size_t pages, int prot_flags, int map_flags, int misc_flags);
+
+// Unmaps the range and frees the page tables that end up empty. PDPTs of the higher half are kept,
+// every address space shares them. MISC_FREE_FRAMES frees the mapped frames as well.
+// Returns how many of the pages were mapped.
+size_t vmm_unmap_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int misc_flags);
+
+// Changes the protection of the pages that are mapped in the range, holes are skipped.
+void vmm_protect_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int prot_flags, int misc_flags);
+
+// Changes the cache type (MAP_CACHE_*) of the pages that are mapped in the range, holes are skipped.
+// Writes back the caches first, so nothing cached under the old type is left behind.
+void vmm_set_cache_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int map_flags, int misc_flags);
+
+// Maps the pages present in `source` at the same addresses in `target`, where nothing may be mapped yet. Both sides
+// end up read-only and every frame gains a share (see pmm_share_page()), writes have to copy them first.
+// MISC_INVLPG flushes the source's write access. False if the target's tables couldn't be allocated, whatever
+// got shared until then stays mapped in the target.
+bool vmm_share_range(pml4e* source, pml4e* target, uint64_t virt_address, size_t pages, int misc_flags);
+
+// Physical address `virt_address` is mapped to, 0 if it isn't mapped.
+uint64_t vmm_virt_to_phys(pml4e* pml4e, uint64_t virt_address);
+
+// Raw PTE of the 4 KiB page at `virt_address`, present or not. 0 if there's no page table for it or it's in a huge page.
+uint64_t vmm_get_pte(pml4e* pml4e, uint64_t virt_address);
+
+// Atomically replaces the raw PTE of a 4 KiB page and returns the old one, nothing is written if vmm_get_pte()
+// would return 0. MISC_INVLPG flushes the page if the old entry was present.
+uint64_t vmm_exchange_pte(pml4e* pml4e, uint64_t virt_address, uint64_t entry, int misc_flags);
+
+// Second chance scan for reclaim: clears the accessed bit of every present 4 KiB page in the range and collects
+// up to `max` pages that weren't accessed since the last scan (the zero page isn't one), holes and huge pages are
+// skipped whole. Returns how many were collected, `end` is set to where the scan stopped.
+// MISC_INVLPG flushes the scanned range, so the accessed bits get set again.
+size_t vmm_collect_cold_pages(pml4e* pml4e, uint64_t virt_address, size_t pages, uint64_t* cold, size_t max, uint64_t* end, int misc_flags);
+
+// Read-only stand-in for anonymous pages that were read but never written. vmm_unmap_range() never frees it.
+uint64_t vmm_get_zero_page();
+
+// Flushes the whole TLB, global entries included.
+void vmm_flush_tlb_all();
+
+// Collapses the mappings in the range into 2 MiB/1 GiB pages wherever a whole aligned block maps contiguous frames
+// with the same flags, the rest stays as it is. MAP_GLOBAL makes every page in the range global.
+void vmm_promote_range(pml4e* pml4e, uint64_t virt_address, size_t pages, int map_flags, int misc_flags);
+
+// Promotes the kernel's text and rodata to global huge pages, needs the PMM for splitting.
+void vmm_remap_kernel();
+
+bool vmm_has_1g_pages();
+
 void vmm_test(void* addr);
 
 constexpr uint64_t vmm_create_virtual_address(bool is_user, uint64_t pml4e_index, uint64_t pdpe_index, uint64_t pde_index, uint64_t pte_index, uint64_t offset)
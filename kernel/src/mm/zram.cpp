@@ -0,0 +1,234 @@
+#include <kstd/kstdio.hpp>
+#include <kstd/kstring.hpp>
+#include <kstd/kmutex.hpp>
+#include <mm/address_space.hpp>
+#include <mm/shrinker.hpp>
+#include <mm/slab.hpp>
+#include <mm/lz4.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+#include "zram.hpp"
+
+// The pool: one slab cache per ZRAM_CLASS_SIZE step, an object goes to the smallest class that holds it.
+// Slabs are contiguous buddy blocks, so no object straddles frames that aren't next to each other.
+static SlabCache zram_classes[ZRAM_CLASS_COUNT];
+static bool zram_ready = false;
+
+// Guards the reference counts and the statistics. Swap-outs hold it throughout, they share the buffers below.
+static kstd::mutex zram_lock;
+static lz4_state zram_lz4_state;
+static uint8_t zram_buffer[ZRAM_MAX_STORED - sizeof(zram_object)];
+static zram_stats zram_statistics = {};
+
+static inline zram_object* zram_entry_object(uint64_t entry)
+{
+    return vmm_make_virtual<zram_object*>(entry & ~VMM_ENTRY_SWAP);
+}
+
+static size_t zram_pool_pages()
+{
+    size_t pages = 0;
+    for (const SlabCache& cache : zram_classes) pages += cache.get_slab_count() << SLAB_ORDER;
+
+    return pages;
+}
+
+// Compressing costs more than dropping a cache, a single page is claimed so the other shrinkers go first.
+static size_t zram_shrinker_count()
+{
+    return 1;
+}
+
+// Counts what the pool didn't take back, the frames it grew by are part of the price.
+static size_t zram_shrinker_scan(size_t pages)
+{
+    size_t pool = zram_pool_pages();
+    size_t swapped = address_space_reclaim(pages);
+    size_t grown = zram_pool_pages() - pool;
+
+    return swapped > grown ? swapped - grown : 0;
+}
+
+static shrinker zram_shrinker = {
+        .name = "zram",
+        .count = zram_shrinker_count,
+        .scan = zram_shrinker_scan,
+        .next = nullptr,
+        .exhausted = false
+};
+
+void zram_init()
+{
+    for (size_t i = 0; ZRAM_CLASS_COUNT > i; i++)
+    {
+        if (!zram_classes[i].init("zram", (i + 1) * ZRAM_CLASS_SIZE, ZRAM_CLASS_SIZE, nullptr))
+        {
+            kstd::printf("[ZRAM] Size class of %zu bytes doesn't fit a slab.\n", (i + 1) * ZRAM_CLASS_SIZE);
+            return;
+        }
+    }
+
+    zram_ready = true;
+    shrinker_register(&zram_shrinker);
+}
+
+bool zram_swap_out(pml4e* pml4e, uint64_t virt_address, int misc_flags)
+{
+    uint64_t entry = vmm_get_pte(pml4e, virt_address);
+    uint64_t frame = entry & VMM_ENTRY_ADDRESS_MASK;
+
+    // A shared frame stays around for its other owners, compressing it frees nothing.
+    if (!zram_ready || !(entry & VMM_ENTRY_PRESENT) || frame == vmm_get_zero_page() || pmm_page_is_shared(frame)) return false;
+
+    zram_lock.lock();
+
+    // Unmapped before it's read, so no write lands between compressing it and putting the swap entry in.
+    entry = vmm_exchange_pte(pml4e, virt_address, 0, misc_flags);
+
+    size_t length = lz4_compress(&zram_lz4_state, vmm_make_virtual<void*>(frame), PAGE_SIZE, zram_buffer, sizeof(zram_buffer));
+    zram_object* object = nullptr;
+
+    if (length == 0)
+    {
+        zram_statistics.incompressible++;
+    }
+    else
+    {
+        size_t size_class = (sizeof(zram_object) + length + ZRAM_CLASS_SIZE - 1) / ZRAM_CLASS_SIZE - 1;
+        object = static_cast<zram_object*>(zram_classes[size_class].alloc());
+    }
+
+    if (object == nullptr)
+    {
+        zram_lock.unlock();
+        vmm_exchange_pte(pml4e, virt_address, entry, MISC_NONE);
+        return false;
+    }
+
+    object->refs = 1;
+    object->length = static_cast<uint32_t>(length);
+    kstd::memcpy(object + 1, zram_buffer, length);
+
+    zram_statistics.stored_pages++;
+    zram_statistics.compressed_bytes += length;
+    zram_statistics.swap_outs++;
+
+    zram_lock.unlock();
+
+    vmm_exchange_pte(pml4e, virt_address, (reinterpret_cast<uint64_t>(object) - vmm_hhdm->offset) | VMM_ENTRY_SWAP, MISC_NONE);
+    pmm_put_page(frame);
+
+    return true;
+}
+
+bool zram_swap_in(pml4e* pml4e, uint64_t virt_address, int prot_flags, int misc_flags)
+{
+    uint64_t start = __builtin_ia32_rdtsc();
+
+    uint64_t entry = vmm_get_pte(pml4e, virt_address);
+    if (!zram_is_swap_entry(entry)) return false;
+
+    uint64_t frame = pmm_alloc_pages(0);
+    if (frame == 0)
+    {
+        kstd::printf("[ZRAM] Out of memory bringing back the page at %lx.\n", virt_address);
+        return false;
+    }
+
+    // The entry holds a reference, the object stays while the caller keeps the page tables.
+    zram_object* object = zram_entry_object(entry);
+
+    if (!lz4_decompress(object + 1, object->length, vmm_make_virtual<void*>(frame), PAGE_SIZE))
+    {
+        kstd::printf("[ZRAM] Compressed page at %lx is corrupted.\n", virt_address);
+        pmm_free_page(frame);
+        return false;
+    }
+
+    vmm_exchange_pte(pml4e, virt_address, 0, MISC_NONE);
+
+    if (!vmm_map_range(pml4e, virt_address, frame, 1, prot_flags, MAP_PRESENT, misc_flags))
+    {
+        vmm_exchange_pte(pml4e, virt_address, entry, MISC_NONE);
+        pmm_free_page(frame);
+        return false;
+    }
+
+    zram_free_entry(entry);
+
+    uint64_t cycles = __builtin_ia32_rdtsc() - start;
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    zram_lock.lock();
+
+    zram_statistics.swap_ins++;
+    zram_statistics.fault_cycles += cycles;
+    if (cycles > zram_statistics.max_fault_cycles) zram_statistics.max_fault_cycles = cycles;
+
+    zram_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    return true;
+}
+
+void zram_dup_entry(uint64_t entry)
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    zram_lock.lock();
+
+    zram_entry_object(entry)->refs++;
+
+    zram_lock.unlock();
+    cpu_restore_interrupts(flags);
+}
+
+void zram_free_entry(uint64_t entry)
+{
+    zram_object* object = zram_entry_object(entry);
+
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    zram_lock.lock();
+
+    bool last = --object->refs == 0;
+    if (last)
+    {
+        zram_statistics.stored_pages--;
+        zram_statistics.compressed_bytes -= object->length;
+    }
+
+    zram_lock.unlock();
+
+    if (last) slab_free(object);
+
+    cpu_restore_interrupts(flags);
+}
+
+zram_stats zram_get_stats()
+{
+    uint64_t flags = cpu_save_and_disable_interrupts();
+    zram_lock.lock();
+
+    zram_stats stats = zram_statistics;
+
+    zram_lock.unlock();
+    cpu_restore_interrupts(flags);
+
+    stats.pool_pages = zram_pool_pages();
+
+    return stats;
+}
+
+void zram_print_stats()
+{
+    zram_stats stats = zram_get_stats();
+
+    // Ratios in hundredths, printf has no use for doubles here.
+    uint64_t stored_bytes = stats.stored_pages * PAGE_SIZE;
+    uint64_t ratio = stats.compressed_bytes != 0 ? stored_bytes * 100 / stats.compressed_bytes : 0;
+    uint64_t effective = stats.pool_pages != 0 ? stats.stored_pages * 100 / stats.pool_pages : 0;
+    uint64_t average = stats.swap_ins != 0 ? stats.fault_cycles / stats.swap_ins : 0;
+
+    kstd::printf("zram: %lu pages stored in %lu compressed bytes (%lu.%02lux), pool of %lu pages (%lu.%02lux)\n",
+            stats.stored_pages, stats.compressed_bytes, ratio / 100, ratio % 100, stats.pool_pages, effective / 100, effective % 100);
+    kstd::printf("    %lu swapped out, %lu swapped in, %lu incompressible\n", stats.swap_outs, stats.swap_ins, stats.incompressible);
+    kstd::printf("    Fault latency: %lu cycles on average, %lu at most\n", average, stats.max_fault_cycles);
+}
@@ -0,0 +1,73 @@
+#ifndef KITTY_OS_CPP_ZRAM_HPP
+#define KITTY_OS_CPP_ZRAM_HPP
+
+#include <stdint.h>
+#include <stddef.h>
+#include <mm/vmm.hpp>
+
+/*
+ * Raw defines
+ */
+#define ZRAM_CLASS_SIZE 64                  // Granularity of the pool's size classes, and the alignment of every object.
+#define ZRAM_MAX_STORED 3072                // Pages that don't compress below this (header included) stay in memory.
+#define ZRAM_CLASS_COUNT (ZRAM_MAX_STORED / ZRAM_CLASS_SIZE)
+#define ZRAM_SCAN_BATCH 32                  // Cold pages collected per walk of the page tables.
+
+/*
+ * Structs
+ */
+
+// Header of a compressed page in the pool, the LZ4 block follows it. A swap entry is the physical
+// address of one of these with VMM_ENTRY_SWAP set.
+struct zram_object
+{
+    uint32_t refs;      // Swap entries pointing here, clones of an address space share them.
+    uint32_t length;    // Of the compressed data.
+};
+
+struct zram_stats
+{
+    uint64_t stored_pages;
+    uint64_t compressed_bytes;
+    uint64_t pool_pages;            // Frames the pool's slabs take, its real cost.
+    uint64_t swap_outs;
+    uint64_t swap_ins;
+    uint64_t incompressible;        // Cold pages left in memory because they didn't compress well enough.
+    uint64_t fault_cycles;          // Spent in zram_swap_in(), in TSC cycles.
+    uint64_t max_fault_cycles;
+};
+
+/*
+ * inline functions
+ */
+inline bool zram_is_swap_entry(uint64_t entry)
+{
+    return (entry & (VMM_ENTRY_PRESENT | VMM_ENTRY_SWAP)) == VMM_ENTRY_SWAP;
+}
+
+/*
+ * Global function definitions
+ */
+
+// Compressed swap kept in memory: the clock scan (see address_space_reclaim()) compresses anonymous pages
+// that went cold into a pool of size classes and leaves a swap entry in their PTE, the #PF handler brings
+// them back. Registers a shrinker, so it only runs under memory pressure. Needs the slab allocator.
+void zram_init();
+
+// Compresses the page at `virt_address` and replaces its PTE with a swap entry. False if it isn't worth it
+// or possible: not present, the zero page, a frame shared with a clone, incompressible or no pool memory.
+// The caller keeps the page tables from changing, with interrupts disabled.
+bool zram_swap_out(pml4e* pml4e, uint64_t virt_address, int misc_flags);
+
+// Decompresses the page behind the swap entry at `virt_address` into a new frame and maps it with
+// `prot_flags`. False if there's no memory for it or the entry is gone.
+bool zram_swap_in(pml4e* pml4e, uint64_t virt_address, int prot_flags, int misc_flags);
+
+// Reference counting for swap entries copied or dropped with the page tables.
+void zram_dup_entry(uint64_t entry);
+void zram_free_entry(uint64_t entry);
+
+zram_stats zram_get_stats();
+void zram_print_stats();
+
+#endif //KITTY_OS_CPP_ZRAM_HPP
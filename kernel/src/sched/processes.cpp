@@ -1,16 +1,30 @@
 #include <kstd/kmutex.hpp>
 #include <mm/vmm.hpp>
+#include <mm/pcid.hpp>
 #include <sched/processes.hpp>
+#include <kernel/syscalls/syscalls.hpp>
+#include <arch/x64/cpu/percpu.hpp>
+
+constexpr size_t proc_stack_size = 4 * 4096;
 
 uint64_t last_pid = 0;
 process_t* proc_head = nullptr;
 process_t* current_process = nullptr;
 
+// Where the round-robin over either kind of process left off.
+static process_t* proc_last_normal = nullptr;
+static process_t* proc_last_idle = nullptr;
+static uint64_t proc_ticks = 0;
+
 kstd::mutex proc_mtx;
 
 void sched_init()
 {
     proc_mtx.unlock();
+
+    // Whatever called us (the shell, once kernel_main carries on) is a process too, its registers are saved on the first switch.
+    current_process = proc_create_raw_process("kernel", PROC_PRIORITY_NORMAL);
+    proc_last_normal = current_process;
 }
 
 kstd::mutex add_task_mtx;
@@ -21,8 +35,11 @@ process_t* proc_create_raw_process(const char* name, uint64_t prio)
 
     auto proc = new process_t(proc_alloc_id(), name, {}, false, prio);
 
+    // The scheduler unlinks exited processes from a tick, the two stores can't be split by one.
+    uint64_t flags = cpu_save_and_disable_interrupts();
     proc->next = proc_head;
     proc_head = proc;
+    cpu_restore_interrupts(flags);
 
     add_task_mtx.unlock();
 
@@ -35,10 +52,14 @@ void proc_add_task(const process_t& proc)
 
     // Dynamically allocate a new process_t instance
     process_t* new_proc = new process_t(proc.process_id, proc.process_name, proc.registers, proc.is_being_processed, proc.priority);
+    new_proc->space = proc.space;
+    new_proc->stack = proc.stack;
 
-    // Add the new process to the beginning of the list
+    // Add the new process to the beginning of the list, see proc_create_raw_process() about the interrupts.
+    uint64_t flags = cpu_save_and_disable_interrupts();
     new_proc->next = proc_head;
     proc_head = new_proc;
+    cpu_restore_interrupts(flags);
 
     add_task_mtx.unlock();
 }
@@ -52,6 +73,14 @@ bool proc_remove_task(uint64_t process_id)
 
     while (current != nullptr)
     {
+        // Its address space may be the one that's loaded, the scheduler frees it after switching away.
+        if (current->process_id == process_id && current == current_process)
+        {
+            current->exited = true;
+            proc_mtx.unlock();
+            return true;
+        }
+
         if (current->process_id == process_id)
         {
             if (previous != nullptr)
@@ -62,6 +91,11 @@ bool proc_remove_task(uint64_t process_id)
             {
                 proc_head = current->next;
             }
+            if (current == proc_last_normal) proc_last_normal = nullptr;
+            if (current == proc_last_idle) proc_last_idle = nullptr;
+
+            if (current->space != nullptr) address_space_free(current->space);
+            delete[] current->stack;
             delete current;
             proc_mtx.unlock();
             return true;
@@ -91,7 +125,9 @@ void proc_create_task(uint64_t prio, const char* name, void(*task_pointer)())
     kstd::memset(&proc.registers, 0, sizeof(decltype(proc.registers)));
 
     proc.registers.rip = reinterpret_cast<uint64_t>(task_pointer);
-    proc.registers.rsp = reinterpret_cast<uint64_t>(new uint8_t[4 * 4096]);
+    // The stack grows down from the end of its allocation, minus the slot a call would have left a return address in.
+    auto stack = new uint8_t[proc_stack_size];
+    proc.registers.rsp = reinterpret_cast<uint64_t>(stack + proc_stack_size) - sizeof(uint64_t);
     proc.registers.rflags = 0x200; // Enable interrupts.
     proc.registers.cr3 = vmm_read_cr3();
     proc.registers.cs = 0x8;
@@ -110,6 +146,81 @@ void proc_create_task(uint64_t prio, const char* name, void(*task_pointer)())
     proc_mtx.unlock();
 }
 
+// spawn(entry) -> PID of a new process running `entry` on a copy-on-write clone of the caller's address space,
+// -1 on failure. It runs in ring 0 on a kernel stack of its own: the lower half is copy-on-write in the clone,
+// and a fault on the stack it's running on has no other stack to go to.
+static void proc_sc_spawn([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    uint64_t entry = registers->rbx;
+    AddressSpace* space = address_space_current();
+
+    registers->rax = static_cast<uint64_t>(-1);
+
+    if (space == nullptr || space == address_space_kernel())
+    {
+        kstd::printf("[PROC] spawn(): the caller's address space can't be cloned.\n");
+        return;
+    }
+
+    auto stack = new uint8_t[proc_stack_size];
+    if (stack == nullptr) return;
+
+    AddressSpace* child = space->clone();
+    if (child == nullptr)
+    {
+        delete[] stack;
+        return;
+    }
+
+    const char* name = current_process != nullptr ? current_process->process_name : "spawned";
+    uint64_t prio = current_process != nullptr ? current_process->priority : PROC_PRIORITY_NORMAL;
+
+    process_t proc(proc_alloc_id(), name, {}, false, prio);
+
+    kstd::memset(&proc.registers, 0, sizeof(decltype(proc.registers)));
+
+    proc.registers.rip = entry;
+    // Same layout as proc_create_task(), the kernel half (and the stack with it) is mapped in the clone too.
+    proc.registers.rsp = reinterpret_cast<uint64_t>(stack + proc_stack_size) - sizeof(uint64_t);
+    proc.registers.rbp = proc.registers.rsp;
+    proc.registers.rflags = 0x200; // Enable interrupts.
+    proc.registers.cr3 = child->get_cr3();
+    proc.registers.cs = 0x8;
+    proc.registers.ds = 0x10;
+    proc.registers.ss = 0x10;
+    proc.registers.es = 0x10;
+    proc.registers.fs = 0x10;
+    proc.registers.gs = 0x10;
+    proc.space = child;
+    proc.stack = stack;
+
+    proc_add_task(proc);
+
+    registers->rax = proc.process_id;
+}
+
+// exit(code), doesn't return. The caller is switched away from right away, its address space is freed on a later switch.
+static void proc_sc_exit([[maybe_unused]] syscall_entry* this_, Registers_x86_64* registers)
+{
+    if (current_process == nullptr) return;
+
+    kstd::printf("[PROC] Process %lu (%s) exited with %ld.\n", current_process->process_id, current_process->process_name, static_cast<int64_t>(registers->rbx));
+
+    // The caller is in a syscall, it can't be holding the process list and the switch can't be skipped.
+    current_process->exited = true;
+    proc_scheduler(registers);
+}
+
+syscall_type syscall_entry proc_spawn_sce = {
+        .syscall_id = SYSCALL_SPAWN,
+        .syscall_function = &proc_sc_spawn
+};
+
+syscall_type syscall_entry proc_exit_sce = {
+        .syscall_id = SYSCALL_EXIT,
+        .syscall_function = &proc_sc_exit
+};
+
 void proc_print_all_processes()
 {
     kstd::printf("Processes: \n");
@@ -126,9 +237,52 @@ void proc_print_all_processes()
 }
 bool dirty_fix = false;
 
+// The process after `after` that is (or isn't) at idle priority, going round the list once. nullptr if there's none.
+static process_t* proc_next(process_t* after, bool idle)
+{
+    process_t* candidate = after;
+
+    for (process_t* step = proc_head; step != nullptr; step = step->next)
+    {
+        candidate = candidate != nullptr && candidate->next != nullptr ? candidate->next : proc_head;
+        if (!candidate->exited && (candidate->priority == PROC_PRIORITY_IDLE) == idle) return candidate;
+    }
+
+    return nullptr;
+}
+
+// Frees the processes that exited, except `running`: the tick came from it, so its CR3 is still loaded.
+static void proc_reap(process_t* running)
+{
+    process_t** link = &proc_head;
+
+    while (*link != nullptr)
+    {
+        process_t* proc = *link;
+
+        if (!proc->exited || proc == running)
+        {
+            link = &proc->next;
+            continue;
+        }
+
+        *link = proc->next;
+
+        if (proc == proc_last_normal) proc_last_normal = nullptr;
+        if (proc == proc_last_idle) proc_last_idle = nullptr;
+
+        if (proc->space != nullptr) address_space_free(proc->space);
+        delete[] proc->stack;
+        delete proc;
+    }
+}
+
 void proc_scheduler(Registers_x86_64* regs)
 {
-    proc_mtx.lock();
+    // The tick may have interrupted someone walking the list, they get to finish and the switch waits a tick.
+    if (!proc_mtx.try_lock()) return;
+
+    proc_reap(current_process);
 
     if (proc_head == nullptr)
     {
@@ -136,11 +290,11 @@ void proc_scheduler(Registers_x86_64* regs)
         return;
     }
 
-    if (current_process != nullptr)
+    if (current_process != nullptr && !current_process->exited)
     {
         // Save the current context (registers) of the running process
         current_process->registers.rip = regs->rip;
-        current_process->registers.orig_rsp = regs->rsp;
+        current_process->registers.rsp = regs->orig_rsp; // Where the interrupted code's stack was, not the handler's
         current_process->registers.rflags = regs->rflags;
         current_process->registers.cs = regs->cs;
         current_process->registers.ds = regs->ds;
@@ -166,19 +320,30 @@ void proc_scheduler(Registers_x86_64* regs)
         current_process->registers.cr3 = regs->cr3; // Save the CR3 register
     }
 
-    if (current_process == nullptr)
-    {
-        current_process = proc_head;
-    }
-    else
+    // Idle tasks get a tick now and then, everything else takes turns in between.
+    process_t* next = nullptr;
+    proc_ticks++;
+
+    if (proc_ticks % PROC_IDLE_PERIOD == 0) next = proc_next(proc_last_idle, true);
+    if (next == nullptr) next = proc_next(proc_last_normal, false);
+    if (next == nullptr) next = proc_next(proc_last_idle, true);
+
+    if (next == nullptr)
     {
-        current_process = current_process->next;
-        if (current_process == nullptr)
-        {
-            current_process = proc_head; // Loop back to the beginning of the list
-        }
+        proc_mtx.unlock();
+
+        // Nothing runnable, whoever got interrupted carries on. Unless it exited, then there's nothing to return to.
+        if (current_process == nullptr || !current_process->exited) return;
+
+        kstd::printf("[PROC] Process %lu exited and no process is left to run.\n", current_process->process_id);
+        unreachable();
     }
 
+    if (next->priority == PROC_PRIORITY_IDLE) proc_last_idle = next;
+    else proc_last_normal = next;
+
+    current_process = next;
+
     // Restore the context (registers) of the next process to run
     regs->rip = current_process->registers.rip;
     regs->orig_rsp = current_process->registers.rsp;
@@ -204,7 +369,7 @@ void proc_scheduler(Registers_x86_64* regs)
     regs->r13 = current_process->registers.r13;
     regs->r14 = current_process->registers.r14;
     regs->r15 = current_process->registers.r15;
-    regs->cr3 = current_process->registers.cr3; // Restore the CR3 register
+    regs->cr3 = pcid_switch_cr3(current_process->registers.cr3); // Restore the CR3 register, keeping the TLB if its PCID allows
 
     proc_mtx.unlock();
 }
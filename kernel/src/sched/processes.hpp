@@ -7,6 +7,12 @@
 
 #include <hal/x64/idt/idt.hpp>
 #include <kstd/kstring.hpp>
+#include <mm/address_space.hpp>
+
+#define PROC_PRIORITY_IDLE 0      // Gets every PROC_IDLE_PERIOD-th tick, or all of them if nothing else is there.
+#define PROC_PRIORITY_NORMAL 1
+
+#define PROC_IDLE_PERIOD 8
 
 struct process_t
 {
@@ -15,11 +21,14 @@ struct process_t
     Registers_x86_64 registers;
     bool is_being_processed;
     uint64_t priority;
+    AddressSpace* space; // Owned copy-on-write clone, nullptr for tasks running on the kernel's tables.
+    uint8_t* stack; // Owned kernel stack of a spawned process, freed with it.
+    bool exited; // Never runs again, freed with its space once the scheduler has switched away from it.
     process_t* next; // Pointer to the next process in the list
 
     // Constructor for convenience
     process_t(uint64_t id, const char* name, const Registers_x86_64& regs, bool is_proc, uint64_t pri)
-            : process_id(id), process_name(kstd::strdup(name)), registers(regs), is_being_processed(is_proc), priority(pri), next(nullptr) {}
+            : process_id(id), process_name(kstd::strdup(name)), registers(regs), is_being_processed(is_proc), priority(pri), space(nullptr), stack(nullptr), exited(false), next(nullptr) {}
 
     // Destructor to free allocated memory
     ~process_t() {
@@ -29,6 +38,7 @@ struct process_t
 
 process_t* proc_create_raw_process(const char* name, uint64_t prio);
 void proc_add_task(const process_t& proc);
+// The running process is only marked as exited, it goes with the next switch.
 bool proc_remove_task(uint64_t process_id);
 void proc_create_task(uint64_t prio, const char* name, void(*task_pointer)());
 void proc_print_all_processes();